@@ -0,0 +1,111 @@
+//文件名: bench/relax_bench.c
+//
+//描述: 这个程序测量sip/relax.h中松弛内核各个实现的速度, 并检查它们的结果与标量实现相同.
+//
+//用法: bench/relax_bench [目的节点数 [邻居数 [轮数]]]
+//每一轮模拟SIP的一次路由重新计算: 对每个邻居调用一次松弛内核. 输出每个实现每个(邻居, 目的节点)对的平均耗时.
+//用make bench编译, 它不属于all.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "constants.h"
+#include "../sip/relax.h"
+
+typedef struct result {
+    unsigned int *best, *any;
+    int *next;
+} result_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//用实现fn做一次完整的路由计算
+static void recompute(relax_fn *fn, result_t *r, unsigned int **via, const unsigned int *fd,
+                      const unsigned int *link, int nr_nbrs, unsigned int n)
+{
+    for (unsigned int d = 0; d < n; d++) {
+        r->best[d] = r->any[d] = INFINITE_COST;
+        r->next[d] = -1;
+    }
+    for (int i = 0; i < nr_nbrs; i++) {
+        fn(r->best, r->next, r->any, via[i], fd, link[i], i + 1, n);
+    }
+}
+
+static void result_alloc(result_t *r, unsigned int n)
+{
+    r->best = malloc(n * sizeof(*r->best));
+    r->any = malloc(n * sizeof(*r->any));
+    r->next = malloc(n * sizeof(*r->next));
+    if (r->best == NULL || r->any == NULL || r->next == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int n = argc > 1 ? atoi(argv[1]) : 4096;
+    int nr_nbrs = argc > 2 ? atoi(argv[2]) : 8;
+    int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+    if (n == 0 || nr_nbrs <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [nodes [neighbors [rounds]]]\n", argv[0]);
+        return 1;
+    }
+
+    // 随机的距离矢量, 其中大约十分之一不可达; 可行距离有一部分比邻居的距离还小
+    srand(1);
+    unsigned int **via = malloc(nr_nbrs * sizeof(*via));
+    unsigned int *link = malloc(nr_nbrs * sizeof(*link));
+    unsigned int *fd = malloc(n * sizeof(*fd));
+    for (int i = 0; i < nr_nbrs; i++) {
+        via[i] = malloc(n * sizeof(*via[i]));
+        link[i] = 1 + rand() % 10;
+        for (unsigned int d = 0; d < n; d++) {
+            via[i][d] = rand() % 10 == 0 ? INFINITE_COST : rand() % 200;
+        }
+    }
+    for (unsigned int d = 0; d < n; d++) {
+        fd[d] = rand() % 4 == 0 ? rand() % 200 : INFINITE_COST;
+    }
+
+    result_t ref, r;
+    result_alloc(&ref, n);
+    result_alloc(&r, n);
+    const relax_impl_t *scalar = NULL;
+    for (const relax_impl_t *impl = relax_impls; impl->name; impl++) {
+        if (strcmp(impl->name, "scalar") == 0) {
+            scalar = impl;
+        }
+    }
+    recompute(scalar->fn, &ref, via, fd, link, nr_nbrs, n);
+
+    printf("%u nodes, %d neighbors, %d rounds\n", n, nr_nbrs, rounds);
+    for (const relax_impl_t *impl = relax_impls; impl->name; impl++) {
+        if (!impl->supported()) {
+            printf("%-8s not supported\n", impl->name);
+            continue;
+        }
+        recompute(impl->fn, &r, via, fd, link, nr_nbrs, n);
+        if (memcmp(r.best, ref.best, n * sizeof(*r.best)) || memcmp(r.any, ref.any, n * sizeof(*r.any)) ||
+                memcmp(r.next, ref.next, n * sizeof(*r.next))) {
+            printf("%-8s MISMATCH\n", impl->name);
+            return 1;
+        }
+
+        double start = now_sec();
+        for (int k = 0; k < rounds; k++) {
+            recompute(impl->fn, &r, via, fd, link, nr_nbrs, n);
+        }
+        double elapsed = now_sec() - start;
+        printf("%-8s %8.3f ms/round %8.3f ns/entry\n", impl->name,
+               elapsed * 1e3 / rounds, elapsed * 1e9 / rounds / n / nr_nbrs);
+    }
+    return 0;
+}
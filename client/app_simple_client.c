@@ -2,7 +2,7 @@
 //
 //描述: 这是简单版本的客户端程序代码. 客户端首先连接到本地SIP进程, 然后它调用stcp_client_init()初始化STCP客户端. 
 //它通过两次调用stcp_client_sock()和stcp_client_connect()创建两个套接字并连接到服务器.
-//它然后通过这两个连接发送一段短的字符串给服务器. 经过一段时候后, 客户端调用stcp_client_disconnect()断开到服务器的连接.
+//它然后通过这两个连接发送一段短的字符串给服务器, 并从同一个连接接收服务器发回的字符串. 经过一段时候后, 客户端调用stcp_client_disconnect()断开到服务器的连接.
 //最后,客户端调用stcp_client_close()关闭套接字并断开到本地SIP进程的连接.
 
 //创建日期: 2015年
@@ -125,6 +125,17 @@ int main() {
 		log("send string:%s to connection 2",mydata2);
 	}
 
+	//接收服务器通过两个连接发回的字符串
+	char echo[7];
+	for(i=0;i<5;i++){
+		stcp_client_recv(sockfd, echo, 6);
+		log("recv echo:%s from connection 1",echo);
+	}
+	for(i=0;i<5;i++){
+		stcp_client_recv(sockfd2, echo, 7);
+		log("recv echo:%s from connection 2",echo);
+	}
+
 	//等待一段时间, 然后关闭连接
 	log("prepare to disconnect");
 	sleep(WAITTIME);
@@ -1,24 +1,26 @@
 //文件名: client/app_stress_client.c
 //
-//描述: 这是压力测试版本的客户端程序代码. 客户端首先连接到本地SIP进程, 然后它调用stcp_client_init()初始化STCP客户端. 
+//描述: 这是压力测试版本的客户端程序代码. 客户端首先连接到本地SIP进程, 然后它调用stcp_client_init_transport()初始化STCP客户端, 与SIP进程之间使用共享内存环. 
 //它通过调用stcp_client_sock()和stcp_client_connect()创建套接字并连接到服务器.
-//然后它读取文件sendthis.txt中的文本数据, 将文件的长度和文件数据发送给服务器. 经过一段时候后, 客户端调用stcp_client_disconnect()断开到服务器的连接.
+//然后它将文件sendthis.txt的长度发送给服务器, 再调用stcp_client_sendfile()发送文件数据. 经过一段时候后, 客户端调用stcp_client_disconnect()断开到服务器的连接.
 //最后,客户端调用stcp_client_close()关闭套接字并断开到本地SIP进程的连接.
 
 //创建日期: 2015年
 
-//输入: 无
+//输入: -v 使用基于时延的Vegas拥塞控制代替默认的Reno
 
 //输出: STCP客户端状态
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +28,7 @@
 #include <constants.h>
 #include "../topology/topology.h"
 #include "stcp_client.h"
+#include "shmring.h"
 
 //创建一个连接, 使用客户端端口号87和服务器端口号88. 
 #define CLIENTPORT1 87
@@ -65,7 +68,19 @@ void disconnectToSIP(int sip_conn) {
 	close(sip_conn);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+	int cc = CC_RENO;
+	int opt;
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		switch (opt) {
+		case 'v':
+			cc = CC_VEGAS;
+			break;
+		default:
+			panic("Usage: %s [-v]", argv[0]);
+		}
+	}
+
 	//用于丢包率的随机数种子
 	srand(time(NULL));
 
@@ -76,7 +91,10 @@ int main() {
 	}
 
 	//初始化stcp客户端
-	stcp_client_init(sip_conn);
+	//批量传输经过共享内存环, 每个段不再需要一次系统调用
+	if(stcp_client_init_transport(sip_conn, SHMCHAN_SHM)<0) {
+		panic("fail to set up the shared memory ring with SIP");
+	}
 	sleep(STARTDELAY);
 
 	char hostname[50];
@@ -94,25 +112,29 @@ int main() {
 	if(sockfd<0) {
 		panic("fail to create stcp client sock");
 	}
+	//批量传输使用选择重传, 丢包时只重传丢失的段
+	stcp_client_setopt(sockfd, STCP_OPT_SR, 1);
+	stcp_client_setopt(sockfd, STCP_OPT_WINDOW, STCP_MAX_WINDOW);
+	stcp_client_setopt(sockfd, STCP_OPT_CC, cc);
 	if(stcp_client_connect(sockfd,server_nodeID,SERVERPORT1)<0) {
 		panic("fail to connect to stcp server");
 	}
 	log("client connected to server, client port:%d, server port %d",CLIENTPORT1,SERVERPORT1);
 	
-	//获取sendthis.txt文件长度, 创建缓冲区并读取文件中的数据
-	FILE *f;
-	f = fopen("sendthis.txt","r");
-	assert(f!=NULL);
-	fseek(f,0,SEEK_END);
-	int fileLen = ftell(f);
-	fseek(f,0,SEEK_SET);
-	char *buffer = (char*)malloc(fileLen);
-	fread(buffer,fileLen,1,f);
-	fclose(f);
-	//首先发送文件长度, 然后发送整个文件.
+	//获取sendthis.txt文件长度. 文件数据由stcp_client_sendfile()直接从文件映射中发出, 不需要读进缓冲区
+	int fd = open("sendthis.txt", O_RDONLY);
+	assert(fd>=0);
+	struct stat st;
+	fstat(fd,&st);
+	int fileLen = st.st_size;
+	//首先发送文件长度, 然后发送整个文件. 塞住连接, 让4字节的长度和文件开头合并在同一个段中
+	stcp_client_setopt(sockfd, STCP_OPT_CORK, 1);
 	stcp_client_send(sockfd,&fileLen,sizeof(int));
-    stcp_client_send(sockfd, buffer, fileLen);
-	free(buffer);
+	if(stcp_client_sendfile(sockfd,fd,0,fileLen)<0) {
+		panic("fail to send file");
+	}
+	stcp_client_setopt(sockfd, STCP_OPT_CORK, 0);
+	close(fd);
 	//等待一段时间, 然后关闭连接.
 	log("prepare to disconnect");
 	sleep(WAITTIME);
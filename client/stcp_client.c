@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include "stcp_client.h"
+#include "shmring.h"
+#include "conntable.h"
+#include "epoch.h"
 #include "common.h"
 #include "../topology/topology.h"
 
@@ -55,8 +59,8 @@ static const char *state_to_s(const client_tcb_t *tcb)
     return client_state_s[tcb->state];
 }
 
-//tcb连接池
-static client_tcb_t *tcbs[MAX_TRANSPORT_CONNECTIONS];
+//连接表, 由套接字ID或进入段的(服务器节点, 服务器端口, 客户端端口)找到TCB
+static conntable_t *conns;
 
 //记录模拟网络层所使用的连接套接字
 static int son_connection;
@@ -64,64 +68,189 @@ static int son_connection;
 //记录seghandler线程的tid
 pthread_t handler_tid;
 
+//所有连接的数据段重传定时器都在这个时间轮中, SYN/FIN的重传超时由调用者在条件变量上限时等待
+static timerwheel_t *timers;
+
 void stcp_client_init(int conn)
 {
-    for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-        tcbs[i] = NULL;
+    if (stcp_client_init_transport(conn, SHMCHAN_SOCKET) < 0) {
+        warn("handshake with SIP failed");
+    }
+}
+
+int stcp_client_init_transport(int conn, int transport)
+{
+    // 环中的一条消息就是一个 sendseg_arg_t
+    shmchan_t *chan;
+    if (shmchan_offer(conn, transport, sizeof(sendseg_arg_t), STCP_SIP_RING_SLOTS, &chan) == -1) {
+        return -1;
+    }
+
+    if (conns == NULL && (conns = conntable_create()) == NULL) {
+        sys_panic("conntable_create");
+    }
+    log("client TCB table has been initialized.");
+
+    if (timers == NULL && (timers = timerwheel_create()) == NULL) {
+        sys_panic("timerwheel_create");
     }
-    log("client TCB pool has been initialized.");
 
     //启动接收网络层报文段的线程
     son_connection = conn;
     pthread_create(&handler_tid, NULL, seghandler, NULL);
-    log("seghandler started.");
+    log("seghandler started%s.", chan ? " with shared memory" : "");
+    return 1;
+}
+
+/**
+ * @brief 释放 TCB. 由 epoch_retire() 在 seghandler 不可能再看到这个 TCB 之后调用.
+ */
+static void free_tcb(void *arg)
+{
+    client_tcb_t *tcb = arg;
+    stream_free(&tcb->stream);
+    free(tcb->stateMutex);
+    free(tcb->stateCond);
+    free(tcb);
+}
+
+/**
+ * @brief 填写端口并把段发给服务器, 作为数据通路的 output 回调函数
+ */
+static void output(void *owner, seg_t *seg)
+{
+    client_tcb_t *tcb = owner;
+    seg->header.src_port = tcb->client_portNum;
+    seg->header.dest_port = tcb->server_portNum;
+    sip_sendseg(son_connection, tcb->server_nodeID, seg);
+}
+
+/**
+ * @brief 通过套接字 ID 找到 TCB 并增加它的引用计数, 无效或已经关闭时返回 NULL
+ *
+ * 引用计数在读临界区中增加, 这时连接表的引用还没有被丢弃, 所以 TCB 一定还活着.
+ * 之后 API 可以离开读临界区阻塞在数据通路上, 用完后调用 put_tcb().
+ */
+static client_tcb_t *get_tcb(int sockfd)
+{
+    epoch_enter();
+    client_tcb_t *tcb = conntable_get(conns, sockfd);
+    if (tcb) {
+        atomic_fetch_add(&tcb->refs, 1);
+    }
+    epoch_exit();
+    return tcb;
+}
+
+/**
+ * @brief 减少 TCB 的引用计数, 最后一个引用释放 TCB
+ *
+ * 连接表持有一个引用, stcp_client_close() 通过 epoch_retire() 丢弃它, 这样 seghandler 也不会再看到这个 TCB.
+ */
+static void put_tcb(void *arg)
+{
+    client_tcb_t *tcb = arg;
+    if (tcb && atomic_fetch_sub(&tcb->refs, 1) == 1) {
+        free_tcb(tcb);
+    }
 }
 
 // 创建一个客户端TCB条目, 返回套接字描述符
 //
-// 这个函数查找客户端TCB表以找到第一个NULL条目, 然后使用malloc()为该条目创建一个新的TCB条目.
+// 这个函数使用malloc()创建一个新的TCB条目, 并把它加入连接表.
 // 该TCB中的所有字段都被初始化. 例如, TCB state被设置为CLOSED，客户端端口被设置为函数调用参数client_port.
-// TCB表中条目的索引号应作为客户端的新套接字ID被这个函数返回, 它用于标识客户端的连接.
-// 如果TCB表中没有条目可用, 这个函数返回-1.
+// 连接表分配的套接字ID被这个函数返回, 它用于标识客户端的连接.
+// 如果连接表已满或内存不足, 这个函数返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
 int stcp_client_sock(unsigned int client_port)
 {
-    for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-        if (tcbs[i] == NULL) {
-            client_tcb_t *tcb = calloc(1, sizeof(*tcb));
-
-            tcb->client_portNum = client_port;
-            tcb->client_nodeID = topology_getMyNodeID();
-            tcb->server_portNum = (unsigned int)(-1);
-            tcb->state = CLOSED;
-
-            //init mutex
-            tcb->bufMutex = malloc(sizeof(*tcb->bufMutex));
-            pthread_mutex_init(tcb->bufMutex, NULL);
-            tcb->bufCond = malloc(sizeof(*tcb->bufCond));
-            pthread_cond_init(tcb->bufCond, NULL);
-
-            // init fields related to send
-            tcb->sendBufHead = NULL;
-            tcb->sendBufTail = NULL;
-            tcb->sendBufunSent = NULL;
-            tcb->next_seqNum = 0;
-            tcb->unAck_segNum = 0;
-            tcb->send_time = 0;
-
-            log("Assign socket %d to port %d", i, client_port);
-            tcbs[i] = tcb;
-
-            //socket num
-            return i;
+    client_tcb_t *tcb = calloc(1, sizeof(*tcb));
+    if (tcb == NULL) {
+        return -1;
+    }
+
+    tcb->client_portNum = client_port;
+    tcb->client_nodeID = topology_getMyNodeID();
+    tcb->server_portNum = (unsigned int)(-1);
+    tcb->state = CLOSED;
+    // 连接表持有的引用
+    tcb->refs = 1;
+
+    //init mutex
+    tcb->stateMutex = malloc(sizeof(*tcb->stateMutex));
+    pthread_mutex_init(tcb->stateMutex, NULL);
+    tcb->stateCond = malloc(sizeof(*tcb->stateCond));
+    cond_init_monotonic(tcb->stateCond);
+
+    // init the data path of both directions
+    if (stream_init(&tcb->stream, timers, output, tcb) == -1) {
+        free(tcb->stateMutex);
+        free(tcb->stateCond);
+        free(tcb);
+        return -1;
+    }
+
+    int sockfd = conntable_add(conns, tcb, client_port);
+    if (sockfd == -1) {
+        // 还没有加入连接表, 没有其他线程能看到它
+        free_tcb(tcb);
+        return -1;
+    }
+    log("Assign socket %d to port %d", sockfd, client_port);
+
+    // 让 SIP 进程把发往这个端口的段交给本进程
+    if (sip_regport(son_connection, client_port) == -1) {
+        warn("fail to register port %d", client_port);
+    }
+
+    //socket num
+    return sockfd;
+}
+
+static int setopt_tcb(client_tcb_t *tcb, int sockfd, int opt, int value)
+{
+    if (tcb != NULL && opt == STCP_OPT_CORK) {
+        stream_set_cork(&tcb->stream, value);
+        return 1;
+    }
+    if (tcb == NULL || tcb->state != CLOSED) {
+        log("Options of socket %d cannot be changed now", sockfd);
+        return -1;
+    }
+    switch (opt) {
+    case STCP_OPT_SR:
+        tcb->stream.sr = value != 0;
+        break;
+    case STCP_OPT_WINDOW:
+        if (value <= 0 || value > STCP_MAX_WINDOW) {
+            LOG(tcb, "invalid window size %d", value);
+            return -1;
         }
+        tcb->stream.window = value;
+        break;
+    case STCP_OPT_CC:
+        if (value < 0 || value >= CC_NR_ALGOS) {
+            LOG(tcb, "invalid congestion control algorithm %d", value);
+            return -1;
+        }
+        cc_init(&tcb->stream.cc, value);
+        break;
+    default:
+        LOG(tcb, "unknown option %d", opt);
+        return -1;
     }
+    return 1;
+}
 
-    //没有找到条目
-    return -1;
+int stcp_client_setopt(int sockfd, int opt, int value)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = setopt_tcb(tcb, sockfd, opt, value);
+    put_tcb(tcb);
+    return ret;
 }
 
 //发送报文
@@ -133,6 +262,7 @@ send_ctrl(client_tcb_t *tcb, unsigned short type)
         .header.dest_port = tcb->server_portNum,
         .header.length = 0,
         .header.type = type,
+        .header.rcv_win = stream_rcv_win(&tcb->stream),
     };
     if (sip_sendseg(son_connection, tcb->server_nodeID, &syn) == -1) {
         log("sending ctrl to %d:%d failed", tcb->server_nodeID, tcb->server_portNum);
@@ -142,6 +272,35 @@ send_ctrl(client_tcb_t *tcb, unsigned short type)
     }
 }
 
+/**
+ * @brief 发送 SYN
+ *
+ * 请求了非默认的选项时, 选项放在 SYN 的数据部分中. 默认的 SYN 不带数据, 与只支持 GBN 的服务器兼容.
+ */
+static int send_syn(client_tcb_t *tcb)
+{
+    if (!tcb->stream.sr && tcb->stream.window == GBN_WINDOW) {
+        return send_ctrl(tcb, SYN);
+    }
+    seg_t syn = {
+        .header.src_port = tcb->client_portNum,
+        .header.dest_port = tcb->server_portNum,
+        .header.length = sizeof(stcp_synopt_t),
+        .header.type = SYN,
+        .header.rcv_win = stream_rcv_win(&tcb->stream),
+    };
+    stcp_synopt_t opt = {
+        .flags = tcb->stream.sr ? STCP_SYNOPT_SR : 0,
+        .window = tcb->stream.window,
+    };
+    memcpy(syn.data, &opt, sizeof(opt));
+    if (sip_sendseg(son_connection, tcb->server_nodeID, &syn) == -1) {
+        log("sending SYN to %d:%d failed", tcb->server_nodeID, tcb->server_portNum);
+        return -1;
+    }
+    return 1;
+}
+
 // 连接STCP服务器
 //
 // 这个函数用于连接服务器. 它以套接字ID和服务器的端口号作为输入参数. 套接字ID用于找到TCB条目.
@@ -152,36 +311,43 @@ send_ctrl(client_tcb_t *tcb, unsigned short type)
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
-static void *timer(void *arg)
+/**
+ * @brief 等待 tcb 进入状态 state, 最多等待 ms 毫秒
+ * @return 进入了 state 返回 1, 超时返回 0
+ *
+ * seghandler 在 stateMutex 之下改变状态并广播 stateCond, 等待期间不占用 CPU.
+ */
+static int wait_state(client_tcb_t *tcb, unsigned int state, unsigned int ms)
 {
-    // thanks to http://stackoverflow.com/a/9799466/5164297
-    client_tcb_t *tcb = arg;
-    const unsigned short prev = tcb->state;
-    // TODO We need a lock!
-    if (prev != SYNSENT && prev != FINWAIT) {
-        LOG(tcb, "does not need to wait");
-        return arg;
-    }
-    LOG(tcb, "timer starts under %s", state_to_s(tcb));
-    if (select(0, NULL, NULL, NULL, &tcb->timeout) < 0) {
-        perror("select");
-    }
-    if (prev == tcb->state) {
-        LOG(tcb, "timer ends under the same state %s", state_to_s(tcb));
-        tcb->is_time_out = 1;  // Allow logs to keep sequence
-    } else {
-        LOG(tcb, "timer ends from %s to %s", client_state_s[prev], state_to_s(tcb));
+    struct timespec deadline = deadline_ms(ms);
+    pthread_mutex_lock(tcb->stateMutex);
+    while (tcb->state != state) {
+        if (pthread_cond_timedwait(tcb->stateCond, tcb->stateMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
     }
-    return arg;
+    int reached = tcb->state == state;
+    pthread_mutex_unlock(tcb->stateMutex);
+    return reached;
 }
 
 /**
- * @brief connect to a remote server
+ * @brief 在 stateMutex 之下改变状态, 唤醒 wait_state() 中的等待者
  */
-int stcp_client_connect(int sockfd, int nodeID, unsigned int server_port)
+static void set_state(client_tcb_t *tcb, unsigned int state)
 {
-    client_tcb_t *tcb = tcbs[sockfd];
+    pthread_mutex_lock(tcb->stateMutex);
+    tcb->state = state;
+    pthread_cond_broadcast(tcb->stateCond);
+    pthread_mutex_unlock(tcb->stateMutex);
+    stcp_poll_notify();
+}
 
+/**
+ * @brief connect to a remote server
+ */
+static int connect_tcb(client_tcb_t *tcb, int sockfd, int nodeID, unsigned int server_port)
+{
     if (tcb == NULL) {
         log("Invalid stcp socket %d", sockfd);
         return 0;
@@ -191,149 +357,157 @@ int stcp_client_connect(int sockfd, int nodeID, unsigned int server_port)
     } else {
         tcb->server_portNum = server_port;
         tcb->server_nodeID = nodeID;
-        tcb->state = SYNSENT;
+        // 此后只有来自这个服务器的段才交给这个连接
+        if (conntable_bind(conns, sockfd, nodeID, server_port) == -1) {
+            LOG(tcb, "cannot bind to %d:%u", nodeID, server_port);
+            return -1;
+        }
+        set_state(tcb, SYNSENT);
         LOG(tcb, "shifts into %s", state_to_s(tcb));
 
         for (int i = 0; i < SYN_MAX_RETRY; i++) {
-            if (send_ctrl(tcb, SYN) == -1) {
+            if (send_syn(tcb) == -1) {
                 // 连接断开，直接退出。
-                tcb->state = CLOSED;
                 break;
             }
 
-            tcb->timeout.tv_sec = SYN_TIMEOUT / 1000000000;
-            tcb->timeout.tv_usec = (SYN_TIMEOUT % 1000000000) / 1000000;
-            tcb->is_time_out = 0;
-
-            pthread_t tid;
-            pthread_create(&tid, NULL, timer, tcb);
-
-            while (tcb->state != CONNECTED && !tcb->is_time_out) {}
-            if (tcb->state == CONNECTED) {
-                LOG(tcb, "connection %d shifts into %s", sockfd, state_to_s(tcb));
+            unsigned int sent = clock_ms();
+            if (wait_state(tcb, CONNECTED, rto_get(&tcb->stream.rto))) {
+                // Karn 规则: 只有没有重传过的 SYN 才能得到 RTT 样本
+                if (i == 0) {
+                    rto_sample(&tcb->stream.rto, clock_ms() - sent);
+                }
+                LOG(tcb, "connection %d shifts into %s (rto %u ms)", sockfd, state_to_s(tcb), rto_get(&tcb->stream.rto));
                 return 1;
             } else {
                 LOG(tcb, "%s time out", state_to_s(tcb));
+                rto_backoff(&tcb->stream.rto);
             }
 
-            LOG(tcb, "oops, retry to send FIN");
+            LOG(tcb, "oops, retry to send SYN");
         }
         LOG(tcb, "Oops, syn failed");
+        // 回到CLOSED并解除与服务器的绑定, 这个套接字之后还可以再次连接
+        set_state(tcb, CLOSED);
+        conntable_bind(conns, sockfd, CONN_ANY, CONN_ANY);
         return -1;
     }
 }
 
-/**
- * 这个线程持续轮询发送缓冲区以触发超时事件. 如果发送缓冲区非空, 它应一直运行.
- * 如果(当前时间 - 第一个已发送但未被确认段的发送时间) > DATA_TIMEOUT, 就发生一次超时事件.
- * 当超时事件发生时, 重新发送所有已发送但未被确认段. 当发送缓冲区为空时, 这个线程将终止.
- */
-void *sendbuf_timer(void *arg)
+int stcp_client_connect(int sockfd, int nodeID, unsigned int server_port)
 {
-    client_tcb_t *tcb = arg;
-    LOG(tcb, "sendbuf_timer started");
-    for (;;) {
-        struct timeval tv = ns_to_tv(SENDBUF_POLLING_INTERVAL);
-        select(0, NULL, NULL, NULL, &tv);
-
-        pthread_mutex_lock(tcb->bufMutex);
-        segBuf_t *curr = tcb->sendBufHead;
-        for (; curr != tcb->sendBufunSent; curr = curr->next) {
-            // The time out for a data segment is smaller than the SENDBUF_POLLING_INTERVAL.
-            // Therefore we can assume that these data hasn't been acked.
-            LOG(tcb, "resends seq %d", curr->seg.header.seq_num);
-            sip_sendseg(son_connection, tcb->server_nodeID, &curr->seg);
-        }
-        for (; curr != NULL; curr = curr->next) {
-            sip_sendseg(son_connection, tcb->server_nodeID, &curr->seg);
-            tcb->sendBufunSent = tcb->sendBufunSent->next;
-        }
-        if (tcb->sendBufHead == NULL) {
-            LOG(tcb, "send buffer timer exits");
-            tcb->sendBufTail = NULL;
-            pthread_mutex_unlock(tcb->bufMutex);
-            return arg;
-        }
-        pthread_mutex_unlock(tcb->bufMutex);
-    }
-    return arg;
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = connect_tcb(tcb, sockfd, nodeID, server_port);
+    put_tcb(tcb);
+    return ret;
 }
 
 /**
  * @brief 发送数据给STCP服务器
  *
  * 这个函数使用套接字ID找到TCB表中的条目.
- * 然后它使用提供的数据创建segBuf, 将它附加到发送缓冲区链表中.
- * 如果发送缓冲区在插入数据之前为空, 一个名为sendbuf_timer的线程就会启动.
- * 每隔SENDBUF_ROLLING_INTERVAL时间查询发送缓冲区以检查是否有超时事件发生.
+ * 然后它把数据复制进发送缓冲区的字节环, 并在窗口(协商的窗口, 拥塞窗口和服务器通告的接收窗口)允许的范围内
+ * 把数据切成段立即发出, 其余的数据在收到确认后发出. 字节环满时, 这个函数阻塞直到确认腾出空间. 参见stream.h.
  * 这个函数在成功时返回1，否则返回-1.
  */
 int stcp_client_send(int sockfd, void *data, unsigned int length)
 {
-    client_tcb_t *tcb = tcbs[sockfd];
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
     if (tcb == NULL) {
         log(RED "The socket %d is invalid" NORMAL, sockfd);
-        return -1;
     } else if (tcb->state != CONNECTED) {
         LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
-        return -1;
+    } else {
+        ret = stream_send(&tcb->stream, data, length);
     }
+    put_tcb(tcb);
+    return ret;
+}
 
-    unsigned int rest_len = 0;
-    char *rest_data = NULL;
-    if (length > MAX_SEG_LEN) {
-        rest_len = length - MAX_SEG_LEN;
-        rest_data = (char *)data + MAX_SEG_LEN;
-        length = MAX_SEG_LEN;
+int stcp_client_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "The socket %d is invalid" NORMAL, sockfd);
+    } else if (tcb->state != CONNECTED) {
+        LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
+    } else {
+        ret = stream_sendv(&tcb->stream, iov, iovcnt);
     }
+    put_tcb(tcb);
+    return ret;
+}
 
-    // Send buffer can be set up without locking.
-    segBuf_t *sendbuf = calloc(1, sizeof(*sendbuf));
-    sendbuf->next = NULL;
-    sendbuf->sentTime = tcb->send_time;
-    sendbuf->seg.header.type = DATA;
-    sendbuf->seg.header.src_port = tcb->client_portNum;
-    sendbuf->seg.header.dest_port = tcb->server_portNum;
-    sendbuf->seg.header.length = length;
-    sendbuf->seg.header.seq_num = tcb->next_seqNum;
-    tcb->next_seqNum += length;
-    memcpy(sendbuf->seg.data, data, length);
-
-    checksum(&sendbuf->seg);
-
-    pthread_mutex_lock(tcb->bufMutex);
-    while (tcb->unAck_segNum == GBN_WINDOW) {
-        LOG(tcb, "wait window clear");
-        pthread_cond_wait(tcb->bufCond, tcb->bufMutex);
-        LOG(tcb, "wake up with unAck_segNum %d", tcb->unAck_segNum);
+int stcp_client_sendfile(int sockfd, int fd, off_t offset, size_t length)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "The socket %d is invalid" NORMAL, sockfd);
+    } else if (tcb->state != CONNECTED) {
+        LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
+    } else {
+        ret = stream_sendfile(&tcb->stream, fd, offset, length);
     }
-    LOG(tcb, "adds send buffer under window size %d", tcb->unAck_segNum);
-    tcb->unAck_segNum++;
-    if (tcb->sendBufTail == NULL) {
-        LOG(tcb, "This is the first send bufferd");
-        Assert(tcb->sendBufHead == NULL, "header should be NULL as tail is so.");  // This causes tail to be NULL.
-        Assert(tcb->sendBufunSent == NULL, "unsent should be NULL as tail is so");  // This one runs into NULL at first.
-        tcb->sendBufTail = sendbuf;
-        tcb->sendBufHead = tcb->sendBufTail;
-        tcb->sendBufunSent = tcb->sendBufHead;
-        pthread_t tid;
-        pthread_create(&tid, NULL, sendbuf_timer, tcb);
+    put_tcb(tcb);
+    return ret;
+}
+
+int stcp_client_send_some(int sockfd, void *data, unsigned int length)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "The socket %d is invalid" NORMAL, sockfd);
+    } else if (tcb->state != CONNECTED) {
+        LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
     } else {
-        tcb->sendBufTail->next = sendbuf;
-        tcb->sendBufTail = sendbuf;
-        if (tcb->sendBufunSent == NULL) {
-            LOG(tcb, "Send buffers are all sent but not acked yet");
-            Assert(tcb->sendBufHead, "header should not be NULL as tail is so");
-            tcb->sendBufunSent = sendbuf;
-        }
+        ret = stream_send_some(&tcb->stream, data, length);
     }
-    pthread_mutex_unlock(tcb->bufMutex);
+    put_tcb(tcb);
+    return ret;
+}
 
-    if (rest_len != 0) {
-        return stcp_client_send(sockfd, rest_data, rest_len);
+/**
+ * @brief 从接收缓冲区中取数据
+ * @param need 至少要有多少字节才返回
+ * @return 复制的字节数, 失败返回 -1
+ */
+static int recv_data(int sockfd, void *buf, unsigned int length, unsigned int need)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "The socket %d is invalid" NORMAL, sockfd);
+    } else if (tcb->state == CLOSED) {
+        LOG(tcb, "is under %s, and cannot receive data", state_to_s(tcb));
     } else {
-        return 1;
+        ret = stream_recv(&tcb->stream, buf, length, need);
     }
+    put_tcb(tcb);
+    return ret;
+}
+
+/**
+ * @brief 接收来自STCP服务器的数据
+ *
+ * 这个函数阻塞直到接收缓冲区中有 length 个字节, 它然后取走数据并返回1. 如果这个函数失败, 则返回-1.
+ */
+int stcp_client_recv(int sockfd, void *buf, unsigned int length)
+{
+    return recv_data(sockfd, buf, length, length) == -1 ? -1 : 1;
+}
+
+/**
+ * @brief 接收来自STCP服务器的数据, 有多少取多少
+ *
+ * 这个函数阻塞直到接收缓冲区非空, 然后取走最多 length 个字节, 返回取走的字节数. 如果这个函数失败, 则返回-1.
+ */
+int stcp_client_recv_some(int sockfd, void *buf, unsigned int length)
+{
+    return recv_data(sockfd, buf, length, length > 0 ? 1 : 0);
 }
 
 // 断开到STCP服务器的连接
@@ -346,10 +520,8 @@ int stcp_client_send(int sockfd, void *data, unsigned int length)
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
-int stcp_client_disconnect(int sockfd)
+static int disconnect_tcb(client_tcb_t *tcb, int sockfd)
 {
-    client_tcb_t *tcb = tcbs[sockfd];
-
     if (tcb == NULL) {
         log("Invalid stcp socket %d", sockfd);
         return 0;
@@ -358,109 +530,71 @@ int stcp_client_disconnect(int sockfd)
             sockfd, client_state_s[tcb->state]);
         return 0;
     } else {
-        while (tcb->sendBufHead != NULL) {}
-        tcb->state = FINWAIT;
+        // 等待发送缓冲区中的数据全部被确认
+        stream_drain(&tcb->stream);
+        set_state(tcb, FINWAIT);
         LOG(tcb, "shifts into %s", state_to_s(tcb));
 
         //设置等待时间
         for (int i = 0; i < FIN_MAX_RETRY; i++) {
             if (send_ctrl(tcb, FIN) == -1) {
                 // 连接断开，直接退出。
-                tcb->state = CLOSED;
                 break;
             }
 
-            tcb->timeout.tv_sec = FIN_TIMEOUT / 1000000000;
-            tcb->timeout.tv_usec = (FIN_TIMEOUT % 1000000000) / 1000000;
-            tcb->is_time_out = 0;
-
-            pthread_t tid;
-            pthread_create(&tid, NULL, timer, tcb);
-
-            while (tcb->state != CLOSED && !tcb->is_time_out) {}
-            if (tcb->state == CLOSED) {
+            if (wait_state(tcb, CLOSED, rto_get(&tcb->stream.rto))) {
                 LOG(tcb, "Socket %d shifts into %s", sockfd, state_to_s(tcb));
                 return 0;
             } else {
                 LOG(tcb, "%s time out", state_to_s(tcb));
+                rto_backoff(&tcb->stream.rto);
             }
 
             LOG(tcb, "oops, retry to send FIN");
         }
 
         log("Oops, failed to disconnect");
+        set_state(tcb, CLOSED);
         return -1;
     }
 }
 
+int stcp_client_disconnect(int sockfd)
+{
+    client_tcb_t *tcb = get_tcb(sockfd);
+    int ret = disconnect_tcb(tcb, sockfd);
+    put_tcb(tcb);
+    return ret;
+}
+
 // 关闭STCP客户
 //
-// 这个函数调用free()释放TCB条目. 它将该条目标记为NULL, 成功时(即位于正确的状态)返回1,
-// 失败时(即位于错误的状态)返回-1.
+// 这个函数把TCB条目移出连接表, 此后套接字ID不再有效. seghandler可能正在处理这个连接的段,
+// 所以连接表的引用通过epoch_retire()在它处理完之后才被丢弃. 其他线程可能还阻塞在这个套接字的API中,
+// stream_shutdown()唤醒它们, TCB在最后一个引用被丢弃时释放. 成功时返回0, 套接字ID无效时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
 int stcp_client_close(int sockfd)
 {
-    client_tcb_t *tcb = tcbs[sockfd];
-    LOG(tcb, "is to be closed");
-    tcbs[sockfd] = NULL;
-
-    pthread_mutex_lock(tcb->bufMutex);
-    while (tcb->sendBufHead) {
-        segBuf_t *tmp = tcb->sendBufHead;
-        tcb->sendBufHead = tcb->sendBufHead->next;
-        free(tmp);
+    client_tcb_t *tcb = conntable_remove(conns, sockfd);
+    if (tcb == NULL) {
+        log("Invalid stcp socket %d", sockfd);
+        return -1;
     }
-    tcb->sendBufHead = NULL;
-    tcb->sendBufTail = NULL;
-    tcb->sendBufunSent = NULL;
-    pthread_mutex_unlock(tcb->bufMutex);
-
-    free(tcb->bufMutex);
-    free(tcb->bufCond);
-    // We do not need to free sendBufTail and sendBufUnsent,
-    // as they should aside on the linked list started from starting from sendBufHead.
-    free(tcb);
-
+    stream_t *st = &tcb->stream;
+    LOG(tcb, "is to be closed (%u bytes sent, %u bytes resent, %u DATAACKs sent, %s cwnd %u ssthresh %u)",
+        st->bytes_sent, st->bytes_resent, st->nr_dataacks, cc_name(&st->cc), st->cc.cwnd, st->cc.ssthresh);
+    sip_unregport(son_connection, tcb->client_portNum);
+    // 之后重传定时器不再重新添加自己, seghandler也不再处理数据段
+    set_state(tcb, CLOSED);
+    stream_shutdown(st);
+    // 丢弃连接表的引用, 阻塞在 API 中的线程返回之后 TCB 才被释放
+    epoch_retire(tcb, put_tcb);
     return 0;
 }
 
-/**
- * @brief Modify send buffer list according to the DATAACK segment.
- * @param tcb The tcb to which the send buffer list belongs.
- * @param seg The DATAACK segment.
- *
- * Release all of the send buffers whose sequence number (a.k.a. the starting byte index) is less than
- * the DATAACK's sequence number (a.k.a. the expected sequence from server)
- */
-static void handle_dataack(client_tcb_t *tcb, seg_t *seg)
-{
-    // TODO Check seq
-    Assert(seg->header.type == DATAACK, "Unexpected data type for this handler.");
-    pthread_mutex_lock(tcb->bufMutex);
-    while (tcb->sendBufHead != tcb->sendBufunSent) {
-        //LOG(tcb, "buffered seq %d, expected seq %d", tcb->sendBufHead->seg.header.seq_num, seg->header.seq_num);
-        if (tcb->sendBufHead->seg.header.seq_num < seg->header.seq_num) {
-            segBuf_t *tmp = tcb->sendBufHead;
-            LOG(tcb, "release acked send buffer (seq num %d)", tmp->seg.header.seq_num);
-            tcb->sendBufHead = tcb->sendBufHead->next;
-            tcb->unAck_segNum--;
-            free(tmp);
-        } else {
-            break;
-        }
-    }
-    if (tcb->sendBufHead == NULL) {
-        tcb->sendBufTail = NULL;
-    }
-    if (tcb->unAck_segNum < GBN_WINDOW) {
-        pthread_cond_signal(tcb->bufCond);
-    }
-    pthread_mutex_unlock(tcb->bufMutex);
-}
-
 //客户端状态机
 static void client_fsm(client_tcb_t *tcb, seg_t *seg)
 {
@@ -471,8 +605,22 @@ static void client_fsm(client_tcb_t *tcb, seg_t *seg)
     case SYNSENT:
         switch (seg->header.type) {
         case SYNACK:
-            tcb->state = CONNECTED;
-            LOG(tcb, "enters %s state", state_to_s(tcb));
+            if (seg->header.length >= sizeof(stcp_synopt_t)) {
+                stcp_synopt_t opt;
+                memcpy(&opt, seg->data, sizeof(opt));
+                tcb->stream.sr = tcb->stream.sr && (opt.flags & STCP_SYNOPT_SR);
+                if (opt.window > 0 && opt.window < tcb->stream.window) {
+                    tcb->stream.window = opt.window;
+                }
+            } else {
+                // 服务器只支持 GBN
+                tcb->stream.sr = 0;
+                tcb->stream.window = GBN_WINDOW;
+            }
+            stream_set_peer_window(&tcb->stream, seg->header.rcv_win);
+            set_state(tcb, CONNECTED);
+            LOG(tcb, "enters %s state (%s, window %u)", state_to_s(tcb),
+                tcb->stream.sr ? "selective repeat" : "GBN", tcb->stream.window);
             break;
         default:
             LOG(tcb, "receives unexpect %s segment under %s",
@@ -481,26 +629,26 @@ static void client_fsm(client_tcb_t *tcb, seg_t *seg)
         break;
     case CONNECTED:
         switch (seg->header.type) {
+        case DATA:
         case DATAACK:
-            handle_dataack(tcb, seg);
+            stream_input(&tcb->stream, seg);
             break;
         case SYNACK:
             break;
         default:
-            panic(MAGENTA "tcb@%p" NORMAL " receives unexpected segment", tcb);
+            LOG(tcb, "receives unexpect %s segment under %s", seg_type_s(seg), client_state_s[CONNECTED]);
         }
         break;
     case FINWAIT:
         switch (seg->header.type) {
+        case DATA:
         case DATAACK:
-            // As stcp_client_send() is non-blocking, so the client may immediately get into FINWAIT state.
-            // This state won't stay long enough to handle all DATAACK in a high missing rate.
-            // If DATAACK segment is missed and a FINACK arrives, the client will release the send buffers,
-            // which may result in unexpected behaviors.
-            handle_dataack(tcb, seg);
+            // stcp_client_disconnect() drains the send buffer before FIN, but the acks of the data from the server
+            // and late duplicates still arrive in FINWAIT.
+            stream_input(&tcb->stream, seg);
             break;
         case FINACK:
-            tcb->state = CLOSED;
+            set_state(tcb, CLOSED);
             LOG(tcb, "returns %s", client_state_s[CLOSED]);
             break;
         default:
@@ -512,6 +660,46 @@ static void client_fsm(client_tcb_t *tcb, seg_t *seg)
     }
 }
 
+/**
+ * @brief 查询一个套接字当前就绪的事件, 作为 stcp_poll_wait() 的回调函数
+ *
+ * 调用 poll 的线程不一定拥有这个套接字, 所以在读临界区中访问 TCB.
+ */
+static short poll_query(int sockfd)
+{
+    short revents = STCP_POLLNVAL;
+    epoch_enter();
+    client_tcb_t *tcb = conntable_get(conns, sockfd);
+    if (tcb) {
+        revents = stream_poll(&tcb->stream);
+        if (tcb->state != CONNECTED) {
+            // 只有已经建立的连接可以发送数据
+            revents &= ~STCP_POLLOUT;
+        }
+    }
+    epoch_exit();
+    return revents;
+}
+
+int stcp_client_poll(stcp_pollfd_t *fds, int nfds, int timeout)
+{
+    return stcp_poll_wait(fds, nfds, timeout, poll_query);
+}
+
+int stcp_client_eventfd(void)
+{
+    return stcp_poll_eventfd();
+}
+
+/**
+ * @brief SON 断开时关闭数据通路, 唤醒阻塞在收发中的调用者, poll 报告 STCP_POLLHUP
+ */
+static void wake_closed(void *arg, void *unused)
+{
+    client_tcb_t *tcb = arg;
+    stream_shutdown(&tcb->stream);
+}
+
 // 处理进入段的线程
 //
 // 这是由stcp_client_init()启动的线程. 它处理所有来自服务器的进入段.
@@ -528,6 +716,9 @@ void *seghandler(void* arg)
             // 收到了模拟 SON 的 TCP 的断开连接请求。
             log("SON closed");
             son_connection = -1;
+            epoch_enter();
+            conntable_foreach(conns, wake_closed, NULL);
+            epoch_exit();
             break;
         } else if (result == 1) {
             // 丢包
@@ -542,12 +733,14 @@ void *seghandler(void* arg)
 
         log(">>> Receive %s segment from %d to %d", seg_type_s(&seg), seg.header.src_port, seg.header.dest_port);
 
-        for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-            if (tcbs[i] && tcbs[i]->client_portNum == seg.header.dest_port) {
-                client_fsm(tcbs[i], &seg);
-                break;  // efficiency!
-            }
+        // TCB 在 epoch_exit() 之前不会被 stcp_client_close() 释放
+        epoch_enter();
+        client_tcb_t *tcb = conntable_lookup(conns, src_id, seg.header.src_port, seg.header.dest_port);
+        if (tcb) {
+            client_fsm(tcb, &seg);
         }
+        epoch_exit();
+        epoch_poll();
 
         log("<<< Packet handling done");
     }
@@ -9,7 +9,12 @@
 #define STCPCLIENT_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "seg.h"
+#include "rto.h"
+#include "cc.h"
+#include "stream.h"
+#include "stcp_poll.h"
 
 //FSM中使用的客户端状态
 enum {
@@ -18,13 +23,6 @@ enum {
 #undef TOKEN
 };
 
-//在发送缓冲区链表中存储段的单元
-typedef struct segBuf {
-    seg_t seg;
-    unsigned int sentTime;
-    struct segBuf* next;
-} segBuf_t;
-
 //客户端传输控制块. 一个STCP连接的客户端使用这个数据结构记录连接信息.
 typedef struct client_tcb {
     unsigned int server_nodeID;        //服务器节点ID, 类似IP地址, 本实验未使用
@@ -32,18 +30,20 @@ typedef struct client_tcb {
     unsigned int client_nodeID;     //客户端节点ID, 类似IP地址, 本实验未使用
     unsigned int client_portNum;    //客户端端口号
     unsigned int state;     	//客户端状态
-    unsigned int next_seqNum;       //新段准备使用的下一个序号
-    pthread_mutex_t* bufMutex;      //发送缓冲区互斥量
-    unsigned int send_time;         // Record the send time, increased by sendTimer
-    segBuf_t* sendBufHead;          //发送缓冲区头
-    segBuf_t* sendBufunSent;        //发送缓冲区中的第一个未发送段
-    segBuf_t* sendBufTail;          //发送缓冲区尾
-    unsigned int unAck_segNum;      //已发送但未收到确认段的数量
-    int is_time_out;                // 记录超时事件
-    struct timeval timeout;         // 超时值
-    pthread_cond_t *bufCond;        // On unAck_segNum == GBN_WINDOW
+    pthread_mutex_t* stateMutex;    //保护state
+    pthread_cond_t *stateCond;      //state改变时广播, 与stateMutex一起使用
+    atomic_int refs;                //引用计数: 连接表一个, 每个正在执行的API调用一个, 减到0时释放
+    stream_t stream;                //两个方向的数据通路: 发送缓冲区, 接收缓冲区, 重传, 拥塞控制和流量控制. 参见stream.h
 } client_tcb_t;
 
+//stcp_client_setopt()可以设置的选项
+enum {
+    STCP_OPT_SR,                    //非0时请求使用选择重传, 默认使用GBN
+    STCP_OPT_WINDOW,                //请求的窗口大小, 单位为段, 默认为GBN_WINDOW
+    STCP_OPT_CC,                    //拥塞控制算法, CC_RENO或CC_VEGAS, 默认为CC_RENO. 参见cc.h
+    STCP_OPT_CORK,                  //非0时塞住连接, 只发送完整的段; 置0时立即发出剩余的数据. 连接建立之后也可以设置
+};
+
 //
 //
 //  用于客户端应用程序的STCP套接字API.
@@ -65,12 +65,31 @@ void stcp_client_init(int conn);
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
+int stcp_client_init_transport(int conn, int transport);
+
+// 同stcp_client_init(), 但由参数transport选择之后与SIP进程之间的段通过套接字(SHMCHAN_SOCKET)
+// 还是共享内存环(SHMCHAN_SHM)传递, 参见shmring.h. stcp_client_init()使用套接字.
+// 成功时返回1, 与SIP进程握手失败时返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
 int stcp_client_sock(unsigned int client_port);
 
-// 这个函数查找客户端TCB表以找到第一个NULL条目, 然后使用malloc()为该条目创建一个新的TCB条目.
+// 这个函数使用malloc()创建一个新的TCB条目, 并把它加入连接表(参见conntable.h).
 // 该TCB中的所有字段都被初始化. 例如, TCB state被设置为CLOSED，客户端端口被设置为函数调用参数client_port.
-// TCB表中条目的索引号应作为客户端的新套接字ID被这个函数返回, 它用于标识客户端的连接.
-// 如果TCB表中没有条目可用, 这个函数返回-1.
+// 连接表分配的套接字ID被这个函数返回, 它用于标识客户端的连接. 连接关闭之后这个ID不再有效, 也不会指向之后创建的连接.
+// 如果连接表已满或内存不足, 这个函数返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_setopt(int sockfd, int opt, int value);
+
+// 这个函数设置套接字sockfd的选项opt, 除STCP_OPT_CORK之外必须在stcp_client_connect()之前调用.
+// 窗口大小不能超过STCP_MAX_WINDOW. 请求的选项在SYN中发给服务器, 最终采用的值由服务器在SYNACK中决定.
+// 拥塞控制算法只影响发送方, 不需要与服务器协商.
+// 成功时返回1, 套接字无效, 不在CLOSED状态或选项不合法时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
@@ -87,7 +106,71 @@ int stcp_client_connect(int socked, int nodeID, unsigned int server_port);
 
 int stcp_client_send(int sockfd, void* data, unsigned int length);
 
-// 这个函数发送数据给STCP服务器. 你不需要在本实验中实现它。
+// 这个函数发送数据给STCP服务器. 数据被复制进发送缓冲区后在窗口允许时发出, 发送缓冲区满时阻塞.
+// 成功时返回1, 否则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_sendv(int sockfd, const struct iovec* iov, int iovcnt);
+
+// 这个函数把iov中的iovcnt个块依次发送给STCP服务器, 效果同按顺序调用stcp_client_send(), 但所有的块都写入
+// 发送缓冲区之后才切段发出, 相邻的小块(例如长度字段和随后的数据)合并在同一个段中. 发送缓冲区满时阻塞.
+// 成功时返回1, 否则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_sendfile(int sockfd, int fd, off_t offset, size_t length);
+
+// 这个函数把文件fd中从offset开始的length个字节发送给STCP服务器. 文件被映射进内存, 段直接从映射的页面组装,
+// 重传时也从映射中重新读取, 数据不会被复制进发送缓冲区, 发送任意大小的文件占用的内存都是固定的.
+// 这个函数阻塞直到数据全部被服务器确认. 成功时返回1, 范围超出文件或者发送失败时返回-1.
+// 发送期间不支持截短这个文件, 访问被截掉的页面会使进程收到SIGBUS.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_send_some(int sockfd, void* data, unsigned int length);
+
+// 同stcp_client_send(), 但不阻塞: 只把发送缓冲区放得下的部分复制进去, 返回复制的字节数, 发送缓冲区满时返回0.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_recv(int sockfd, void* buf, unsigned int length);
+
+// 这个函数接收来自STCP服务器的数据. 它阻塞直到接收缓冲区中有length个字节, 然后把它们复制到buf中并返回1.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_recv_some(int sockfd, void* buf, unsigned int length);
+
+// 同stcp_client_recv(), 但只阻塞到接收缓冲区中有数据为止, 然后复制最多length个字节到buf中, 返回复制的字节数.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_poll(stcp_pollfd_t* fds, int nfds, int timeout);
+
+// 这个函数等待fds中的任何一个套接字就绪, 参见stcp_poll.h. 它报告
+//   STCP_POLLIN: 接收缓冲区中有数据, stcp_client_recv_some()不会阻塞;
+//   STCP_POLLOUT: 连接已经建立且发送缓冲区中有空间, stcp_client_send_some()不会阻塞;
+//   STCP_POLLHUP: 与SIP进程的连接已经断开, 数据通路被关闭;
+//   STCP_POLLNVAL: 套接字无效或者已经关闭.
+// timeout是毫秒数, 为-1时一直等待. 返回就绪的套接字数, 超时返回0.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_client_eventfd(void);
+
+// 这个函数返回一个eventfd, 任何套接字的就绪条件可能变化时它变为可读. 应用程序可以把它加入自己的epoll,
+// 它可读时用超时0调用stcp_client_poll(), poll会清空它. 失败时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
@@ -104,8 +187,7 @@ int stcp_client_disconnect(int sockfd);
 
 int stcp_client_close(int sockfd);
 
-// 这个函数调用free()释放TCB条目. 它将该条目标记为NULL, 成功时(即位于正确的状态)返回1,
-// 失败时(即位于错误的状态)返回-1.
+// 这个函数把TCB条目移出连接表, TCB在seghandler不再使用它之后才被释放. 成功时返回0, 套接字ID无效时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
@@ -0,0 +1,200 @@
+//文件名: common/cc.c
+//
+//描述: 这个文件实现STCP发送方的拥塞控制, 参见cc.h.
+
+#include <stddef.h>
+#include "cc.h"
+#include "constants.h"
+
+static void cwnd_inc(cc_t *cc, unsigned int n)
+{
+    cc->cwnd += n;
+    if (cc->cwnd > STCP_MAX_WINDOW) {
+        cc->cwnd = STCP_MAX_WINDOW;
+    }
+}
+
+/*
+ * Reno: 慢启动阶段每确认一个段cwnd加1, 拥塞避免阶段每确认一个窗口的段cwnd加1, 丢包后ssthresh减半.
+ */
+
+static void reno_init(cc_t *cc)
+{
+    (void)cc;
+}
+
+static void reno_cong_avoid(cc_t *cc, unsigned int nr_acked)
+{
+    if (cc->cwnd < cc->ssthresh) {
+        cwnd_inc(cc, nr_acked);
+        return;
+    }
+    cc->acked += nr_acked;
+    if (cc->acked >= cc->cwnd) {
+        cc->acked -= cc->cwnd;
+        cwnd_inc(cc, 1);
+    }
+}
+
+static unsigned int reno_ssthresh(cc_t *cc)
+{
+    return cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+}
+
+/*
+ * Vegas: 每一轮窗口比较期望吞吐率cwnd / base_rtt和实际吞吐率cwnd / min_rtt,
+ * 两者之差乘以base_rtt就是积压在路径队列中的段数diff.
+ * diff < VEGAS_ALPHA时cwnd加1, diff > VEGAS_BETA时cwnd减1; 慢启动阶段diff > VEGAS_GAMMA时提前结束慢启动.
+ * 路径上的排队时延一开始增长就让出带宽, 多条流共享一条链路时不会靠丢包来发现拥塞.
+ */
+
+static void vegas_init(cc_t *cc)
+{
+    cc->base_rtt = 0;
+    cc->min_rtt = 0;
+}
+
+static void vegas_rtt_sample(cc_t *cc, unsigned int rtt)
+{
+    if (cc->base_rtt == 0 || rtt < cc->base_rtt) {
+        cc->base_rtt = rtt;
+    }
+    if (cc->min_rtt == 0 || rtt < cc->min_rtt) {
+        cc->min_rtt = rtt;
+    }
+}
+
+static void vegas_cong_avoid(cc_t *cc, unsigned int nr_acked)
+{
+    if (cc->cwnd < cc->ssthresh) {
+        cwnd_inc(cc, nr_acked);
+    }
+    cc->acked += nr_acked;
+    if (cc->acked < cc->cwnd) {
+        return;
+    }
+    // 一轮窗口结束
+    cc->acked = 0;
+    if (cc->min_rtt == 0) {
+        // 这一轮没有可用的样本(都被重传过), 按照 Reno 增长
+        if (cc->cwnd >= cc->ssthresh) {
+            cwnd_inc(cc, 1);
+        }
+        return;
+    }
+    unsigned int diff = cc->cwnd * (cc->min_rtt - cc->base_rtt) / cc->min_rtt;
+    cc->min_rtt = 0;
+    if (cc->cwnd < cc->ssthresh) {
+        if (diff > VEGAS_GAMMA) {
+            cc->ssthresh = cc->cwnd;
+        }
+    } else if (diff < VEGAS_ALPHA) {
+        cwnd_inc(cc, 1);
+    } else if (diff > VEGAS_BETA && cc->cwnd > 2) {
+        cc->cwnd--;
+    }
+}
+
+static unsigned int vegas_ssthresh(cc_t *cc)
+{
+    cc->min_rtt = 0;
+    return reno_ssthresh(cc);
+}
+
+static const cc_ops_t cc_algos[CC_NR_ALGOS] = {
+    [CC_RENO] = {
+        .name = "reno",
+        .init = reno_init,
+        .cong_avoid = reno_cong_avoid,
+        .ssthresh = reno_ssthresh,
+        .rtt_sample = NULL,
+    },
+    [CC_VEGAS] = {
+        .name = "vegas",
+        .init = vegas_init,
+        .cong_avoid = vegas_cong_avoid,
+        .ssthresh = vegas_ssthresh,
+        .rtt_sample = vegas_rtt_sample,
+    },
+};
+
+void cc_init(cc_t *cc, int algo)
+{
+    if (algo < 0 || algo >= CC_NR_ALGOS) {
+        algo = CC_RENO;
+    }
+    cc->ops = &cc_algos[algo];
+    cc->cwnd = CC_INIT_CWND;
+    cc->ssthresh = STCP_MAX_WINDOW;
+    cc->acked = 0;
+    cc->last_ack = 0;
+    cc->dupacks = 0;
+    cc->in_recovery = 0;
+    cc->recover = 0;
+    cc->ops->init(cc);
+}
+
+const char *cc_name(const cc_t *cc)
+{
+    return cc->ops->name;
+}
+
+int cc_on_ack(cc_t *cc, unsigned int ack, unsigned int nr_acked)
+{
+    cc->last_ack = ack;
+    cc->dupacks = 0;
+    if (cc->in_recovery) {
+        if ((int)(ack - cc->recover) < 0) {
+            // 部分确认: 下一个丢失的段也要立即重传, 按确认的段数收缩膨胀的窗口
+            cc->cwnd = cc->cwnd > nr_acked ? cc->cwnd - nr_acked + 1 : 1;
+            return 1;
+        }
+        cc->in_recovery = 0;
+        cc->cwnd = cc->ssthresh;
+        cc->acked = 0;
+        return 0;
+    }
+    cc->ops->cong_avoid(cc, nr_acked);
+    return 0;
+}
+
+int cc_on_dupack(cc_t *cc, unsigned int ack, int in_flight, unsigned int next_seq)
+{
+    if (ack != cc->last_ack) {
+        return 0;  // 乱序到达的旧确认
+    }
+    if (!in_flight) {
+        cc->dupacks = 0;
+        return 0;
+    }
+    if (cc->in_recovery) {
+        // 每个重复确认表示有一个段离开了网络, 允许再发送一个新段
+        cwnd_inc(cc, 1);
+        return 0;
+    }
+    if (++cc->dupacks < CC_DUPACK_THRESH) {
+        return 0;
+    }
+    cc->ssthresh = cc->ops->ssthresh(cc);
+    cc->cwnd = cc->ssthresh + CC_DUPACK_THRESH;
+    cc->in_recovery = 1;
+    cc->recover = next_seq;
+    cc->dupacks = 0;
+    return 1;
+}
+
+void cc_on_timeout(cc_t *cc)
+{
+    cc->ssthresh = cc->ops->ssthresh(cc);
+    cc->cwnd = 1;
+    cc->acked = 0;
+    cc->dupacks = 0;
+    cc->in_recovery = 0;
+}
+
+void cc_on_rtt(cc_t *cc, unsigned int rtt)
+{
+    if (cc->ops->rtt_sample) {
+        cc->ops->rtt_sample(cc, rtt);
+    }
+}
@@ -0,0 +1,70 @@
+//文件名: common/cc.h
+//
+//描述: 这个文件定义STCP发送方的拥塞控制.
+//
+//每个连接维护一个拥塞窗口cwnd(单位为段), 发送方已发送但未被确认的段数不能超过min(cwnd, 协商的窗口).
+//通用部分实现慢启动的阈值ssthresh, 重复确认计数, 快速重传和快速恢复(NewReno式的部分确认处理)以及超时后的窗口收缩.
+//具体的算法通过cc_ops_t操作表接入, 只决定拥塞避免阶段如何增长窗口, 丢包后ssthresh取多少, 以及如何使用RTT样本.
+//目前提供基于丢包的Reno(CC_RENO)和基于时延的Vegas(CC_VEGAS)两种算法, 在套接字创建后连接之前用stcp_client_setopt()选择.
+
+#ifndef CC_H
+#define CC_H
+
+//可以选择的拥塞控制算法
+enum {
+    CC_RENO,
+    CC_VEGAS,
+    CC_NR_ALGOS,
+};
+
+struct cc;
+
+//拥塞控制算法的操作表
+typedef struct cc_ops {
+    const char* name;
+    //初始化算法私有的状态
+    void (*init)(struct cc* cc);
+    //不在快速恢复中时, 收到确认了nr_acked个新段的确认后调用, 负责增长cwnd
+    void (*cong_avoid)(struct cc* cc, unsigned int nr_acked);
+    //检测到丢包(超时或快速重传)时调用, 返回新的ssthresh
+    unsigned int (*ssthresh)(struct cc* cc);
+    //得到一个RTT样本时调用(按照Karn规则, 不来自重传过的段), 可以为NULL
+    void (*rtt_sample)(struct cc* cc, unsigned int rtt);
+} cc_ops_t;
+
+//一个连接的拥塞控制状态
+typedef struct cc {
+    const cc_ops_t* ops;
+    unsigned int cwnd;              //拥塞窗口, 单位为段
+    unsigned int ssthresh;          //慢启动阈值, 单位为段
+    unsigned int acked;             //拥塞避免阶段累计确认的段数, 满一个窗口时cwnd加1
+    unsigned int last_ack;          //最近一次收到的确认号
+    unsigned int dupacks;           //连续的重复确认数
+    int in_recovery;                //是否处于快速恢复中
+    unsigned int recover;           //进入快速恢复时已发送的最大序号, 确认号越过它时退出快速恢复
+    //以下字段由Vegas使用
+    unsigned int base_rtt;          //观察到的最小RTT, 为0表示还没有样本
+    unsigned int min_rtt;           //当前这一轮窗口中观察到的最小RTT
+} cc_t;
+
+//这个函数用算法algo初始化拥塞控制状态. algo不合法时使用Reno.
+void cc_init(cc_t* cc, int algo);
+
+//返回算法的名字.
+const char* cc_name(const cc_t* cc);
+
+//收到确认号为ack, 确认了nr_acked个新段的确认时调用.
+//如果处于快速恢复中且这是一个部分确认(没有越过recover), 返回1, 调用者应立即重传第一个未被确认的段.
+int cc_on_ack(cc_t* cc, unsigned int ack, unsigned int nr_acked);
+
+//收到没有确认任何新段的确认时调用, in_flight表示是否还有已发送但未被确认的段, next_seq是下一个新段将使用的序号.
+//第CC_DUPACK_THRESH个重复确认时进入快速恢复并返回1, 调用者应立即重传第一个未被确认的段.
+int cc_on_dupack(cc_t* cc, unsigned int ack, int in_flight, unsigned int next_seq);
+
+//发生重传超时时调用. cwnd收缩为1, 退出快速恢复.
+void cc_on_timeout(cc_t* cc);
+
+//加入一个RTT样本, 单位为毫秒.
+void cc_on_rtt(cc_t* cc, unsigned int rtt);
+
+#endif
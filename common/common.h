@@ -4,6 +4,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 // Terminology according to
 // https://en.wikipedia.org/wiki/ANSI_escape_code#Sequence_elements
@@ -28,6 +29,48 @@ static inline const char *timestamp(char *s, size_t max)
     return s;
 }
 
+/**
+ * @brief 单调时钟的当前时间, 单位为毫秒
+ *
+ * 返回值会回绕, 只能用无符号减法比较两个时刻.
+ */
+static inline unsigned int clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * @brief 初始化一个使用单调时钟的条件变量
+ *
+ * 这样的条件变量配合 deadline_ms() 做限时等待, 不受系统时间调整的影响.
+ */
+static inline void cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief ms 毫秒之后的单调时钟时刻, 作为 pthread_cond_timedwait() 的截止时间
+ */
+static inline struct timespec deadline_ms(unsigned int ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
 /**
  * @brief 报告系统错误，并退出程序
  * @param msg 传递给 perror 的消息字符串
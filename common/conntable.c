@@ -0,0 +1,280 @@
+//文件名: common/conntable.c
+//
+//描述: 这个文件实现STCP的连接表, 参见conntable.h.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "conntable.h"
+#include "epoch.h"
+#include "constants.h"
+
+#define CONN_IDX_MASK ((1U << CONN_IDX_BITS) - 1)
+#define CONN_GEN_MASK ((1U << (31 - CONN_IDX_BITS)) - 1)
+
+static unsigned int key_hash(const conn_key_t *key)
+{
+    uint32_t h = key->node * 0x9e3779b1u;
+    h = (h ^ key->rport) * 0x85ebca6bu;
+    h = (h ^ key->lport) * 0xc2b2ae35u;
+    return h ^ (h >> 16);
+}
+
+static int key_equal(const conn_key_t *a, const conn_key_t *b)
+{
+    return a->node == b->node && a->rport == b->rport && a->lport == b->lport;
+}
+
+static void free_hash(void *arg)
+{
+    conn_hash_t *hash = arg;
+    for (unsigned int i = 0; i < hash->nr_buckets; i++) {
+        conn_entry_t *e = hash->buckets[i];
+        while (e) {
+            conn_entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(hash);
+}
+
+static conn_hash_t *alloc_hash(unsigned int nr_buckets)
+{
+    conn_hash_t *hash = calloc(1, sizeof(*hash) + nr_buckets * sizeof(hash->buckets[0]));
+    if (hash) {
+        hash->nr_buckets = nr_buckets;
+    }
+    return hash;
+}
+
+static conn_slots_t *alloc_slots(unsigned int nr_slots, const conn_slots_t *old)
+{
+    conn_slots_t *slots = calloc(1, sizeof(*slots) + nr_slots * sizeof(slots->slots[0]));
+    if (slots == NULL) {
+        return NULL;
+    }
+    slots->nr_slots = nr_slots;
+    unsigned int i = 0;
+    if (old) {
+        for (; i < old->nr_slots; i++) {
+            slots->slots[i] = old->slots[i];
+        }
+    }
+    // 新的槽按下标顺序串成空闲链表
+    for (; i < nr_slots; i++) {
+        slots->slots[i].next_free = i + 1 < nr_slots ? i + 1 : CONN_ANY;
+    }
+    return slots;
+}
+
+//把一个连接放入散列表的桶中. 节点先完整地初始化, 再发布到桶头, 读者总是看到完整的节点.
+static void bucket_push(conn_hash_t *hash, const conn_key_t *key, void *tcb, conn_entry_t *e)
+{
+    conn_entry_t *_Atomic *bucket = &hash->buckets[key_hash(key) & (hash->nr_buckets - 1)];
+    e->key = *key;
+    e->tcb = tcb;
+    atomic_store_explicit(&e->next, atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(bucket, e, memory_order_release);
+}
+
+//散列表加倍. 读者可能还在旧表中查找, 所以把节点复制到新表中, 旧表整个交给epoch回收.
+static int hash_grow(conntable_t *ct)
+{
+    conn_hash_t *old = ct->hash;
+    conn_hash_t *hash = alloc_hash(old->nr_buckets * 2);
+    if (hash == NULL) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < old->nr_buckets; i++) {
+        for (conn_entry_t *e = old->buckets[i]; e != NULL; e = e->next) {
+            conn_entry_t *copy = malloc(sizeof(*copy));
+            if (copy == NULL) {
+                free_hash(hash);
+                return -1;
+            }
+            bucket_push(hash, &e->key, e->tcb, copy);
+        }
+    }
+    atomic_store_explicit(&ct->hash, hash, memory_order_release);
+    epoch_retire(old, free_hash);
+    return 0;
+}
+
+static int hash_insert(conntable_t *ct, const conn_key_t *key, void *tcb)
+{
+    if (ct->nr_conns >= ct->hash->nr_buckets && hash_grow(ct) == -1) {
+        return -1;
+    }
+    conn_entry_t *e = malloc(sizeof(*e));
+    if (e == NULL) {
+        return -1;
+    }
+    bucket_push(ct->hash, key, tcb, e);
+    return 0;
+}
+
+//把(key, tcb)的节点从散列表中摘下. 正在遍历这个节点的读者仍然能通过它的next继续, 节点由epoch回收.
+static void hash_remove(conntable_t *ct, const conn_key_t *key, void *tcb)
+{
+    conn_hash_t *hash = ct->hash;
+    conn_entry_t *_Atomic *pp = &hash->buckets[key_hash(key) & (hash->nr_buckets - 1)];
+    for (conn_entry_t *e = *pp; e != NULL; pp = &e->next, e = *pp) {
+        if (e->tcb == tcb && key_equal(&e->key, key)) {
+            atomic_store_explicit(pp, e->next, memory_order_release);
+            epoch_retire(e, free);
+            return;
+        }
+    }
+}
+
+//返回套接字ID对应的槽, 无效时返回NULL. 调用者持有锁.
+static conn_slot_t *slot_of(conntable_t *ct, int sockfd)
+{
+    if (sockfd < 0 || (sockfd & CONN_IDX_MASK) >= ct->slots->nr_slots) {
+        return NULL;
+    }
+    conn_slot_t *slot = &ct->slots->slots[sockfd & CONN_IDX_MASK];
+    if (slot->tcb == NULL || (slot->gen & CONN_GEN_MASK) != (unsigned int)sockfd >> CONN_IDX_BITS) {
+        return NULL;
+    }
+    return slot;
+}
+
+conntable_t *conntable_create(void)
+{
+    conntable_t *ct = calloc(1, sizeof(*ct));
+    if (ct == NULL) {
+        return NULL;
+    }
+    ct->hash = alloc_hash(CONNTABLE_INIT_SIZE);
+    ct->slots = alloc_slots(CONNTABLE_INIT_SIZE, NULL);
+    if (ct->hash == NULL || ct->slots == NULL) {
+        free(ct->hash);
+        free(ct->slots);
+        free(ct);
+        return NULL;
+    }
+    pthread_mutex_init(&ct->lock, NULL);
+    ct->free_head = 0;
+    return ct;
+}
+
+int conntable_add(conntable_t *ct, void *tcb, unsigned int lport)
+{
+    int sockfd = -1;
+    pthread_mutex_lock(&ct->lock);
+    if (ct->free_head == CONN_ANY) {
+        // 槽用完了, 加倍. 旧数组可能还在被读者访问, 交给epoch回收
+        conn_slots_t *old = ct->slots;
+        if (old->nr_slots > CONN_IDX_MASK) {
+            goto out;
+        }
+        conn_slots_t *slots = alloc_slots(old->nr_slots * 2, old);
+        if (slots == NULL) {
+            goto out;
+        }
+        ct->free_head = old->nr_slots;
+        atomic_store_explicit(&ct->slots, slots, memory_order_release);
+        epoch_retire(old, free);
+    }
+    conn_key_t key = { CONN_ANY, CONN_ANY, lport };
+    if (hash_insert(ct, &key, tcb) == -1) {
+        goto out;
+    }
+    unsigned int idx = ct->free_head;
+    conn_slot_t *slot = &ct->slots->slots[idx];
+    ct->free_head = slot->next_free;
+    slot->key = key;
+    atomic_store_explicit(&slot->tcb, tcb, memory_order_release);
+    ct->nr_conns++;
+    sockfd = (slot->gen & CONN_GEN_MASK) << CONN_IDX_BITS | idx;
+out:
+    pthread_mutex_unlock(&ct->lock);
+    return sockfd;
+}
+
+int conntable_bind(conntable_t *ct, int sockfd, unsigned int node, unsigned int rport)
+{
+    int ret = -1;
+    pthread_mutex_lock(&ct->lock);
+    conn_slot_t *slot = slot_of(ct, sockfd);
+    if (slot != NULL) {
+        conn_key_t key = { node, rport, slot->key.lport };
+        // 先登记新键再摘下旧键, 中间到达的段总能找到这个连接
+        if (hash_insert(ct, &key, slot->tcb) == 0) {
+            hash_remove(ct, &slot->key, slot->tcb);
+            slot->key = key;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&ct->lock);
+    return ret;
+}
+
+void *conntable_remove(conntable_t *ct, int sockfd)
+{
+    void *tcb = NULL;
+    pthread_mutex_lock(&ct->lock);
+    conn_slot_t *slot = slot_of(ct, sockfd);
+    if (slot != NULL) {
+        tcb = slot->tcb;
+        hash_remove(ct, &slot->key, tcb);
+        // 先清空再换代: 读者看到新的代数时一定也看到了NULL
+        atomic_store(&slot->tcb, NULL);
+        atomic_store(&slot->gen, slot->gen + 1);
+        slot->next_free = ct->free_head;
+        ct->free_head = sockfd & CONN_IDX_MASK;
+        ct->nr_conns--;
+    }
+    pthread_mutex_unlock(&ct->lock);
+    return tcb;
+}
+
+void *conntable_get(conntable_t *ct, int sockfd)
+{
+    conn_slots_t *slots = atomic_load_explicit(&ct->slots, memory_order_acquire);
+    if (sockfd < 0 || (sockfd & CONN_IDX_MASK) >= slots->nr_slots) {
+        return NULL;
+    }
+    conn_slot_t *slot = &slots->slots[sockfd & CONN_IDX_MASK];
+    // 先读TCB再读代数: 槽被复用时代数在新TCB之前改变
+    void *tcb = atomic_load(&slot->tcb);
+    if (tcb == NULL || (atomic_load(&slot->gen) & CONN_GEN_MASK) != (unsigned int)sockfd >> CONN_IDX_BITS) {
+        return NULL;
+    }
+    return tcb;
+}
+
+static void *hash_find(conn_hash_t *hash, const conn_key_t *key)
+{
+    conn_entry_t *e = atomic_load_explicit(&hash->buckets[key_hash(key) & (hash->nr_buckets - 1)], memory_order_acquire);
+    for (; e != NULL; e = atomic_load_explicit(&e->next, memory_order_acquire)) {
+        if (key_equal(&e->key, key)) {
+            return e->tcb;
+        }
+    }
+    return NULL;
+}
+
+void *conntable_lookup(conntable_t *ct, unsigned int node, unsigned int rport, unsigned int lport)
+{
+    conn_hash_t *hash = atomic_load_explicit(&ct->hash, memory_order_acquire);
+    conn_key_t key = { node, rport, lport };
+    void *tcb = hash_find(hash, &key);
+    if (tcb == NULL) {
+        key.node = key.rport = CONN_ANY;
+        tcb = hash_find(hash, &key);
+    }
+    return tcb;
+}
+
+void conntable_foreach(conntable_t *ct, void (*fn)(void *tcb, void *arg), void *arg)
+{
+    conn_slots_t *slots = atomic_load_explicit(&ct->slots, memory_order_acquire);
+    for (unsigned int i = 0; i < slots->nr_slots; i++) {
+        void *tcb = atomic_load(&slots->slots[i].tcb);
+        if (tcb) {
+            fn(tcb, arg);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+//文件名: common/conntable.h
+//
+//描述: 这个文件定义STCP的连接表.
+//
+//连接表把套接字ID和进入的段映射到TCB, 两种查找都是O(1)的, 与连接数无关:
+//  套接字ID由槽数组的下标和一个代数(generation)组成. 槽被释放后代数加1, 所以关闭之后旧的套接字ID不会指向
+//  之后复用这个槽的新连接.
+//  进入的段按照(远端节点, 远端端口, 本地端口)在散列表中查找. 还不知道远端的套接字(客户端连接之前,
+//  服务器收到SYN之前)以(CONN_ANY, CONN_ANY, 本地端口)登记, 精确查找失败时再按这个键查找.
+//
+//槽数组和散列表在需要时加倍, 没有固定的连接数上限(只受CONN_IDX_BITS限制).
+//读者不加锁, 必须在epoch_enter()和epoch_exit()之间调用conntable_get(), conntable_lookup()和conntable_foreach(),
+//得到的TCB指针在epoch_exit()之前一直有效. 修改由一个互斥量串行化, 被替换下来的数组和散列表节点通过epoch_retire()释放.
+//conntable_remove()之后TCB本身也要由调用者通过epoch_retire()释放, 参见epoch.h.
+
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+//还不知道的远端节点或端口
+#define CONN_ANY ((unsigned int)-1)
+
+typedef struct conn_key {
+    unsigned int node;              //远端节点ID
+    unsigned int rport;             //远端端口
+    unsigned int lport;             //本地端口
+} conn_key_t;
+
+//散列表中的一个连接
+typedef struct conn_entry {
+    struct conn_entry* _Atomic next;
+    conn_key_t key;
+    void* tcb;
+} conn_entry_t;
+
+typedef struct conn_hash {
+    unsigned int nr_buckets;        //2的幂
+    conn_entry_t* _Atomic buckets[];
+} conn_hash_t;
+
+typedef struct conn_slot {
+    _Atomic unsigned int gen;       //这个槽当前的代数
+    void* _Atomic tcb;              //为NULL表示空闲
+    conn_key_t key;                 //连接在散列表中的键, 只由写者访问
+    unsigned int next_free;         //空闲链表中的下一个槽, 只由写者访问
+} conn_slot_t;
+
+typedef struct conn_slots {
+    unsigned int nr_slots;
+    conn_slot_t slots[];
+} conn_slots_t;
+
+typedef struct conntable {
+    pthread_mutex_t lock;           //串行化所有修改
+    conn_hash_t* _Atomic hash;
+    conn_slots_t* _Atomic slots;
+    unsigned int nr_conns;          //表中的连接数
+    unsigned int free_head;         //空闲槽链表, 为CONN_ANY表示没有空闲槽
+} conntable_t;
+
+//这个函数创建一个空的连接表. 失败时返回NULL.
+conntable_t* conntable_create(void);
+
+//这个函数为本地端口lport上的tcb分配一个套接字ID, 并以(CONN_ANY, CONN_ANY, lport)登记到散列表中.
+//返回套接字ID, 表满或内存不足时返回-1.
+int conntable_add(conntable_t* ct, void* tcb, unsigned int lport);
+
+//这个函数在知道远端之后把套接字sockfd的键改为(node, rport, 本地端口). 成功时返回0, sockfd无效时返回-1.
+int conntable_bind(conntable_t* ct, int sockfd, unsigned int node, unsigned int rport);
+
+//这个函数把套接字sockfd移出连接表并返回它的TCB, sockfd无效时返回NULL.
+//此后sockfd不再有效; 读者可能还在使用TCB, 调用者应通过epoch_retire()释放它.
+void* conntable_remove(conntable_t* ct, int sockfd);
+
+//这个函数返回套接字sockfd的TCB, sockfd无效或已经关闭时返回NULL. 调用者在读临界区中.
+void* conntable_get(conntable_t* ct, int sockfd);
+
+//这个函数返回从远端(node, rport)发往本地端口lport的段所属的TCB, 没有时返回NULL. 调用者在读临界区中.
+void* conntable_lookup(conntable_t* ct, unsigned int node, unsigned int rport, unsigned int lport);
+
+//这个函数对表中的每个TCB调用fn(tcb, arg). 调用者在读临界区中.
+void conntable_foreach(conntable_t* ct, void (*fn)(void* tcb, void* arg), void* arg);
+
+#endif
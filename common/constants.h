@@ -7,17 +7,20 @@
 
 //服务器打开的重叠网络层端口号. 客户端将连接到这个端口. 你应该选择一个随机的端口以避免和其他同学发生冲突.
 #define SON_PORT 9009
-//这是STCP可以支持的最大连接数. 你的TCB表应包含MAX_TRANSPORT_CONNECTIONS个条目.
-#define MAX_TRANSPORT_CONNECTIONS 10
+//套接字ID中槽下标的位数, 一个进程最多有(1 << CONN_IDX_BITS)个STCP连接, 其余的位是槽的代数. 参见conntable.h
+#define CONN_IDX_BITS 16
+//连接表的槽数组和散列表的初始大小, 必须是2的幂
+#define CONNTABLE_INIT_SIZE 16
 //最大段长度
 //MAX_SEG_LEN = 1500 - sizeof(stcp header) - sizeof(sip header)
 #define MAX_SEG_LEN  1464
 //数据包丢失率为10%
 #define PKT_LOSS_RATE 0.1
-//SYN_TIMEOUT值, 单位为纳秒
-#define SYN_TIMEOUT 1000000000
-//FIN_TIMEOUT值, 单位为纳秒
-#define FIN_TIMEOUT 1000000000
+//重传超时(RTO)的初始值, 在得到第一个RTT样本之前用于SYN, FIN和数据段, 单位为毫秒. 参见rto.h
+#define RTO_INIT_MS 1000
+//RTO的下限和上限, 单位为毫秒
+#define RTO_MIN_MS 30
+#define RTO_MAX_MS 4000
 //stcp_client_connect()中的最大SYN重传次数
 #define SYN_MAX_RETRY 5
 //stcp_client_disconnect()中的最大FIN重传次数
@@ -26,16 +29,32 @@
 #define CLOSEWAIT_TIMEOUT 10
 //stcp_server_accept()函数使用这个时间间隔来忙等待TCB状态转换, 单位为纳秒
 #define ACCEPT_POLLING_INTERVAL 100000000
-//sendBuf_timer线程的轮询间隔, 单位为纳秒
-#define SENDBUF_POLLING_INTERVAL 100000000
-//STCP客户端在stcp_server_recv()函数中使用这个时间间隔来轮询接收缓冲区, 以检查是否请求的数据已全部到达, 单位为秒.
-#define RECVBUF_POLLING_INTERVAL 1
-//接收缓冲区大小
-#define RECEIVE_BUF_SIZE 1000000
-//数据段超时值, 单位为纳秒
-#define DATA_TIMEOUT 100000000
+//STCP定时器时间轮的刻度, 单位为毫秒. 参见timerwheel.h
+#define TIMERWHEEL_TICK_MS 5
+//接收缓冲区大小, 必须是2的幂. 参见recvbuf.h
+#define RECEIVE_BUF_SIZE (1 << 20)
+//段首部中rcv_win的单位是(1 << STCP_RCV_WIN_SHIFT)字节, 使16位的字段可以通告整个接收缓冲区
+#define STCP_RCV_WIN_SHIFT 5
+//STCP连接每个方向的发送缓冲区的大小, 必须是2的幂, 且能容纳STCP_MAX_WINDOW个最长的段. 参见sendbuf.h
+#define STCP_SNDBUF_SIZE (1 << 17)
+//stcp_client_sendfile()每次映射的文件块大小, 必须是STCP_SNDBUF_SIZE的倍数. 参见stream.h
+#define STCP_SENDFILE_MAP_SIZE (1 << 26)
+//接收方最多攒多少个按序到达的段才发送一个DATAACK(延迟确认). 参见stream.h
+#define STCP_DELACK_SEGS 2
+//延迟确认的最长时间, 单位为毫秒, 必须远小于RTO_MIN_MS
+#define STCP_DELACK_MS 10
 //GBN窗口大小
 #define GBN_WINDOW 10
+//选择重传模式下可以协商的最大窗口大小, 单位为段
+#define STCP_MAX_WINDOW 64
+//连接建立后的初始拥塞窗口, 单位为段. 参见cc.h
+#define CC_INIT_CWND 3
+//触发快速重传的重复确认数
+#define CC_DUPACK_THRESH 3
+//Vegas算法的阈值, 单位为积压在路径队列中的段数
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+#define VEGAS_GAMMA 1
 
 #include <sys/types.h>
 /**
@@ -70,11 +89,13 @@ static inline struct timeval ns_to_tv(int ns)
 #define UNIX_PATH "son-sip"
 #define STCP_PATH "sip-stcp"
 
-//最大路由表槽数 
-#define MAX_ROUTINGTABLE_SLOTS 10
+//SIP进程和SON进程之间使用共享内存时每个方向的环的槽数, 必须是2的幂
+#define SON_SIP_RING_SLOTS 256
+//STCP进程和SIP进程之间使用共享内存时每个方向的环的槽数, 必须是2的幂
+#define STCP_SIP_RING_SLOTS 512
 
-//重叠网络支持的最大节点数
-#define MAX_NODE_NUM 10
+//SIP进程中端口表的槽数
+#define MAX_PORTTABLE_SLOTS 16
 
 //无穷大的链路代价值, 如果两个节点断开连接了, 它们之间的链路代价值就是INFINITE_COST
 #define INFINITE_COST 999
@@ -82,7 +103,12 @@ static inline struct timeval ns_to_tv(int ns)
 //这是广播节点ID. 如果SON进程从SIP进程处接收到一个目标节点ID为BROADCAST_NODEID的报文, 它应该将该报文发送给它的所有邻居
 #define BROADCAST_NODEID 9999
 
-//路由更新广播间隔, 以秒为单位
-#define ROUTEUPDATE_INTERVAL 2
+//距离矢量没有变化时, 路由更新报文作为保活报文发送的间隔, 以秒为单位. 必须明显小于SIP的邻居判活时间
+#define ROUTEUPDATE_INTERVAL 4
+
+//距离矢量变化时立即触发路由更新, 但相邻两次更新至少间隔ROUTEUPDATE_MIN_GAP_MS毫秒,
+//再加上0到ROUTEUPDATE_JITTER_MS毫秒的随机抖动, 这期间的多次变化合并在一次更新中发出
+#define ROUTEUPDATE_MIN_GAP_MS 50
+#define ROUTEUPDATE_JITTER_MS 50
 
 #endif
@@ -0,0 +1,173 @@
+//文件名: common/epoch.c
+//
+//描述: 这个文件实现基于epoch的内存回收, 参见epoch.h.
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "common.h"
+
+//记录槽中的值: 正在读时为(epoch << 1) | 1, 不在读时为0
+#define EPOCH_ACTIVE 1U
+
+//记录槽只分配不释放, 线程退出后归还的槽由之后的线程重用, 因此链表只会在头部增长
+typedef struct epoch_slot {
+    _Atomic unsigned long state;
+    struct epoch_slot* next;
+    _Atomic int in_use;
+    char pad[64 - sizeof(unsigned long) - sizeof(void*) - sizeof(int)];
+} epoch_slot_t;
+
+//一个等待释放的对象
+typedef struct limbo {
+    struct limbo* next;
+    unsigned long epoch;            //被摘下时的全局epoch
+    void* ptr;
+    void (*free_fn)(void*);
+} limbo_t;
+
+static _Atomic unsigned long global_epoch = 1;
+static epoch_slot_t *_Atomic slots;
+
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static limbo_t *limbo_head;
+static _Atomic unsigned int nr_limbo;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+static __thread epoch_slot_t *my_slot;
+static __thread unsigned int my_depth;
+
+static void release_slot(void *arg)
+{
+    epoch_slot_t *slot = arg;
+    atomic_store(&slot->state, 0);
+    atomic_store(&slot->in_use, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+static epoch_slot_t *claim_slot(void)
+{
+    pthread_once(&key_once, make_key);
+    epoch_slot_t *slot;
+    for (slot = atomic_load(&slots); slot != NULL; slot = slot->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&slot->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (slot == NULL) {
+        // 没有空闲的槽, 新分配一个挂到链表头部. 新槽不在读, 推进epoch的线程马上看到它也没有关系
+        slot = aligned_alloc(64, sizeof(*slot));
+        if (slot == NULL) {
+            sys_panic("aligned_alloc");
+        }
+        atomic_init(&slot->state, 0);
+        atomic_init(&slot->in_use, 1);
+        slot->next = atomic_load(&slots);
+        while (!atomic_compare_exchange_weak(&slots, &slot->next, slot)) {
+        }
+    }
+    pthread_setspecific(slot_key, slot);
+    return slot;
+}
+
+void epoch_enter(void)
+{
+    if (my_depth++ > 0) {
+        return;
+    }
+    if (my_slot == NULL) {
+        my_slot = claim_slot();
+    }
+    unsigned long e = atomic_load(&global_epoch);
+    atomic_store(&my_slot->state, e << 1 | EPOCH_ACTIVE);
+    // 记录槽的写入必须在之后读取共享指针之前对其他线程可见
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+    Assert(my_depth > 0, "epoch_exit() without epoch_enter()");
+    if (--my_depth == 0) {
+        atomic_store_explicit(&my_slot->state, 0, memory_order_release);
+    }
+}
+
+//所有正在读的线程都已经观察到当前的epoch时, 把它加1. 调用者持有limbo_lock.
+static unsigned long try_advance(void)
+{
+    unsigned long e = atomic_load(&global_epoch);
+    for (epoch_slot_t *slot = atomic_load(&slots); slot != NULL; slot = slot->next) {
+        if (!atomic_load_explicit(&slot->in_use, memory_order_relaxed)) {
+            continue;
+        }
+        unsigned long s = atomic_load(&slot->state);
+        if ((s & EPOCH_ACTIVE) && (s >> 1) != e) {
+            return e;
+        }
+    }
+    atomic_store(&global_epoch, e + 1);
+    return e + 1;
+}
+
+//推进epoch并取下已经安全的对象. 释放函数在锁外调用.
+static void reclaim(void)
+{
+    limbo_t *freed = NULL;
+    pthread_mutex_lock(&limbo_lock);
+    unsigned long e = try_advance();
+    for (limbo_t **pp = &limbo_head; *pp != NULL;) {
+        limbo_t *l = *pp;
+        if (l->epoch + 2 <= e) {
+            *pp = l->next;
+            l->next = freed;
+            freed = l;
+            atomic_fetch_sub(&nr_limbo, 1);
+        } else {
+            pp = &l->next;
+        }
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    while (freed) {
+        limbo_t *l = freed;
+        freed = l->next;
+        l->free_fn(l->ptr);
+        free(l);
+    }
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+    limbo_t *l = malloc(sizeof(*l));
+    if (l == NULL) {
+        sys_panic("malloc");
+    }
+    l->ptr = ptr;
+    l->free_fn = free_fn;
+    pthread_mutex_lock(&limbo_lock);
+    l->epoch = atomic_load(&global_epoch);
+    l->next = limbo_head;
+    limbo_head = l;
+    atomic_fetch_add(&nr_limbo, 1);
+    pthread_mutex_unlock(&limbo_lock);
+    // 在读临界区中时本线程会阻止epoch前进, 只能等之后的epoch_poll()
+    if (my_depth == 0) {
+        reclaim();
+    }
+}
+
+void epoch_poll(void)
+{
+    if (atomic_load_explicit(&nr_limbo, memory_order_relaxed) == 0 || my_depth > 0) {
+        return;
+    }
+    reclaim();
+}
@@ -0,0 +1,29 @@
+//文件名: common/epoch.h
+//
+//描述: 这个文件定义基于epoch的内存回收(EBR).
+//
+//无锁读取的数据结构(例如连接表)被修改时, 被摘下的对象可能还在被其他线程读取, 不能立即释放.
+//读者在访问这样的数据结构之前调用epoch_enter(), 用完从中得到的指针之后调用epoch_exit();
+//写者把对象从数据结构中摘下之后调用epoch_retire(), 对象在所有可能看到它的读者都退出之后才被释放.
+//
+//全局epoch只在所有正在读的线程都已经观察到当前epoch时才前进. 在epoch e中被摘下的对象,
+//在全局epoch到达e + 2时不可能还被任何读者持有, 此时才调用它的释放函数.
+//每个线程第一次调用epoch_enter()时占用一个记录槽(没有空闲的槽时新分配一个), 线程退出时归还. 读者路径上没有锁, 也不写共享的缓存行.
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+//进入读临界区. 可以嵌套.
+void epoch_enter(void);
+
+//离开读临界区. 离开之后不能再使用在临界区中得到的指针.
+void epoch_exit(void);
+
+//对象ptr已经从所有共享的数据结构中摘下, 等到没有读者能看到它时调用free_fn(ptr).
+//可以在读临界区中调用.
+void epoch_retire(void* ptr, void (*free_fn)(void*));
+
+//尝试推进全局epoch并释放已经安全的对象. 没有待释放的对象时几乎没有开销, 可以在循环中频繁调用.
+void epoch_poll(void);
+
+#endif
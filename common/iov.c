@@ -0,0 +1,109 @@
+//文件名: common/iov.c
+//
+//描述: 这个文件实现在流式套接字上完整读写iovec描述的数据的辅助函数, 参见iov.h.
+
+#include "iov.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/**
+ * @brief 写出 iov 描述的全部数据
+ * @return 成功返回 0, 失败返回 -1
+ *
+ * writev() 在套接字上可能只写出一部分, 此时调整 iov 后继续写剩下的部分.
+ * 注意 iov 数组会被修改.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 尝试写出 iov 描述的全部数据, 发送缓冲区满时不等待
+ * @return 成功返回 0, 发送缓冲区满或失败返回 -1
+ *
+ * unix domain 流式套接字上一个比发送缓冲区小得多的消息要么整个写出, 要么一个字节都不写,
+ * 写出一部分的情况实际上不会发生. 万一发生, 为了不截断消息, 剩下的部分阻塞着写完.
+ */
+int writev_nowait(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return writev_all(fd, iov, iovcnt);
+}
+
+/**
+ * @brief 读满 iov 描述的全部缓冲区
+ * @return 成功返回 0, 连接断开或出错返回 -1
+ *
+ * 流式套接字上一次 readv() 可能读不满, 此时调整 iov 后继续读. 注意 iov 数组会被修改.
+ */
+int readv_all(int fd, struct iovec *iov, int iovcnt)
+{
+    for (;;) {
+        // 长度为 0 的缓冲区 (如不带数据的段) 不需要读, 否则 readv() 返回 0 会被当作连接断开
+        while (iovcnt > 0 && iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+        ssize_t n = readv(fd, iov, iovcnt);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t n)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    return readv_all(fd, &iov, 1);
+}
@@ -0,0 +1,26 @@
+//文件名: common/iov.h
+//
+//描述: 这个文件声明在流式套接字上完整读写iovec描述的数据的辅助函数, 由pkt.c和seg.c共用.
+
+#ifndef IOV_H
+#define IOV_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// 写出iov描述的全部数据. writev()在套接字上可能只写出一部分, 此时调整iov后继续写剩下的部分.
+// 注意iov数组会被修改. 成功返回0, 失败返回-1.
+int writev_all(int fd, struct iovec* iov, int iovcnt);
+
+// 同writev_all(), 但套接字的发送缓冲区满时不等待, 直接返回-1, errno为EAGAIN.
+// 已经写出一部分时把剩下的部分写完, 以免消息在流中被截断. 注意iov数组会被修改.
+int writev_nowait(int fd, struct iovec* iov, int iovcnt);
+
+// 读满iov描述的全部缓冲区. 流式套接字上一次readv()可能读不满, 此时调整iov后继续读.
+// 注意iov数组会被修改. 成功返回0, 连接断开或出错返回-1.
+int readv_all(int fd, struct iovec* iov, int iovcnt);
+
+// 读满buf开始的n个字节, 返回值同readv_all().
+int read_all(int fd, void* buf, size_t n);
+
+#endif
@@ -3,28 +3,80 @@
  */
 
 #include "pkt.h"
+#include "shmring.h"
+#include "iov.h"
 #include <common.h>
 #include <string.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
 
-enum pkt_state {
-    PKTSTART1,
-    PKTSTART2,
-    PKTRECV,
-    PKTSTOP1,
-    PKTSTOP2
-};
-
-// son_sendpkt()由SIP进程调用, 其作用是要求SON进程将报文发送到重叠网络中. SON进程和SIP进程通过一个 unix domain socket 互连.
-// 在son_sendpkt()中, 报文及其下一跳的节点ID被封装进数据结构sendpkt_arg_t, 并通过 unix domain socket 发送给SON进程.
-// 参数son_conn是SIP进程和SON进程之间的TCP连接套接字描述符.
+/**
+ * @brief 帧起始和结束标记
+ */
+#define PKT_BEGIN "!&"
+#define PKT_END   "!#"
+#define PKT_MARK_LEN (sizeof(PKT_BEGIN) - sizeof(PKT_BEGIN[0]))
+
+#define PKT_RBUF_MASK (PKT_RBUF_SIZE - 1)
+
+/**
+ * @brief 本进程在邻居链路上使用的帧格式
+ */
+static int pkt_framing = PKT_FRAMING_LENGTH;
+
+void pkt_set_framing(int framing)
+{
+    pkt_framing = framing;
+}
+
+/**
+ * @brief 串行化本进程中对 SIP-SON 连接的写
+ *
+ * SIP 进程中路由更新, 报文转发和 STCP 段发送分属不同线程, SON 进程中每个邻居也有自己的线程.
+ * 一个消息可能要多次 writev() 才能写完, 不加锁的话不同线程的消息会在连接上交错.
+ */
+static pthread_mutex_t ipc_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ipc_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    shmchan_t *chan = shmchan_of(fd);
+    if (chan != NULL) {
+        // 整条消息一次放入环中, 通道自己串行化生产者
+        return shmchan_send(chan, iov, iovcnt);
+    }
+    pthread_mutex_lock(&ipc_write_mutex);
+    int ret = writev_all(fd, iov, iovcnt);
+    pthread_mutex_unlock(&ipc_write_mutex);
+    return ret;
+}
+
+/**
+ * @brief 从共享内存通道取出一条消息, 检查其中报文首部的长度与消息长度是否一致
+ * @param fixed_len 消息中报文有效数据之前的字节数
+ * @return 成功返回 1, 对端退出或消息不合法返回 -1
+ */
+static int ipc_recv_shm(shmchan_t *chan, struct iovec *iov, int iovcnt, size_t fixed_len, sip_pkt_t *pkt)
+{
+    int len = shmchan_recv(chan, iov, iovcnt);
+    if (len == -1) {
+        return -1;
+    }
+    if ((size_t)len < fixed_len || pkt->header.length > MAX_PKT_LEN || (size_t)len != fixed_len + pkt->header.length) {
+        warn("invalid message of %d bytes on shared memory channel", len);
+        return -1;
+    }
+    return 1;
+}
+
+// son_sendpkt()由SIP进程调用, 其作用是要求SON进程将报文发送到重叠网络中.
+// 下一跳的节点ID, 报文首部和有效数据用一次writev()直接从调用者的pkt发送, 不经过中间缓冲区, 并处理部分写的情况.
+// 参数son_conn是SIP进程和SON进程之间的连接套接字描述符.
 // 如果发送成功, 返回1, 否则返回-1.
 int son_sendpkt(int nextNodeID, sip_pkt_t *pkt, int son_conn)
 {
-    sendpkt_arg_t sendptk;
-    sendptk.nextNodeID = nextNodeID;
-    sendptk.pkt = *pkt;
-    if (write(son_conn, &sendptk, sizeof(sendptk)) > 0) {
+    struct iovec iov[PKT_IOV_MAX];
+    if (ipc_writev(son_conn, iov, pkt_tosend_iov(&nextNodeID, pkt, iov)) == 0) {
         return 1;
     } else {
         return -1;
@@ -32,43 +84,63 @@ int son_sendpkt(int nextNodeID, sip_pkt_t *pkt, int son_conn)
 }
 
 // son_recvpkt()函数由SIP进程调用, 其作用是接收来自SON进程的报文.
-// 参数son_conn是SIP进程和SON进程之间TCP连接的套接字描述符. 报文通过SIP进程和SON进程之间的 unix domain 套接字连接发送.
-// 如果成功接收报文, 返回1, 否则返回-1.
+// 参数son_conn是SIP进程和SON进程之间的连接套接字描述符. 这个函数先读报文首部, 再按首部中的length读有效数据,
+// 两次读取都会处理读不满的情况.
+// 如果成功接收报文, 返回1, 连接断开或首部不合法返回-1.
 int son_recvpkt(sip_pkt_t *pkt, int son_conn)
 {
-    if (read(son_conn, pkt, sizeof(*pkt)) > 0) {
-        return 1;
-    } else {
+    shmchan_t *chan = shmchan_of(son_conn);
+    if (chan != NULL) {
+        struct iovec iov[PKT_IOV_MAX];
+        pkt->header.length = MAX_PKT_LEN;
+        return ipc_recv_shm(chan, iov, pkt_tosip_iov(pkt, iov), sizeof(pkt->header), pkt);
+    }
+    if (read_all(son_conn, &pkt->header, sizeof(pkt->header)) == -1) {
         // 连接断开或套接字销毁
         return -1;
     }
+    if (pkt->header.length > MAX_PKT_LEN) {
+        warn("invalid pkt length %d from SON", pkt->header.length);
+        return -1;
+    }
+    return read_all(son_conn, pkt->data, pkt->header.length) == 0 ? 1 : -1;
 }
 
-// 这个函数由SON进程调用, 其作用是接收数据结构sendpkt_arg_t.
-// 报文和下一跳的节点ID被封装进sendpkt_arg_t结构.
-// 参数sip_conn是在SIP进程和SON进程之间的TCP连接的套接字描述符.
-// sendpkt_arg_t结构通过SIP进程和SON进程之间的TCP连接发送.
-// 如果成功接收sendpkt_arg_t结构, 返回1, 否则返回-1.
+// 这个函数由SON进程调用, 其作用是接收son_sendpkt()发送的消息.
+// 参数sip_conn是在SIP进程和SON进程之间的连接套接字描述符. 读取方式同son_recvpkt().
+// 如果成功接收消息, 返回1, 连接断开或首部不合法返回-1.
 int getpktToSend(sip_pkt_t* pkt, int* nextNode, int sip_conn)
 {
-    sendpkt_arg_t sendpkt;
-    if (read(sip_conn, &sendpkt, sizeof(sendpkt)) > 0) {
-        memcpy(pkt, &sendpkt.pkt, sizeof(*pkt));
-        *nextNode = sendpkt.nextNodeID;
-        return 1;
-    } else {
+    shmchan_t *chan = shmchan_of(sip_conn);
+    if (chan != NULL) {
+        struct iovec iov[PKT_IOV_MAX];
+        pkt->header.length = MAX_PKT_LEN;
+        return ipc_recv_shm(chan, iov, pkt_tosend_iov(nextNode, pkt, iov), sizeof(*nextNode) + sizeof(pkt->header), pkt);
+    }
+
+    // 定长部分用一次 readv 读入
+    struct iovec iov[] = {
+        { .iov_base = nextNode, .iov_len = sizeof(*nextNode) },
+        { .iov_base = &pkt->header, .iov_len = sizeof(pkt->header) },
+    };
+    if (readv_all(sip_conn, iov, 2) == -1) {
         return -1;
     }
+    if (pkt->header.length > MAX_PKT_LEN) {
+        warn("invalid pkt length %d from SIP", pkt->header.length);
+        return -1;
+    }
+    return read_all(sip_conn, pkt->data, pkt->header.length) == 0 ? 1 : -1;
 }
 
 // forwardpktToSIP()函数是在SON进程接收到来自重叠网络中其邻居的报文后被调用的.
-// SON进程调用这个函数将报文转发给SIP进程.
-// 参数sip_conn是SIP进程和SON进程之间的TCP连接的套接字描述符.
-// 报文通过SIP进程和SON进程之间的TCP连接发送.
+// SON进程调用这个函数将报文首部和有效数据用一次writev()转发给SIP进程, 并处理部分写的情况.
+// 参数sip_conn是SIP进程和SON进程之间的连接套接字描述符.
 // 如果报文发送成功, 返回1, 否则返回-1.
 int forwardpktToSIP(sip_pkt_t *pkt, int sip_conn)
 {
-    if (write(sip_conn, pkt, sizeof(*pkt)) > 0) {
+    struct iovec iov[PKT_IOV_MAX];
+    if (ipc_writev(sip_conn, iov, pkt_tosip_iov(pkt, iov)) == 0) {
         return 1;
     } else {
         return -1;
@@ -77,72 +149,181 @@ int forwardpktToSIP(sip_pkt_t *pkt, int sip_conn)
 
 // sendpkt()函数由SON进程调用, 其作用是将接收自SIP进程的报文发送给下一跳.
 // 参数conn是到下一跳节点的TCP连接的套接字描述符.
-// 报文通过SON进程和其邻居节点之间的TCP连接发送, 使用分隔符!&和!#, 按照'!& 报文 !#'的顺序发送.
+// 报文按照pkt_set_framing()设置的帧格式, 用一次writev()直接从pkt发送, 处理部分写的情况.
 // 如果报文发送成功, 返回1, 否则返回-1.
 int sendpkt(sip_pkt_t *pkt, int conn)
 {
-    unsigned char buf[4 + sizeof(*pkt)];
-    memcpy(buf, "!&", 2);
-    memcpy(buf + 2, &pkt->header, sizeof(pkt->header));
-    memcpy(buf + 2 + sizeof(pkt->header), pkt->data, pkt->header.length);
-    memcpy(buf + 2 + sizeof(pkt->header) + pkt->header.length, "!#", 2);
-    if (write(conn, buf, 4 + sizeof(pkt->header) + pkt->header.length) > 0) {
+    struct iovec iov[PKT_IOV_MAX];
+    if (writev_all(conn, iov, pkt_frame_iov(pkt, iov)) == 0) {
         return 1;
     } else {
         return -1;
     }
 }
 
-// recvpkt()函数由SON进程调用, 其作用是接收来自重叠网络中其邻居的报文.
-// 参数conn是到其邻居的TCP连接的套接字描述符.
-// 报文通过SON进程和其邻居之间的TCP连接发送, 使用分隔符!&和!#.
-// 为了接收报文, 这个函数使用一个简单的有限状态机FSM
-// PKTSTART1 -- 起点
-// PKTSTART2 -- 接收到'!', 期待'&'
-// PKTRECV -- 接收到'&', 开始接收数据
-// PKTSTOP1 -- 接收到'!', 期待'#'以结束数据的接收
-// 如果成功接收报文, 返回1, 否则返回-1.
-// 断开连接返回 -2
-int recvpkt(sip_pkt_t *pkt, int conn)
-{
-    char ch;
-    char *buf = (void *)pkt;
-    enum pkt_state pkt_state = PKTSTART1;
-    while (pkt_state != PKTSTOP2) {
-        if (read(conn, &ch, sizeof(ch)) <= 0) {
-            perror("recvpkt");
-            return -2;
+int pkt_frame_iov(sip_pkt_t *pkt, struct iovec *iov)
+{
+    iov[0].iov_base = PKT_BEGIN;
+    iov[0].iov_len = PKT_MARK_LEN;
+    iov[1].iov_base = &pkt->header;
+    iov[1].iov_len = sizeof(pkt->header);
+    iov[2].iov_base = pkt->data;
+    iov[2].iov_len = pkt->header.length;
+    if (pkt_framing != PKT_FRAMING_DELIM) {
+        return 3;
+    }
+    iov[3].iov_base = PKT_END;
+    iov[3].iov_len = PKT_MARK_LEN;
+    return 4;
+}
+
+int pkt_tosip_iov(sip_pkt_t *pkt, struct iovec *iov)
+{
+    iov[0].iov_base = &pkt->header;
+    iov[0].iov_len = sizeof(pkt->header);
+    iov[1].iov_base = pkt->data;
+    iov[1].iov_len = pkt->header.length;
+    return 2;
+}
+
+int pkt_tosend_iov(int *nextNodeID, sip_pkt_t *pkt, struct iovec *iov)
+{
+    iov[0].iov_base = nextNodeID;
+    iov[0].iov_len = sizeof(*nextNodeID);
+    iov[1].iov_base = &pkt->header;
+    iov[1].iov_len = sizeof(pkt->header);
+    iov[2].iov_base = pkt->data;
+    iov[2].iov_len = pkt->header.length;
+    return 3;
+}
+
+void pkt_rbuf_init(pkt_rbuf_t *rb, int conn)
+{
+    rb->conn = conn;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+/**
+ * @brief 取缓冲区中相对 head 偏移为 off 的字节
+ */
+static inline char rbuf_at(const pkt_rbuf_t *rb, unsigned int off)
+{
+    return rb->buf[(rb->head + off) & PKT_RBUF_MASK];
+}
+
+/**
+ * @brief 从相对 head 偏移为 off 处复制 n 个字节, 处理环绕的情况
+ */
+static void rbuf_peek(const pkt_rbuf_t *rb, unsigned int off, void *dst, unsigned int n)
+{
+    unsigned int pos = (rb->head + off) & PKT_RBUF_MASK;
+    unsigned int first = PKT_RBUF_SIZE - pos;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(dst, rb->buf + pos, first);
+    memcpy((char *)dst + first, rb->buf, n - first);
+}
+
+int pkt_rbuf_fill(pkt_rbuf_t *rb)
+{
+    unsigned int room = PKT_RBUF_SIZE - (rb->tail - rb->head);
+    unsigned int pos = rb->tail & PKT_RBUF_MASK;
+    struct iovec iov[2];
+    iov[0].iov_base = rb->buf + pos;
+    iov[0].iov_len = PKT_RBUF_SIZE - pos < room ? PKT_RBUF_SIZE - pos : room;
+    iov[1].iov_base = rb->buf;
+    iov[1].iov_len = room - iov[0].iov_len;
+
+    ssize_t n;
+    do {
+        n = readv(rb->conn, iov, iov[1].iov_len ? 2 : 1);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        rb->tail += n;
+    }
+    return n;
+}
+
+int pkt_rbuf_decode(pkt_rbuf_t *rb, sip_pkt_t *pkt)
+{
+    const unsigned int hdr_len = sizeof(pkt->header);
+    const unsigned int end_len = pkt_framing == PKT_FRAMING_DELIM ? PKT_MARK_LEN : 0;
+    unsigned int skipped = 0;
+    int ret = 0;
+
+    while (rb->tail - rb->head >= PKT_MARK_LEN + hdr_len) {
+        if (rbuf_at(rb, 0) != PKT_BEGIN[0] || rbuf_at(rb, 1) != PKT_BEGIN[1]) {
+            rb->head++;
+            skipped++;
+            continue;
         }
-        switch (pkt_state) {
-        case PKTSTART1:
-            if (ch == '!') pkt_state = PKTSTART2;
-            break;
-        case PKTSTART2:
-            if (ch == '&') pkt_state = PKTRECV;
-            else return -1;
-            break;
-        case PKTRECV:
-            if (ch == '!') pkt_state = PKTSTOP1;
-            else *buf++ = ch;
-            break;
-        case PKTSTOP1:
-            if (ch == '#') pkt_state = PKTSTOP2;
-            else {
-                // 错误的进入 STOP1 的恢复工作
-                *buf++ = '!';
-                // 注意处理 "!!#" 这样的序列
-                if (ch != '!') {
-                    *buf++ = ch;
-                    pkt_state = PKTRECV;
-                }
-                else {
-                    pkt_state = PKTSTOP1;
-                }
-            };
+
+        rbuf_peek(rb, PKT_MARK_LEN, &pkt->header, hdr_len);
+        if (pkt->header.length > MAX_PKT_LEN) {
+            // 数据中恰好出现了 '!&', 或者帧已经损坏
+            rb->head++;
+            skipped++;
+            continue;
+        }
+
+        unsigned int frame_len = PKT_MARK_LEN + hdr_len + pkt->header.length + end_len;
+        if (rb->tail - rb->head < frame_len) {
             break;
-        default:
-            return -1;
         }
+        if (end_len && (rbuf_at(rb, frame_len - 2) != PKT_END[0] || rbuf_at(rb, frame_len - 1) != PKT_END[1])) {
+            rb->head++;
+            skipped++;
+            continue;
+        }
+
+        rbuf_peek(rb, PKT_MARK_LEN + hdr_len, pkt->data, pkt->header.length);
+        rb->head += frame_len;
+        ret = 1;
+        break;
+    }
+
+    if (skipped) {
+        warn("skipped %u bytes to resynchronize on conn %d", skipped, rb->conn);
+    }
+    return ret;
+}
+
+// recvpkt()函数由SON进程调用, 其作用是接收来自重叠网络中其邻居的报文.
+// 参数rb是到该邻居连接的接收缓冲区, 缓冲区中已有完整的帧时不会产生任何系统调用.
+// 如果成功接收报文, 返回1, 连接断开返回-2.
+int recvpkt(sip_pkt_t *pkt, pkt_rbuf_t *rb)
+{
+    while (pkt_rbuf_decode(rb, pkt) == 0) {
+        int n = pkt_rbuf_fill(rb);
+        if (n <= 0) {
+            if (n == -1) {
+                perror("recvpkt");
+            }
+            return -2;
+        }
+    }
+    return 1;
+}
+
+int pkt_rbuf_decode_tosend(pkt_rbuf_t *rb, sip_pkt_t *pkt, int *nextNode)
+{
+    const unsigned int fixed_len = sizeof(*nextNode) + sizeof(pkt->header);
+    if (rb->tail - rb->head < fixed_len) {
+        return 0;
+    }
+    rbuf_peek(rb, sizeof(*nextNode), &pkt->header, sizeof(pkt->header));
+    if (pkt->header.length > MAX_PKT_LEN) {
+        // 与 SIP 进程之间是可靠的本地连接, 出现这种情况说明两边的程序版本不一致
+        warn("invalid pkt length %d from SIP", pkt->header.length);
+        return -1;
+    }
+    if (rb->tail - rb->head < fixed_len + pkt->header.length) {
+        return 0;
     }
-    return 0;
+    rbuf_peek(rb, 0, nextNode, sizeof(*nextNode));
+    rbuf_peek(rb, fixed_len, pkt->data, pkt->header.length);
+    rb->head += fixed_len + pkt->header.length;
+    return 1;
 }
@@ -2,6 +2,7 @@
 #define PKT_H
 
 #include "constants.h"
+#include <sys/uio.h>
 
 //报文类型定义, 用于报文首部中的type字段
 #define ROUTE_UPDATE 1
@@ -21,69 +22,136 @@ typedef struct packet {
 } sip_pkt_t;
 
 //路由更新报文定义
-//对于路由更新报文来说, 路由更新信息存储在报文的data字段中
+//对于路由更新报文来说, 路由更新信息存储在报文的data字段中: 一个route_update_hdr_t, 之后是nr_entries个route_entry_t.
+//
+//每个节点分别给每个邻居发送路由更新, 报文只携带自上次发给这个邻居以来代价发生变化的(节点ID, 代价)对,
+//没有出现的节点代价不变. 发给同一个邻居的报文的seq逐个加1, 接收方发现序号不连续, 说明丢失了更新,
+//就在自己的下一个报文中设置RU_REQUEST, 请求对方发送完整快照. 快照只携带代价不是INFINITE_COST的节点,
+//它的第一个报文设置RU_SNAPSHOT, 接收方收到时先丢弃这个邻居之前通告的全部代价.
+//boot_id在节点启动时随机选取, 邻居的boot_id变化说明它重启过, 已经忘记了之前收到的一切, 需要给它发送快照.
+//一次更新放不进一个报文时拆成多个序号连续的报文, 除最后一个之外都设置RU_MORE, 接收方收齐之后才重新计算路由.
+//没有变化时也定期发送不含条目的报文, 作为保活.
+#define RU_SNAPSHOT 0x1     //完整快照的第一个报文
+#define RU_MORE     0x2     //同一次更新还有后续报文
+#define RU_REQUEST  0x4     //请求接收方发送完整快照
+
+typedef struct routeupdateheader {
+    unsigned int boot_id;       //发送方本次启动的标识
+    unsigned int seq;           //发送方发给这个邻居的报文序号
+    unsigned short flags;       //RU_SNAPSHOT, RU_MORE, RU_REQUEST
+    unsigned short nr_entries;  //之后的route_entry_t个数
+} route_update_hdr_t;
+
+typedef struct routeentry {
+    int nodeID;                 //目标节点ID, 可以是任意的32位整数
+    unsigned int cost;          //到目标节点的代价
+} route_entry_t;
+
+//一个路由更新报文最多携带的条目数
+#define RU_MAX_ENTRIES ((MAX_PKT_LEN - sizeof(route_update_hdr_t)) / sizeof(route_entry_t))
 
 // 数据结构sendpkt_arg_t用在函数son_sendpkt()中.
 // son_sendpkt()由SIP进程调用, 其作用是要求SON进程将报文发送到重叠网络中.
 //
-// SON进程和SIP进程通过一个本地TCP连接互连, 在son_sendpkt()中, SIP进程通过该TCP连接将这个数据结构发送给SON进程.
-// SON进程通过调用getpktToSend()接收这个数据结构. 然后SON进程调用sendpkt()将报文发送给下一跳.
+// SON进程和SIP进程通过一个unix domain套接字互连. sendpkt_arg_t描述了SIP进程发送给SON进程的消息,
+// 但只有nextNodeID, 报文首部和首部中length指出的有效数据会被传输, 没有用到的data部分不会出现在连接上.
+// SON进程通过调用getpktToSend()接收这个消息. 然后SON进程调用sendpkt()将报文发送给下一跳.
+// 反方向上, forwardpktToSIP()发送给SIP进程的消息只包含报文首部和有效数据.
+// 如果SIP进程在连接时选择了共享内存(参见shmring.h), 同样的消息改为经过共享内存环传递,
+// 下面四个函数通过shmchan_of()发现这一点, 调用者不需要区分两种传输方式.
 typedef struct sendpktargument {
     int nextNodeID;        //下一跳的节点ID
     sip_pkt_t pkt;         //要发送的报文
 } sendpkt_arg_t;
 
-// son_sendpkt()由SIP进程调用, 其作用是要求SON进程将报文发送到重叠网络中. SON进程和SIP进程通过一个本地TCP连接互连.
-// 在son_sendpkt()中, 报文及其下一跳的节点ID被封装进数据结构sendpkt_arg_t, 并通过TCP连接发送给SON进程.
-// 参数son_conn是SIP进程和SON进程之间的TCP连接套接字描述符.
-// 当通过SIP进程和SON进程之间的TCP连接发送数据结构sendpkt_arg_t时, 使用'!&'和'!#'作为分隔符, 按照'!& sendpkt_arg_t结构 !#'的顺序发送.
+// son_sendpkt()由SIP进程调用, 其作用是要求SON进程将报文发送到重叠网络中.
+// 下一跳的节点ID, 报文首部和有效数据用一次writev()直接从调用者的pkt发送, 不经过中间缓冲区, 并处理部分写的情况.
+// 参数son_conn是SIP进程和SON进程之间的连接套接字描述符.
 // 如果发送成功, 返回1, 否则返回-1.
 int son_sendpkt(int nextNodeID, sip_pkt_t* pkt, int son_conn);
 
 // son_recvpkt()函数由SIP进程调用, 其作用是接收来自SON进程的报文.
-// 参数son_conn是SIP进程和SON进程之间TCP连接的套接字描述符. 报文通过SIP进程和SON进程之间的TCP连接发送, 使用分隔符!&和!#.
-// 为了接收报文, 这个函数使用一个简单的有限状态机FSM
-// PKTSTART1 -- 起点
-// PKTSTART2 -- 接收到'!', 期待'&'
-// PKTRECV -- 接收到'&', 开始接收数据
-// PKTSTOP1 -- 接收到'!', 期待'#'以结束数据的接收
-// 如果成功接收报文, 返回1, 否则返回-1.
+// 参数son_conn是SIP进程和SON进程之间的连接套接字描述符. 这个函数先读报文首部, 再按首部中的length读有效数据,
+// 两次读取都会处理读不满的情况.
+// 如果成功接收报文, 返回1, 连接断开或首部不合法返回-1.
 int son_recvpkt(sip_pkt_t* pkt, int son_conn);
 
-// 这个函数由SON进程调用, 其作用是接收数据结构sendpkt_arg_t.
-// 报文和下一跳的节点ID被封装进sendpkt_arg_t结构.
-// 参数sip_conn是在SIP进程和SON进程之间的TCP连接的套接字描述符.
-// sendpkt_arg_t结构通过SIP进程和SON进程之间的TCP连接发送, 使用分隔符!&和!#.
-// 为了接收报文, 这个函数使用一个简单的有限状态机FSM
-// PKTSTART1 -- 起点
-// PKTSTART2 -- 接收到'!', 期待'&'
-// PKTRECV -- 接收到'&', 开始接收数据
-// PKTSTOP1 -- 接收到'!', 期待'#'以结束数据的接收
-// 如果成功接收sendpkt_arg_t结构, 返回1, 否则返回-1.
+// 这个函数由SON进程调用, 其作用是接收son_sendpkt()发送的消息.
+// 参数sip_conn是在SIP进程和SON进程之间的连接套接字描述符. 读取方式同son_recvpkt().
+// 如果成功接收消息, 返回1, 连接断开或首部不合法返回-1.
 int getpktToSend(sip_pkt_t* pkt, int* nextNode, int sip_conn);
 
 // forwardpktToSIP()函数是在SON进程接收到来自重叠网络中其邻居的报文后被调用的.
-// SON进程调用这个函数将报文转发给SIP进程.
-// 参数sip_conn是SIP进程和SON进程之间的TCP连接的套接字描述符.
-// 报文通过SIP进程和SON进程之间的TCP连接发送, 使用分隔符!&和!#, 按照'!& 报文 !#'的顺序发送.
+// SON进程调用这个函数将报文首部和有效数据用一次writev()转发给SIP进程, 并处理部分写的情况.
+// 参数sip_conn是SIP进程和SON进程之间的连接套接字描述符.
 // 如果报文发送成功, 返回1, 否则返回-1.
 int forwardpktToSIP(sip_pkt_t* pkt, int sip_conn);
 
+// 邻居链路上的帧格式, 链路两端必须一致.
+// PKT_FRAMING_LENGTH -- '!& sip_hdr_t data[header.length]', 依靠首部中的length字段定界, 默认格式.
+// PKT_FRAMING_DELIM  -- '!& sip_hdr_t data[header.length] !#', 与仍使用分隔符格式的旧节点互通时使用.
+enum {
+    PKT_FRAMING_LENGTH,
+    PKT_FRAMING_DELIM,
+};
+
+// 设置本进程在所有邻居链路上使用的帧格式.
+void pkt_set_framing(int framing);
+
 // sendpkt()函数由SON进程调用, 其作用是将接收自SIP进程的报文发送给下一跳.
 // 参数conn是到下一跳节点的TCP连接的套接字描述符.
-// 报文通过SON进程和其邻居节点之间的TCP连接发送, 使用分隔符!&和!#, 按照'!& 报文 !#'的顺序发送.
+// 报文按照pkt_set_framing()设置的帧格式, 用一次writev()直接从pkt发送, 处理部分写的情况.
 // 如果报文发送成功, 返回1, 否则返回-1.
 int sendpkt(sip_pkt_t* pkt, int conn);
 
+//邻居连接接收缓冲区的大小, 必须是2的幂, 且远大于一个最长的帧.
+#define PKT_RBUF_SIZE (1 << 16)
+
+// 每个邻居连接的接收环形缓冲区.
+// 每次read()尽可能多地读入数据, 然后直接在缓冲区中解帧, 链路繁忙时一次系统调用可以取到多个报文.
+// head和tail是自由增长的计数器, 对PKT_RBUF_SIZE取模后才是buf的下标.
+typedef struct pkt_rbuf {
+    int conn;                   //邻居连接的套接字描述符
+    unsigned int head;          //下一个待解析的字节
+    unsigned int tail;          //下一个读入的字节将存放的位置
+    char buf[PKT_RBUF_SIZE];
+} pkt_rbuf_t;
+
+// 初始化连接conn的接收缓冲区.
+void pkt_rbuf_init(pkt_rbuf_t* rb, int conn);
+
+// 用一次readv()将连接上可读的数据尽可能多地读入缓冲区.
+// 返回读入的字节数, 对端关闭连接返回0, 出错返回-1(errno保持不变).
+int pkt_rbuf_fill(pkt_rbuf_t* rb);
+
+// 尝试从缓冲区中解出一个完整的报文.
+// 帧起始标记'!&'之前的字节, 以及长度或结束标记不合法的帧都会被跳过, 以便重新同步.
+// 解出报文返回1, 数据还不足一个完整的帧返回0.
+int pkt_rbuf_decode(pkt_rbuf_t* rb, sip_pkt_t* pkt);
+
 // recvpkt()函数由SON进程调用, 其作用是接收来自重叠网络中其邻居的报文.
-// 参数conn是到其邻居的TCP连接的套接字描述符.
-// 报文通过SON进程和其邻居之间的TCP连接发送, 使用分隔符!&和!#.
-// 为了接收报文, 这个函数使用一个简单的有限状态机FSM
-// PKTSTART1 -- 起点
-// PKTSTART2 -- 接收到'!', 期待'&'
-// PKTRECV -- 接收到'&', 开始接收数据
-// PKTSTOP1 -- 接收到'!', 期待'#'以结束数据的接收
-// 如果成功接收报文, 返回1, 否则返回-1.
-int recvpkt(sip_pkt_t* pkt, int conn);
+// 参数rb是到该邻居连接的接收缓冲区, 缓冲区中已有完整的帧时不会产生任何系统调用.
+// 如果成功接收报文, 返回1, 连接断开返回-2.
+int recvpkt(sip_pkt_t* pkt, pkt_rbuf_t* rb);
+
+// 以下接口供事件驱动(非阻塞)的SON使用: 报文编码为iovec后由调用者自行写出或排队,
+// 接收的数据由调用者读入pkt_rbuf_t后再解码. 编码格式与上面的阻塞接口完全一致.
+
+//编码一个报文最多需要的iovec个数
+#define PKT_IOV_MAX 4
+
+// 将pkt按照邻居链路的帧格式编码到iov中, 返回使用的iovec个数. iov引用pkt中的数据, 不发生复制.
+int pkt_frame_iov(sip_pkt_t* pkt, struct iovec* iov);
+
+// 将pkt编码为forwardpktToSIP()发送给SIP进程的消息, 返回使用的iovec个数.
+int pkt_tosip_iov(sip_pkt_t* pkt, struct iovec* iov);
+
+// 将pkt和nextNodeID编码为son_sendpkt()发送给SON进程的消息, 返回使用的iovec个数.
+// nextNodeID必须在消息写出之前保持有效.
+int pkt_tosend_iov(int* nextNodeID, sip_pkt_t* pkt, struct iovec* iov);
+
+// 尝试从rb中解出一个getpktToSend()所接收的消息.
+// 解出消息返回1, 数据还不足一个完整的消息返回0, 消息不合法返回-1.
+int pkt_rbuf_decode_tosend(pkt_rbuf_t* rb, sip_pkt_t* pkt, int* nextNode);
 
 #endif
@@ -0,0 +1,50 @@
+//文件名: common/recvbuf.c
+//
+//描述: 这个文件实现STCP接收方的接收缓冲区, 参见recvbuf.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include "recvbuf.h"
+
+int recvbuf_init(recvbuf_t *rb, unsigned int size)
+{
+    rb->data = malloc(size);
+    if (rb->data == NULL) {
+        return -1;
+    }
+    rb->size = size;
+    rb->head = rb->tail = 0;
+    return 0;
+}
+
+void recvbuf_free(recvbuf_t *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+}
+
+int recvbuf_write(recvbuf_t *rb, const void *data, unsigned int len)
+{
+    if (len > recvbuf_room(rb)) {
+        return -1;
+    }
+    unsigned int off = rb->tail & (rb->size - 1);
+    unsigned int first = rb->size - off < len ? rb->size - off : len;
+    memcpy(rb->data + off, data, first);
+    memcpy(rb->data, (const char *)data + first, len - first);
+    rb->tail += len;
+    return 0;
+}
+
+unsigned int recvbuf_read(recvbuf_t *rb, void *dst, unsigned int len)
+{
+    if (len > recvbuf_used(rb)) {
+        len = recvbuf_used(rb);
+    }
+    unsigned int off = rb->head & (rb->size - 1);
+    unsigned int first = rb->size - off < len ? rb->size - off : len;
+    memcpy(dst, rb->data + off, first);
+    memcpy((char *)dst + first, rb->data, len - first);
+    rb->head += len;
+    return len;
+}
@@ -0,0 +1,47 @@
+//文件名: common/recvbuf.h
+//
+//描述: 这个文件定义STCP接收方的接收缓冲区.
+//
+//接收缓冲区是一个预先分配的字节环, seghandler线程把按序到达的数据追加到尾部, 应用程序从头部取走数据.
+//head和tail是自由增长的计数器, 对环的大小取模后才是下标:
+//
+//      head                tail
+//       |  已接收未读取   |  空闲
+//
+//读取和写入的代价只与复制的字节数成正比, 与缓冲区中已有的数据量无关, 不需要把剩余数据移动到缓冲区开头.
+
+#ifndef RECVBUF_H
+#define RECVBUF_H
+
+typedef struct recvbuf {
+    char* data;                     //字节环
+    unsigned int size;              //字节环的大小, 2的幂
+    unsigned int head;              //下一个被读取的字节
+    unsigned int tail;              //下一个被写入的字节
+} recvbuf_t;
+
+//这个函数为接收缓冲区分配大小为size(2的幂)的字节环. 成功时返回0, 失败时返回-1.
+int recvbuf_init(recvbuf_t* rb, unsigned int size);
+
+//这个函数释放字节环.
+void recvbuf_free(recvbuf_t* rb);
+
+//这个函数把data中的len个字节追加到字节环中. 空间不够时不写入任何数据, 返回-1; 成功时返回0.
+int recvbuf_write(recvbuf_t* rb, const void* data, unsigned int len);
+
+//这个函数从字节环中取走最多len个字节复制到dst中, 返回复制的字节数.
+unsigned int recvbuf_read(recvbuf_t* rb, void* dst, unsigned int len);
+
+//已接收但还没有被读取的字节数
+static inline unsigned int recvbuf_used(const recvbuf_t* rb)
+{
+    return rb->tail - rb->head;
+}
+
+//空闲的字节数
+static inline unsigned int recvbuf_room(const recvbuf_t* rb)
+{
+    return rb->size - (rb->tail - rb->head);
+}
+
+#endif
@@ -0,0 +1,53 @@
+//文件名: common/rto.c
+//
+//描述: 这个文件实现STCP的重传超时估计器, 参见rto.h.
+
+#include "rto.h"
+#include "constants.h"
+
+static unsigned int clamp(unsigned int ms)
+{
+    if (ms < RTO_MIN_MS) {
+        return RTO_MIN_MS;
+    } else if (ms > RTO_MAX_MS) {
+        return RTO_MAX_MS;
+    }
+    return ms;
+}
+
+void rto_init(rto_t *rto)
+{
+    rto->srtt = 0;
+    rto->rttvar = 0;
+    rto->rto = RTO_INIT_MS;
+    rto->backoff = 0;
+}
+
+void rto_sample(rto_t *rto, unsigned int rtt)
+{
+    if (rtt == 0) {
+        rtt = 1;  // 时钟精度为毫秒, 本地环回的样本可能为 0
+    }
+    if (rto->srtt == 0) {
+        rto->srtt = rtt;
+        rto->rttvar = rtt / 2;
+    } else {
+        unsigned int delta = rtt > rto->srtt ? rtt - rto->srtt : rto->srtt - rtt;
+        rto->rttvar = (3 * rto->rttvar + delta) / 4;
+        rto->srtt = (7 * rto->srtt + rtt) / 8;
+    }
+    rto->rto = clamp(rto->srtt + 4 * rto->rttvar);
+    rto->backoff = 0;
+}
+
+void rto_backoff(rto_t *rto)
+{
+    if (rto_get(rto) < RTO_MAX_MS) {
+        rto->backoff++;
+    }
+}
+
+unsigned int rto_get(const rto_t *rto)
+{
+    return clamp(rto->rto << rto->backoff);
+}
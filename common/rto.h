@@ -0,0 +1,31 @@
+//文件名: common/rto.h
+//
+//描述: 这个文件定义STCP的重传超时(RTO)估计器.
+//
+//每个连接根据RTT样本维护平滑的RTT(srtt)和RTT偏差(rttvar), RTO = srtt + 4 * rttvar, 限制在[RTO_MIN_MS, RTO_MAX_MS]之内.
+//按照Karn规则, 被重传过的段不产生样本, 因为无法区分确认对应的是哪一次发送; 超时后RTO加倍, 直到得到新的样本.
+//所有时间的单位都是毫秒.
+
+#ifndef RTO_H
+#define RTO_H
+
+typedef struct rto {
+    unsigned int srtt;              //平滑的RTT, 为0表示还没有样本
+    unsigned int rttvar;            //RTT偏差
+    unsigned int rto;               //未退避的RTO
+    unsigned int backoff;           //连续超时的次数
+} rto_t;
+
+//这个函数将估计器初始化为RTO_INIT_MS.
+void rto_init(rto_t* rto);
+
+//这个函数加入一个RTT样本rtt, 并清除退避. 调用者负责保证样本来自没有被重传过的段.
+void rto_sample(rto_t* rto, unsigned int rtt);
+
+//这个函数在一次超时之后调用, 使RTO加倍.
+void rto_backoff(rto_t* rto);
+
+//这个函数返回当前的RTO, 包括退避.
+unsigned int rto_get(const rto_t* rto);
+
+#endif
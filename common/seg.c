@@ -8,7 +8,10 @@
 
 #include "seg.h"
 #include "network.h"
+#include "shmring.h"
+#include "iov.h"
 #include <string.h>
+#include <pthread.h>
 
 //
 //
@@ -63,6 +66,74 @@ const char *seg_type_s(seg_t *seg)
 }
 
 
+/**
+ * @brief 串行化本进程中对 STCP-SIP 连接的写
+ *
+ * STCP 进程中应用线程和定时器线程都会发送段. 一个消息可能要多次 writev() 才能写完,
+ * 不加锁的话不同线程的消息会在连接上交错. 使用共享内存时由通道自己串行化.
+ */
+static pthread_mutex_t seg_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 发送一个 sendseg_arg_t 消息, 只传输节点ID, 段首部和首部中 length 指出的数据
+ * @param wait 为 0 时环或发送缓冲区满就不等待, 直接失败
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int seg_send(int conn, int nodeID, seg_t *seg, int wait)
+{
+    struct iovec iov[] = {
+        { .iov_base = &nodeID, .iov_len = sizeof(nodeID) },
+        { .iov_base = &seg->header, .iov_len = sizeof(seg->header) },
+        { .iov_base = seg->data, .iov_len = seg->header.length },
+    };
+    shmchan_t *chan = shmchan_of(conn);
+    if (chan != NULL) {
+        return wait ? shmchan_send(chan, iov, 3) : shmchan_trysend(chan, iov, 3);
+    }
+    pthread_mutex_lock(&seg_write_mutex);
+    int ret = wait ? writev_all(conn, iov, 3) : writev_nowait(conn, iov, 3);
+    pthread_mutex_unlock(&seg_write_mutex);
+    return ret;
+}
+
+/**
+ * @brief 接收一个 seg_send() 发送的消息
+ * @return 成功返回 0, 连接断开或消息不合法返回 -1
+ *
+ * 使用套接字时先读定长部分, 再按段首部中的 length 读数据.
+ */
+static int seg_recv(int conn, int *nodeID, seg_t *seg)
+{
+    const size_t fixed_len = sizeof(*nodeID) + sizeof(seg->header);
+    struct iovec iov[] = {
+        { .iov_base = nodeID, .iov_len = sizeof(*nodeID) },
+        { .iov_base = &seg->header, .iov_len = sizeof(seg->header) },
+        { .iov_base = seg->data, .iov_len = MAX_SEG_LEN },
+    };
+
+    shmchan_t *chan = shmchan_of(conn);
+    if (chan != NULL) {
+        int len = shmchan_recv(chan, iov, 3);
+        if (len == -1) {
+            return -1;
+        }
+        if ((size_t)len < fixed_len || seg->header.length > MAX_SEG_LEN || (size_t)len != fixed_len + seg->header.length) {
+            warn("invalid message of %d bytes on shared memory channel", len);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (readv_all(conn, iov, 2) == -1) {
+        return -1;
+    }
+    if (seg->header.length > MAX_SEG_LEN) {
+        warn("invalid seg length %d", seg->header.length);
+        return -1;
+    }
+    return read_all(conn, seg->data, seg->header.length);
+}
+
 //STCP进程使用这个函数发送sendseg_arg_t结构(包含段及其目的节点ID)给SIP进程.
 //参数sip_conn是在STCP进程和SIP进程之间连接的TCP描述符.
 //如果sendseg_arg_t发送成功,就返回1,否则返回-1.
@@ -70,16 +141,35 @@ unsigned short checksum(seg_t *seg);
 int sip_sendseg(int sip_conn, int dest_nodeID, seg_t* segptr)
 {
     segptr->header.checksum = checksum(segptr);
-    sendseg_arg_t pkt;
-    pkt.nodeID = dest_nodeID;
-    pkt.seg = *segptr;
-    if (send(sip_conn, &pkt, sizeof(pkt), 0) > 0) {
+    if (seg_send(sip_conn, dest_nodeID, segptr, 1) == 0) {
         return 1;
     } else {
         return -1;
     }
 }
 
+static int send_ctrl(int sip_conn, int ctrl, unsigned int port)
+{
+    seg_t seg;
+    memset(&seg.header, 0, sizeof(seg.header));
+    seg.header.src_port = port;
+    if (seg_send(sip_conn, ctrl, &seg, 1) == 0) {
+        return 1;
+    } else {
+        return -1;
+    }
+}
+
+int sip_regport(int sip_conn, unsigned int port)
+{
+    return send_ctrl(sip_conn, SIP_CTRL_REGPORT, port);
+}
+
+int sip_unregport(int sip_conn, unsigned int port)
+{
+    return send_ctrl(sip_conn, SIP_CTRL_UNREGPORT, port);
+}
+
 //STCP进程使用这个函数来接收来自SIP进程的包含段及其源节点ID的sendseg_arg_t结构.
 //参数sip_conn是STCP进程和SIP进程之间连接的TCP描述符.
 //当接收到段时, 使用seglost()来判断该段是否应被丢弃并检查校验和.
@@ -87,14 +177,10 @@ int sip_sendseg(int sip_conn, int dest_nodeID, seg_t* segptr)
 int checkchecksum(seg_t *seg);
 int sip_recvseg(int sip_conn, int* src_nodeID, seg_t* segptr)
 {
-    sendseg_arg_t pkt;
-    if (recv(sip_conn, &pkt, sizeof(pkt), 0) <= 0) {
+    if (seg_recv(sip_conn, src_nodeID, segptr) == -1) {
         return -1;
     }
 
-    *src_nodeID = pkt.nodeID;
-    *segptr = pkt.seg;
-
     if (checkchecksum(segptr) == -1) {
         return 2;
     }
@@ -116,10 +202,7 @@ int sip_recvseg(int sip_conn, int* src_nodeID, seg_t* segptr)
 //如果成功接收到sendseg_arg_t就返回1, 否则返回-1.
 int getsegToSend(int stcp_conn, int* dest_nodeID, seg_t* segPtr)
 {
-    sendseg_arg_t ptk;
-    if (recv(stcp_conn, &ptk, sizeof(ptk), 0) > 0) {
-        *dest_nodeID = ptk.nodeID;
-        *segPtr = ptk.seg;
+    if (seg_recv(stcp_conn, dest_nodeID, segPtr) == 0) {
         return 1;
     } else {
         return -1;
@@ -128,13 +211,11 @@ int getsegToSend(int stcp_conn, int* dest_nodeID, seg_t* segPtr)
 
 //SIP进程使用这个函数发送包含段及其源节点ID的sendseg_arg_t结构给STCP进程.
 //参数stcp_conn是STCP进程和SIP进程之间连接的TCP描述符.
+//SIP进程的一个线程要为所有STCP进程和过路的报文服务, 所以STCP进程来不及接收时不等待, 段被丢弃, 由STCP重传.
 //如果sendseg_arg_t被成功发送就返回1, 否则返回-1.
 int forwardsegToSTCP(int stcp_conn, int src_nodeID, seg_t* segPtr)
 {
-    sendseg_arg_t pkt;
-    pkt.nodeID = src_nodeID;
-    pkt.seg = *segPtr;
-    if (send(stcp_conn, &pkt, sizeof(pkt), 0) > 0) {
+    if (seg_send(stcp_conn, src_nodeID, segPtr, 0) == 0) {
         return 1;
     } else {
         return -1;
@@ -224,5 +305,9 @@ int checkchecksum(seg_t *seg)
     if (seg == NULL) {
         return 0;
     }
+    //seglost()可能翻转了length中的位, 这时不能按照length去读段之外的内存
+    if (seg->header.length > MAX_SEG_LEN) {
+        return 0;
+    }
     return calc_checksum(seg) == 0;
 }
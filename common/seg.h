@@ -27,7 +27,7 @@ typedef struct stcp_hdr {
     unsigned int ack_num;         //确认号
     unsigned short int length;    //段数据长度
     unsigned short int  type;     //段类型
-    unsigned short int  rcv_win;  //本实验未使用
+    unsigned short int  rcv_win;  //接收窗口: 发送方还能发送的字节数, 从确认号算起, 单位为(1 << STCP_RCV_WIN_SHIFT)字节
     unsigned short int checksum;  //这个段的校验和,本实验未使用
 } stcp_hdr_t;
 
@@ -38,6 +38,25 @@ typedef struct segment {
     char data[MAX_SEG_LEN];
 } seg_t;
 
+//SYN和SYNACK段的数据部分可以携带的连接选项.
+//客户端在SYN中提出请求, 服务器在SYNACK中给出双方采用的值. 不带选项的SYNACK表示服务器只支持GBN.
+typedef struct stcp_synopt {
+    unsigned int flags;           //STCP_SYNOPT_*
+    unsigned int window;          //窗口大小, 单位为段
+} stcp_synopt_t;
+
+#define STCP_SYNOPT_SR 0x1        //使用选择重传
+
+//选择重传模式下DATAACK段的数据部分携带的选择确认块, 表示服务器已经缓存了序号在[start, end)中的数据.
+//首部中的seq_num仍然是累积确认的序号.
+typedef struct stcp_sack {
+    unsigned int start;
+    unsigned int end;
+} stcp_sack_t;
+
+//一个DATAACK段最多携带的选择确认块数
+#define STCP_MAX_SACK 4
+
 // Return the string which describes the type of segment.
 const char *seg_type_s(seg_t *p);
 
@@ -45,11 +64,28 @@ const char *seg_type_s(seg_t *p);
 //它包含一个节点ID和一个段.
 //对sip_sendseg()来说, 节点ID是段的目标节点ID.
 //对sip_recvseg()来说, 节点ID是段的源节点ID.
+//连接上只传输节点ID, 段首部和首部中length指出的数据. 如果STCP进程在初始化时选择了共享内存(参见shmring.h),
+//同样的消息改为经过共享内存环传递, 下面四个函数通过shmchan_of()发现这一点, 调用者不需要区分两种传输方式.
 typedef struct sendsegargument {
 	int nodeID;		//节点ID
 	seg_t seg;		//一个段
 } sendseg_arg_t;
 
+//STCP进程发给SIP进程的控制消息也使用sendseg_arg_t, 以下面的负数作为节点ID, 端口号放在段首部的src_port中.
+//一个SIP进程可以同时服务多个STCP进程, 它根据这些消息登记的端口把发往本节点的段交给正确的STCP进程.
+enum {
+    SIP_CTRL_REGPORT = -2,          //登记端口
+    SIP_CTRL_UNREGPORT = -3,        //注销端口
+};
+
+//STCP进程在创建套接字后使用这个函数向SIP进程登记本地端口port, 此后目的端口为port的段会交给这个STCP进程.
+//如果消息发送成功, 就返回1, 否则返回-1.
+int sip_regport(int sip_conn, unsigned int port);
+
+//STCP进程在释放套接字时使用这个函数注销本地端口port.
+//如果消息发送成功, 就返回1, 否则返回-1.
+int sip_unregport(int sip_conn, unsigned int port);
+
 //STCP进程使用这个函数发送sendseg_arg_t结构(包含段及其目的节点ID)给SIP进程.
 //参数sip_conn是在STCP进程和SIP进程之间连接的TCP描述符.
 //如果sendseg_arg_t发送成功,就返回1,否则返回-1.
@@ -67,7 +103,7 @@ int sip_recvseg(int sip_conn, int* src_nodeID, seg_t* segPtr);
 int getsegToSend(int stcp_conn, int* dest_nodeID, seg_t* segPtr);
 
 //SIP进程使用这个函数发送包含段及其源节点ID的sendseg_arg_t结构给STCP进程.
-//参数stcp_conn是STCP进程和SIP进程之间连接的TCP描述符.
+//参数stcp_conn是STCP进程和SIP进程之间连接的TCP描述符. STCP进程来不及接收时不等待, 段被丢弃.
 //如果sendseg_arg_t被成功发送就返回1, 否则返回-1.
 int forwardsegToSTCP(int stcp_conn, int src_nodeID, seg_t* segPtr);
 
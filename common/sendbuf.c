@@ -0,0 +1,111 @@
+//文件名: common/sendbuf.c
+//
+//描述: 这个文件实现STCP发送方的发送缓冲区, 参见sendbuf.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include "sendbuf.h"
+
+int sendbuf_init(sendbuf_t *sb, unsigned int size, unsigned int seq)
+{
+    sb->data = malloc(size);
+    if (sb->data == NULL) {
+        return -1;
+    }
+    sb->size = size;
+    sb->una = sb->nxt = sb->end = seq;
+    sb->seg_head = sb->seg_tail = 0;
+    sb->ext = NULL;
+    sb->ext_seq = sb->ext_len = 0;
+    return 0;
+}
+
+void sendbuf_free(sendbuf_t *sb)
+{
+    free(sb->data);
+    sb->data = NULL;
+}
+
+unsigned int sendbuf_write(sendbuf_t *sb, const void *data, unsigned int len)
+{
+    if (sb->ext) {
+        return 0;
+    }
+    unsigned int space = sendbuf_room(sb);
+    if (len > space) {
+        len = space;
+    }
+    unsigned int off = sb->end & (sb->size - 1);
+    unsigned int first = sb->size - off < len ? sb->size - off : len;
+    memcpy(sb->data + off, data, first);
+    memcpy(sb->data, (const char *)data + first, len - first);
+    sb->end += len;
+    return len;
+}
+
+static void ring_read(const sendbuf_t *sb, unsigned int seq, void *dst, unsigned int len)
+{
+    unsigned int off = seq & (sb->size - 1);
+    unsigned int first = sb->size - off < len ? sb->size - off : len;
+    memcpy(dst, sb->data + off, first);
+    memcpy((char *)dst + first, sb->data, len - first);
+}
+
+void sendbuf_read(const sendbuf_t *sb, unsigned int seq, void *dst, unsigned int len)
+{
+    if (sb->ext == NULL) {
+        ring_read(sb, seq, dst, len);
+        return;
+    }
+    // 一个段可能跨过字节环中的数据和外部内存的边界, 外部内存之后不会再有数据
+    int ring = (int)(sb->ext_seq - seq);
+    if (ring > 0) {
+        unsigned int n = (unsigned int)ring < len ? (unsigned int)ring : len;
+        ring_read(sb, seq, dst, n);
+        dst = (char *)dst + n;
+        seq += n;
+        len -= n;
+    }
+    memcpy(dst, sb->ext + (seq - sb->ext_seq), len);
+}
+
+unsigned int sendbuf_attach(sendbuf_t *sb, const void *ext, unsigned int len)
+{
+    sb->ext = ext;
+    sb->ext_seq = sb->end;
+    sb->ext_len = len;
+    sb->end += len;
+    return sb->ext_seq;
+}
+
+void sendbuf_detach(sendbuf_t *sb)
+{
+    sb->ext = NULL;
+    sb->ext_len = 0;
+}
+
+sendseg_t *sendbuf_cut(sendbuf_t *sb, unsigned int len)
+{
+    sendseg_t *seg = &sb->segs[sb->seg_tail++ & (SENDBUF_MAX_SEGS - 1)];
+    seg->seq = sb->nxt;
+    seg->len = len;
+    seg->sentTime = 0;
+    seg->sacked = 0;
+    seg->retrans = 0;
+    sb->nxt += len;
+    return seg;
+}
+
+sendseg_t *sendbuf_seg(sendbuf_t *sb, unsigned int i)
+{
+    if (i >= sendbuf_inflight(sb)) {
+        return NULL;
+    }
+    return &sb->segs[(sb->seg_head + i) & (SENDBUF_MAX_SEGS - 1)];
+}
+
+void sendbuf_pop(sendbuf_t *sb)
+{
+    sendseg_t *seg = &sb->segs[sb->seg_head++ & (SENDBUF_MAX_SEGS - 1)];
+    sb->una = seg->seq + seg->len;
+}
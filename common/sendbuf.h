@@ -0,0 +1,100 @@
+//文件名: common/sendbuf.h
+//
+//描述: 这个文件定义STCP发送方的发送缓冲区.
+//
+//发送缓冲区由两部分组成:
+//  一个预先分配的字节环, 存放应用程序写入但还没有被确认的数据;
+//  一个段索引环, 记录已经发出但还没有被确认的每个段的序号, 长度和发送时刻.
+//stcp_client_send()只把数据复制进字节环, 段在发送时才从字节环中切出, 因此连续的小块写入会合并成完整的段.
+//序号是自由增长的计数器, 对环的大小取模后才是下标:
+//
+//      una                 nxt                 end
+//       |  已发送未确认    |  已写入未发送    |  空闲
+//
+//收到累积确认时只需要移动una和段索引环的头部, 不需要分配或释放内存.
+//
+//发送文件时, 一段外部的只读内存(文件的映射)可以挂接在end之后, 占用序号[ext_seq, ext_seq + ext_len).
+//这段序号范围内的数据在发送和重传时都直接从外部内存读取, 不经过字节环. 挂接期间不能再写入字节环,
+//外部内存在它的数据全部被确认之后才能摘除.
+
+#ifndef SENDBUF_H
+#define SENDBUF_H
+
+//一个已发送但未被确认的段
+typedef struct sendseg {
+    unsigned int seq;               //段的序号
+    unsigned int len;               //段数据长度
+    unsigned int sentTime;          //最近一次发送的时刻, 由clock_ms()得到
+    int sacked;                     //选择重传模式下, 服务器已经确认缓存了这个段
+    int retrans;                    //这个段被重传过, 按照Karn规则不能用于RTT采样
+} sendseg_t;
+
+//段索引环的容量, 必须是2的幂且不小于STCP_MAX_WINDOW
+#define SENDBUF_MAX_SEGS 64
+
+typedef struct sendbuf {
+    char* data;                     //字节环
+    unsigned int size;              //字节环的大小, 2的幂
+    unsigned int una;               //第一个未被确认的字节的序号
+    unsigned int nxt;               //第一个未发送的字节的序号
+    unsigned int end;               //下一个写入的字节的序号
+    unsigned int seg_head;          //段索引环中第一个未被确认的段
+    unsigned int seg_tail;          //段索引环中下一个段存放的位置
+    const char* ext;                //挂接的外部内存, 为NULL表示没有
+    unsigned int ext_seq;           //外部内存中第一个字节的序号
+    unsigned int ext_len;           //外部内存的字节数
+    sendseg_t segs[SENDBUF_MAX_SEGS];
+} sendbuf_t;
+
+//这个函数为发送缓冲区分配大小为size(2的幂)的字节环, 序号从seq开始. 成功时返回0, 失败时返回-1.
+int sendbuf_init(sendbuf_t* sb, unsigned int size, unsigned int seq);
+
+//这个函数释放字节环.
+void sendbuf_free(sendbuf_t* sb);
+
+//这个函数把data中最多len个字节复制进字节环, 返回复制的字节数. 字节环满或者挂接了外部内存时返回0.
+unsigned int sendbuf_write(sendbuf_t* sb, const void* data, unsigned int len);
+
+//这个函数把序号从seq开始的len个字节复制到dst中, 处理环的回绕. 落在外部内存范围内的字节从外部内存读取.
+void sendbuf_read(const sendbuf_t* sb, unsigned int seq, void* dst, unsigned int len);
+
+//这个函数把长度为len的外部内存挂接在已写入的数据之后, 返回它的第一个字节的序号. 调用者保证没有挂接其他外部内存.
+unsigned int sendbuf_attach(sendbuf_t* sb, const void* ext, unsigned int len);
+
+//这个函数摘除外部内存. 调用者保证它的数据已经全部被确认.
+void sendbuf_detach(sendbuf_t* sb);
+
+//这个函数从未发送的数据中切出一个长度为len的段, 记录在段索引环中并返回它. 调用者保证数据和索引环的空间都足够.
+sendseg_t* sendbuf_cut(sendbuf_t* sb, unsigned int len);
+
+//这个函数返回第i个已发送但未被确认的段, 不存在时返回NULL.
+sendseg_t* sendbuf_seg(sendbuf_t* sb, unsigned int i);
+
+//这个函数释放第一个已发送但未被确认的段, una前进到它的末尾.
+void sendbuf_pop(sendbuf_t* sb);
+
+//已发送但未被确认的段数
+static inline unsigned int sendbuf_inflight(const sendbuf_t* sb)
+{
+    return sb->seg_tail - sb->seg_head;
+}
+
+//已写入但未发送的字节数
+static inline unsigned int sendbuf_unsent(const sendbuf_t* sb)
+{
+    return sb->end - sb->nxt;
+}
+
+//字节环中的空闲字节数
+static inline unsigned int sendbuf_room(const sendbuf_t* sb)
+{
+    return sb->size - (sb->end - sb->una);
+}
+
+//所有写入的数据都已被确认
+static inline int sendbuf_empty(const sendbuf_t* sb)
+{
+    return sb->una == sb->end;
+}
+
+#endif
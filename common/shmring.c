@@ -0,0 +1,481 @@
+//文件名: common/shmring.c
+//
+//描述: 这个文件实现基于共享内存的本地消息通道, 参见shmring.h.
+
+#define _GNU_SOURCE  // memfd_create()
+#include "shmring.h"
+#include "common.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+//握手消息的魔数
+#define SHMCHAN_MAGIC 0x5348524eu
+
+//能与通道关联的套接字描述符的上限
+#define SHMCHAN_MAX_FD 1024
+
+//握手时随消息传递的描述符个数: memfd和四个eventfd
+#define SHMCHAN_NR_FDS 5
+
+/**
+ * @brief 握手消息
+ *
+ * 选择共享内存时, 随消息通过 SCM_RIGHTS 传递 memfd 和四个 eventfd.
+ * 两个环依次存放在共享内存中, 第一个由发起方生产, 第二个由接受方生产;
+ * 第一个 eventfd 用于唤醒接受方, 第二个用于唤醒发起方,
+ * 第三个在第一个环有空槽时唤醒发起方, 第四个在第二个环有空槽时唤醒接受方.
+ */
+typedef struct shmchan_hello {
+    unsigned int magic;
+    unsigned int transport;
+    unsigned int nr_slots;
+    unsigned int slot_size;
+} shmchan_hello_t;
+
+static shmchan_t *chans[SHMCHAN_MAX_FD];
+
+static inline size_t ring_bytes(unsigned int nr_slots, unsigned int slot_size)
+{
+    return sizeof(shmring_t) + (size_t)nr_slots * slot_size;
+}
+
+static inline unsigned int slot_size_for(size_t msg_max)
+{
+    // 槽的大小按 8 字节对齐
+    return (sizeof(unsigned int) + msg_max + 7) & ~7u;
+}
+
+static inline char *ring_slot(shmring_t *ring, unsigned int pos)
+{
+    return ring->slots + (size_t)(pos & (ring->nr_slots - 1)) * ring->slot_size;
+}
+
+/**
+ * @brief 将一条消息放入环
+ * @return 成功返回 0, 环满返回 -1
+ *
+ * 放入之后如果发现消费者已经取完了之前的所有消息, 说明环刚从空变为非空, 消费者可能正要睡眠, 需要唤醒它.
+ * 这里的全屏障与 ring_wait() 中的全屏障配对: 要么生产者看到消费者更新后的 head, 要么消费者看到新的 tail.
+ */
+static int ring_push(shmring_t *ring, int efd, const struct iovec *iov, int iovcnt)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ring->nr_slots) {
+        return -1;
+    }
+
+    char *slot = ring_slot(ring, tail);
+    unsigned int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(slot + sizeof(len) + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    memcpy(slot, &len, sizeof(len));
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) == tail) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) == -1) {
+            perror("eventfd write");
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 从环中取出一条消息
+ * @param space_efd 生产者因环满而睡眠时, 取出消息后用于唤醒它
+ * @return 消息长度, 环为空返回 0
+ *
+ * 这里的全屏障与 ring_wait_space() 中的全屏障配对: 要么消费者看到 full_wait, 要么生产者看到新的 head.
+ */
+static int ring_pop(shmring_t *ring, int space_efd, const struct iovec *iov, int iovcnt)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+
+    const char *slot = ring_slot(ring, head);
+    unsigned int len;
+    memcpy(&len, slot, sizeof(len));
+    unsigned int off = 0;
+    for (int i = 0; i < iovcnt && off < len; i++) {
+        size_t n = len - off < iov[i].iov_len ? len - off : iov[i].iov_len;
+        memcpy(iov[i].iov_base, slot + sizeof(len) + off, n);
+        off += n;
+    }
+    if (off < len) {
+        warn("message of %u bytes truncated to %u bytes", len, off);
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->full_wait, memory_order_relaxed) &&
+            atomic_exchange_explicit(&ring->full_wait, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(space_efd, &one, sizeof(one)) == -1) {
+            perror("eventfd write");
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief 在 rx 环为空时睡眠, 直到对端放入消息或退出
+ * @return 可能有新消息返回 0, 对端已经退出且环为空返回 -1
+ */
+static int ring_wait(shmchan_t *chan)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&chan->rx->tail, memory_order_relaxed) !=
+            atomic_load_explicit(&chan->rx->head, memory_order_relaxed)) {
+        return 0;
+    }
+
+    struct pollfd pfds[] = {
+        { .fd = chan->rx_efd, .events = POLLIN },
+        { .fd = chan->sock, .events = POLLIN },
+    };
+    while (poll(pfds, 2, -1) == -1) {
+        if (errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    }
+    if (pfds[0].revents & POLLIN) {
+        shmchan_clear(chan);
+        return 0;
+    }
+    // 对端退出前放入的消息仍然要交给调用者
+    return atomic_load_explicit(&chan->rx->tail, memory_order_acquire) !=
+           atomic_load_explicit(&chan->rx->head, memory_order_relaxed) ? 0 : -1;
+}
+
+/**
+ * @brief 在 tx 环满时睡眠, 直到对端取出消息或退出
+ * @return 可能有空槽返回 0, 对端已经退出返回 -1
+ *
+ * 使用共享内存时套接字上没有数据, 可读即意味着对端关闭了连接.
+ */
+static int ring_wait_space(shmchan_t *chan)
+{
+    shmring_t *ring = chan->tx;
+    atomic_store_explicit(&ring->full_wait, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->tail, memory_order_relaxed) -
+            atomic_load_explicit(&ring->head, memory_order_relaxed) != ring->nr_slots) {
+        return 0;
+    }
+
+    struct pollfd pfds[] = {
+        { .fd = chan->tx_space_efd, .events = POLLIN },
+        { .fd = chan->sock, .events = POLLIN },
+    };
+    while (poll(pfds, 2, -1) == -1) {
+        if (errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    }
+    if (pfds[0].revents & POLLIN) {
+        uint64_t count;
+        if (read(chan->tx_space_efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            perror("eventfd read");
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static int chan_send(shmchan_t *chan, const struct iovec *iov, int iovcnt, int wait)
+{
+    if (iov_len(iov, iovcnt) > chan->tx->slot_size - sizeof(unsigned int)) {
+        warn("message of %zu bytes is too long for the ring", iov_len(iov, iovcnt));
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan->tx_mutex);
+    int ret;
+    while ((ret = ring_push(chan->tx, chan->tx_efd, iov, iovcnt)) == -1 && wait) {
+        if (ring_wait_space(chan) == -1) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&chan->tx_mutex);
+    return ret;
+}
+
+int shmchan_send(shmchan_t *chan, const struct iovec *iov, int iovcnt)
+{
+    return chan_send(chan, iov, iovcnt, 1);
+}
+
+int shmchan_trysend(shmchan_t *chan, const struct iovec *iov, int iovcnt)
+{
+    return chan_send(chan, iov, iovcnt, 0);
+}
+
+int shmchan_recv(shmchan_t *chan, const struct iovec *iov, int iovcnt)
+{
+    for (;;) {
+        int len = ring_pop(chan->rx, chan->rx_space_efd, iov, iovcnt);
+        if (len > 0) {
+            return len;
+        }
+        if (ring_wait(chan) == -1) {
+            return -1;
+        }
+    }
+}
+
+int shmchan_tryrecv(shmchan_t *chan, const struct iovec *iov, int iovcnt)
+{
+    return ring_pop(chan->rx, chan->rx_space_efd, iov, iovcnt);
+}
+
+void shmchan_clear(shmchan_t *chan)
+{
+    uint64_t count;
+    if (read(chan->rx_efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+}
+
+shmchan_t *shmchan_of(int sock)
+{
+    if (sock < 0 || sock >= SHMCHAN_MAX_FD) {
+        return NULL;
+    }
+    return chans[sock];
+}
+
+static shmchan_t *chan_attach(int sock, void *map, size_t map_len, int initiator, const int efds[4])
+{
+    shmring_t *first = map;
+    shmring_t *second = (void *)((char *)map + map_len / 2);
+
+    shmchan_t *chan = calloc(1, sizeof(*chan));
+    chan->sock = sock;
+    chan->map = map;
+    chan->map_len = map_len;
+    chan->tx = initiator ? first : second;
+    chan->rx = initiator ? second : first;
+    chan->tx_efd = initiator ? efds[0] : efds[1];
+    chan->rx_efd = initiator ? efds[1] : efds[0];
+    chan->tx_space_efd = initiator ? efds[2] : efds[3];
+    chan->rx_space_efd = initiator ? efds[3] : efds[2];
+    pthread_mutex_init(&chan->tx_mutex, NULL);
+    chans[sock] = chan;
+    return chan;
+}
+
+void shmchan_detach(int sock)
+{
+    shmchan_t *chan = shmchan_of(sock);
+    if (chan == NULL) {
+        return;
+    }
+    chans[sock] = NULL;
+    munmap(chan->map, chan->map_len);
+    close(chan->tx_efd);
+    close(chan->rx_efd);
+    close(chan->tx_space_efd);
+    close(chan->rx_space_efd);
+    pthread_mutex_destroy(&chan->tx_mutex);
+    free(chan);
+}
+
+int shmchan_offer(int sock, int transport, size_t msg_max, unsigned int nr_slots, shmchan_t **pchan)
+{
+    shmchan_hello_t hello = {
+        .magic = SHMCHAN_MAGIC,
+        .transport = transport,
+    };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    *pchan = NULL;
+
+    if (transport == SHMCHAN_SOCKET) {
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello) ? 0 : -1;
+    }
+
+    if (sock >= SHMCHAN_MAX_FD || (nr_slots & (nr_slots - 1)) != 0) {
+        warn("cannot create ring of %u slots on fd %d", nr_slots, sock);
+        return -1;
+    }
+
+    hello.nr_slots = nr_slots;
+    hello.slot_size = slot_size_for(msg_max);
+    size_t map_len = 2 * ring_bytes(hello.nr_slots, hello.slot_size);
+
+    int fds[SHMCHAN_NR_FDS];
+    for (int i = 0; i < SHMCHAN_NR_FDS; i++) {
+        fds[i] = -1;
+    }
+    void *map = MAP_FAILED;
+    fds[0] = memfd_create("shmchan", MFD_CLOEXEC);
+    if (fds[0] == -1 || ftruncate(fds[0], map_len) == -1) {
+        perror("memfd");
+        goto fail;
+    }
+    for (int i = 1; i < SHMCHAN_NR_FDS; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fds[i] == -1) {
+            perror("eventfd");
+            goto fail;
+        }
+    }
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        shmring_t *ring = (void *)((char *)map + i * map_len / 2);
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->full_wait, 0);
+        ring->nr_slots = hello.nr_slots;
+        ring->slot_size = hello.slot_size;
+    }
+
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        perror("sendmsg");
+        goto fail;
+    }
+    close(fds[0]);  // 映射不依赖于描述符
+
+    *pchan = chan_attach(sock, map, map_len, 1, fds + 1);
+    return 0;
+
+fail:
+    if (map != MAP_FAILED) {
+        munmap(map, map_len);
+    }
+    for (int i = 0; i < SHMCHAN_NR_FDS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 接收握手消息并按照对端的选择建立通道
+ * @param flags 传给 recvmsg() 的标志, 带 MSG_DONTWAIT 时不等待握手消息
+ * @return 成功返回 0, 失败返回 -1, 不等待且握手消息还没有到达返回 1
+ */
+static int chan_answer(int sock, size_t msg_max, shmchan_t **pchan, int flags)
+{
+    shmchan_hello_t hello;
+    int fds[SHMCHAN_NR_FDS];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+    *pchan = NULL;
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    }
+    if (n != sizeof(hello) || hello.magic != SHMCHAN_MAGIC) {
+        warn("bad handshake on fd %d", sock);
+        return -1;
+    }
+    if (hello.transport == SHMCHAN_SOCKET) {
+        return 0;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        warn("no ring passed on fd %d", sock);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    size_t map_len;
+    if (sock >= SHMCHAN_MAX_FD) {
+        warn("fd %d cannot be associated with a ring", sock);
+        goto fail;
+    }
+    // 环的参数来自对端, 映射之前必须确认它们与本进程的预期一致, 并且共享内存足够大
+    if (hello.nr_slots == 0 || (hello.nr_slots & (hello.nr_slots - 1)) != 0 ||
+            hello.slot_size != slot_size_for(msg_max)) {
+        warn("bad ring of %u slots of %u bytes on fd %d", hello.nr_slots, hello.slot_size, sock);
+        goto fail;
+    }
+    map_len = 2 * ring_bytes(hello.nr_slots, hello.slot_size);
+    struct stat st;
+    if (fstat(fds[0], &st) == -1) {
+        perror("fstat");
+        goto fail;
+    }
+    if ((size_t)st.st_size < map_len) {
+        warn("shared memory of %lld bytes is too small for the ring on fd %d", (long long)st.st_size, sock);
+        goto fail;
+    }
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    close(fds[0]);
+
+    *pchan = chan_attach(sock, map, map_len, 0, fds + 1);
+    return 0;
+
+fail:
+    for (int i = 0; i < SHMCHAN_NR_FDS; i++) {
+        close(fds[i]);
+    }
+    return -1;
+}
+
+int shmchan_answer(int sock, size_t msg_max, shmchan_t **pchan)
+{
+    return chan_answer(sock, msg_max, pchan, MSG_WAITALL);
+}
+
+int shmchan_tryanswer(int sock, size_t msg_max, shmchan_t **pchan)
+{
+    // 握手消息很短, 发起方用一次 sendmsg() 发出, 在 unix domain 套接字上总是整个到达
+    return chan_answer(sock, msg_max, pchan, MSG_DONTWAIT);
+}
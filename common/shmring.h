@@ -0,0 +1,94 @@
+//文件名: common/shmring.h
+//
+//描述: 这个文件定义本地进程之间基于共享内存的消息通道.
+//
+//一个通道由一段memfd共享内存中的两个单生产者/单消费者无锁环组成, 每个方向一个, 环的每个槽存放一条消息.
+//生产者只在环从空变为非空时通过eventfd唤醒消费者, 消费者在睡眠之前会把环取空, 因此繁忙时收发消息不需要系统调用.
+//环满时生产者登记后睡眠在另一个eventfd上, 消费者取出消息后发现有生产者在等待才唤醒它.
+//
+//通道建立在已有的unix domain连接之上: 发起连接的一方调用shmchan_offer(), 接受连接的一方调用shmchan_answer().
+//双方先交换一个握手消息, 由发起方决定这条连接使用共享内存还是继续使用套接字本身传输消息.
+//使用共享内存时, memfd和四个eventfd随握手消息通过SCM_RIGHTS传递, 原来的套接字此后只用于检测对端退出.
+//握手成功后通道与套接字描述符关联, 之后可以用shmchan_of()通过套接字描述符找到它,
+//因此pkt.c和seg.c中以套接字描述符为参数的收发函数不需要改变接口.
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+//握手时可以选择的传输方式
+enum {
+    SHMCHAN_SOCKET,         //继续使用unix domain套接字传输消息
+    SHMCHAN_SHM,            //使用共享内存环传输消息
+};
+
+//共享内存中的单生产者/单消费者环.
+//head和tail是自由增长的计数器, 分别由消费者和生产者独占写, 放在不同的缓存行中以避免伪共享.
+typedef struct shmring {
+    _Atomic unsigned int head;      //下一个要取出的槽
+    char pad0[64 - sizeof(unsigned int)];
+    _Atomic unsigned int tail;      //下一个要放入的槽
+    _Atomic unsigned int full_wait; //生产者因环满而睡眠时置1, 由消费者清除
+    char pad1[64 - 2 * sizeof(unsigned int)];
+    unsigned int nr_slots;          //槽数, 2的幂
+    unsigned int slot_size;         //每个槽的字节数, 包括开头记录消息长度的unsigned int
+    char pad2[64 - 2 * sizeof(unsigned int)];
+    char slots[];
+} shmring_t;
+
+//一个进程看到的双向通道
+typedef struct shmchan {
+    int sock;                       //建立通道的unix domain套接字, 只用于检测对端退出
+    shmring_t* tx;                  //本进程生产的环
+    shmring_t* rx;                  //本进程消费的环
+    int tx_efd;                     //tx从空变为非空时用于唤醒对端
+    int rx_efd;                     //对端用于唤醒本进程
+    int tx_space_efd;               //tx满时本进程在上面睡眠, 对端取出消息后用于唤醒本进程
+    int rx_space_efd;               //对端因rx满而睡眠时用于唤醒对端
+    void* map;                      //共享内存映射
+    size_t map_len;
+    pthread_mutex_t tx_mutex;       //本进程中可能有多个线程生产消息, 放入环之前需要串行化
+} shmchan_t;
+
+// 发起连接的一方调用这个函数, 在套接字sock上发送握手消息.
+// transport为SHMCHAN_SHM时, 创建槽数为nr_slots(2的幂), 每条消息最长msg_max字节的两个环, 并将共享内存交给对端.
+// 成功时返回0, *chan为建立的通道(使用套接字传输时为NULL); 失败时返回-1.
+int shmchan_offer(int sock, int transport, size_t msg_max, unsigned int nr_slots, shmchan_t** chan);
+
+// 接受连接的一方调用这个函数, 从套接字sock上接收握手消息并按照对端的选择建立通道.
+// msg_max必须与对端调用shmchan_offer()时相同, 对端给出的环与之不符时握手失败.
+// 成功时返回0, *chan为建立的通道(对端选择使用套接字传输时为NULL); 失败时返回-1.
+int shmchan_answer(int sock, size_t msg_max, shmchan_t** chan);
+
+// 与shmchan_answer()相同, 但握手消息还没有到达时不等待, 直接返回1. 供事件驱动的接受方使用.
+int shmchan_tryanswer(int sock, size_t msg_max, shmchan_t** chan);
+
+// 返回与套接字sock关联的通道, 没有关联时返回NULL.
+shmchan_t* shmchan_of(int sock);
+
+// 解除通道与套接字的关联并释放通道, 套接字本身由调用者关闭.
+void shmchan_detach(int sock);
+
+// 将iov描述的一条消息放入通道. 环满时等待消费者取走消息.
+// 成功时返回0, 对端已经退出或消息太长时返回-1.
+int shmchan_send(shmchan_t* chan, const struct iovec* iov, int iovcnt);
+
+// 同shmchan_send(), 但环满时不等待, 直接返回-1.
+int shmchan_trysend(shmchan_t* chan, const struct iovec* iov, int iovcnt);
+
+// 从通道中取出一条消息, 依次填入iov描述的缓冲区. 通道为空时睡眠等待.
+// 返回消息长度, 对端已经退出且通道已空时返回-1.
+int shmchan_recv(shmchan_t* chan, const struct iovec* iov, int iovcnt);
+
+// 同shmchan_recv(), 但通道为空时不等待, 直接返回0.
+// 用于事件循环: 对rx_efd可读的事件, 先调用shmchan_clear()再反复调用这个函数直到返回0.
+int shmchan_tryrecv(shmchan_t* chan, const struct iovec* iov, int iovcnt);
+
+// 清除rx_efd上的唤醒计数.
+void shmchan_clear(shmchan_t* chan);
+
+#endif
@@ -0,0 +1,130 @@
+//文件名: common/stcp_poll.c
+//
+//描述: 这个文件实现STCP套接字的就绪通知, 参见stcp_poll.h.
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "stcp_poll.h"
+#include "common.h"
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+//每次通知加1. 等待者记下扫描之前的值, 值变了才需要重新扫描
+static _Atomic unsigned long seq;
+//阻塞在cond上的线程数, 为0时通知不需要加锁
+static _Atomic int nr_waiters;
+//通知器的eventfd, 为-1表示还没有创建
+static _Atomic int efd = -1;
+//eventfd已经被写过, 还没有被poll清空
+static atomic_int efd_signalled;
+
+static void init_cond(void)
+{
+    cond_init_monotonic(&cond);
+}
+
+void stcp_poll_notify(void)
+{
+    atomic_fetch_add(&seq, 1);
+    // 等待者在持有lock时增加nr_waiters之后才检查seq, 两边之中至少有一边能看到对方的修改
+    if (atomic_load(&nr_waiters) > 0) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+    int fd = atomic_load(&efd);
+    if (fd != -1 && !atomic_exchange(&efd_signalled, 1)) {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) == -1) {
+            perror("eventfd write");
+        }
+    }
+}
+
+int stcp_poll_eventfd(void)
+{
+    pthread_mutex_lock(&lock);
+    if (atomic_load(&efd) == -1) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            perror("eventfd");
+        }
+        atomic_store(&efd, fd);
+    }
+    pthread_mutex_unlock(&lock);
+    return atomic_load(&efd);
+}
+
+/**
+ * @brief 查询每个套接字, 填写 revents
+ * @return 就绪的套接字数
+ */
+static int scan(stcp_pollfd_t *fds, int nfds, short (*query)(int))
+{
+    int nr_ready = 0;
+    for (int i = 0; i < nfds; i++) {
+        short mask = fds[i].events | STCP_POLLHUP | STCP_POLLNVAL;
+        fds[i].revents = query(fds[i].sockfd) & mask;
+        if (fds[i].revents) {
+            nr_ready++;
+        }
+    }
+    return nr_ready;
+}
+
+int stcp_poll_wait(stcp_pollfd_t *fds, int nfds, int timeout, short (*query)(int))
+{
+    pthread_once(&once, init_cond);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout > 0) {
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    // 先清空 eventfd 再扫描: 扫描之后发生的变化会再次写 eventfd
+    int fd = atomic_load(&efd);
+    if (fd != -1) {
+        uint64_t cnt;
+        if (read(fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+            perror("eventfd read");
+        }
+        atomic_store(&efd_signalled, 0);
+    }
+
+    for (;;) {
+        unsigned long seen = atomic_load(&seq);
+        int nr_ready = scan(fds, nfds, query);
+        if (nr_ready > 0 || timeout == 0) {
+            return nr_ready;
+        }
+
+        int expired = 0;
+        pthread_mutex_lock(&lock);
+        atomic_fetch_add(&nr_waiters, 1);
+        while (atomic_load(&seq) == seen && !expired) {
+            if (timeout < 0) {
+                pthread_cond_wait(&cond, &lock);
+            } else {
+                expired = pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT;
+            }
+        }
+        atomic_fetch_sub(&nr_waiters, 1);
+        pthread_mutex_unlock(&lock);
+        if (expired) {
+            return scan(fds, nfds, query);
+        }
+    }
+}
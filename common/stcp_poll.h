@@ -0,0 +1,44 @@
+//文件名: common/stcp_poll.h
+//
+//描述: 这个文件定义STCP套接字的就绪通知.
+//
+//stcp_client_poll()和stcp_server_poll()类似poll(2): 应用程序给出一组套接字和关心的事件,
+//调用阻塞直到其中至少一个套接字就绪或者超时, 然后在revents中返回每个套接字就绪的事件.
+//事件都是水平触发的, 只要条件成立就一直报告.
+//
+//本进程中所有STCP套接字共享一个通知器. 数据通路和状态机在就绪条件可能发生变化时(数据到达, 确认腾出了
+//发送缓冲区的空间, 连接建立或关闭)调用stcp_poll_notify(), 它唤醒阻塞在poll中的线程. 通知器还可以提供一个
+//eventfd: 应用程序把它加入自己的epoll, 它可读时用超时0调用poll取得就绪的套接字. poll会清空这个eventfd,
+//之后的通知再次使它可读. 没有人取走eventfd时通知不需要系统调用.
+
+#ifndef STCP_POLL_H
+#define STCP_POLL_H
+
+//接收缓冲区中有数据, recv_some不会阻塞
+#define STCP_POLLIN     0x01
+//发送缓冲区中有空间, send_some不会阻塞
+#define STCP_POLLOUT    0x02
+//服务器套接字上的连接已经建立, 参见stcp_server_listen()
+#define STCP_POLLACCEPT 0x04
+//连接已经关闭, 总是报告, 不需要在events中请求
+#define STCP_POLLHUP    0x08
+//套接字无效, 总是报告
+#define STCP_POLLNVAL   0x10
+
+typedef struct stcp_pollfd {
+    int sockfd;                     //套接字ID
+    short events;                   //关心的事件
+    short revents;                  //就绪的事件, 由poll填写
+} stcp_pollfd_t;
+
+//这个函数通知等待者某些套接字的就绪条件可能发生了变化. 可以在持有任何锁时调用.
+void stcp_poll_notify(void);
+
+//这个函数返回通知器的eventfd, 第一次调用时创建. 失败时返回-1.
+int stcp_poll_eventfd(void);
+
+//这个函数是stcp_client_poll()和stcp_server_poll()的公共部分. query(sockfd)返回一个套接字当前就绪的全部事件.
+//timeout是毫秒数, 为-1时一直等待. 返回就绪的套接字数, 超时返回0.
+int stcp_poll_wait(stcp_pollfd_t* fds, int nfds, int timeout, short (*query)(int sockfd));
+
+#endif
@@ -0,0 +1,697 @@
+//文件名: common/stream.c
+//
+//描述: 这个文件实现STCP连接的数据通路, 参见stream.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stream.h"
+#include "stcp_poll.h"
+#include "constants.h"
+#include "common.h"
+
+/**
+ * @brief 内部日志信息，自动输出所属的 tcb。
+ */
+#define LOG(st, fmt, ...) \
+    log(MAGENTA "{tcb:%p} " NORMAL fmt, (st)->owner, ## __VA_ARGS__)
+
+static void rtx_timeout(void *arg);
+static void delack_timeout(void *arg);
+
+int stream_init(stream_t *st, timerwheel_t *timers, void (*output)(void *, seg_t *), void *owner)
+{
+    memset(st, 0, sizeof(*st));
+    if (sendbuf_init(&st->sndbuf, STCP_SNDBUF_SIZE, 0) == -1) {
+        return -1;
+    }
+    if (recvbuf_init(&st->rcvbuf, RECEIVE_BUF_SIZE) == -1) {
+        sendbuf_free(&st->sndbuf);
+        return -1;
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    cond_init_monotonic(&st->sndCond);
+    pthread_cond_init(&st->rcvCond, NULL);
+    st->output = output;
+    st->owner = owner;
+    st->timers = timers;
+    st->window = GBN_WINDOW;
+    tw_timer_init(&st->rtx_timer, rtx_timeout, st);
+    tw_timer_init(&st->delack_timer, delack_timeout, st);
+    rto_init(&st->rto);
+    cc_init(&st->cc, CC_RENO);
+    st->snd_wnd = RECEIVE_BUF_SIZE;
+    st->rcv_wnd_adv = RECEIVE_BUF_SIZE;
+    return 0;
+}
+
+void stream_free(stream_t *st)
+{
+    // 定时器的回调函数会访问 st, 释放之前要等它结束
+    timerwheel_del_sync(st->timers, &st->rtx_timer);
+    timerwheel_del_sync(st->timers, &st->delack_timer);
+    while (st->oooHead) {
+        oooSeg_t *tmp = st->oooHead;
+        st->oooHead = tmp->next;
+        free(tmp);
+    }
+    sendbuf_free(&st->sndbuf);
+    recvbuf_free(&st->rcvbuf);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->sndCond);
+    pthread_cond_destroy(&st->rcvCond);
+}
+
+void stream_shutdown(stream_t *st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->closed = 1;
+    pthread_cond_broadcast(&st->sndCond);
+    pthread_cond_broadcast(&st->rcvCond);
+    pthread_mutex_unlock(&st->lock);
+    stcp_poll_notify();
+}
+
+/*接收方向*/
+
+/**
+ * @brief 计算要通告的接收窗口, 并记录在 rcv_wnd_adv 中. 调用者持有 lock.
+ * @return 段首部中 rcv_win 字段的值
+ */
+static unsigned short rcv_win_locked(stream_t *st)
+{
+    unsigned int room = recvbuf_room(&st->rcvbuf);
+    st->rcv_wnd_adv = room >> STCP_RCV_WIN_SHIFT << STCP_RCV_WIN_SHIFT;
+    return room >> STCP_RCV_WIN_SHIFT;
+}
+
+unsigned short stream_rcv_win(stream_t *st)
+{
+    pthread_mutex_lock(&st->lock);
+    unsigned short win = rcv_win_locked(st);
+    pthread_mutex_unlock(&st->lock);
+    return win;
+}
+
+/**
+ * @brief 累积确认已经随 DATAACK 或 DATA 段发出, 取消延迟确认. 调用者持有 lock.
+ */
+static void ack_sent(stream_t *st)
+{
+    if (st->ack_pending != 0) {
+        st->ack_pending = 0;
+        timerwheel_del(st->timers, &st->delack_timer);
+    }
+}
+
+/**
+ * @brief 发送 DATAACK, 通告当前的累积确认和接收窗口. 调用者持有 lock.
+ * @param with_sacks 选择重传模式下是否把缓存的乱序段合并成选择确认块放在数据部分中
+ */
+static void send_dataack(stream_t *st, int with_sacks)
+{
+    seg_t ack = {
+        .header.length = 0,
+        .header.type = DATAACK,
+        .header.seq_num = st->rcv_nxt,
+        .header.rcv_win = rcv_win_locked(st),
+    };
+    stcp_sack_t sacks[STCP_MAX_SACK];
+    int nr_sacks = 0;
+    for (const oooSeg_t *ooo = with_sacks ? st->oooHead : NULL; ooo != NULL; ooo = ooo->next) {
+        if (nr_sacks > 0 && sacks[nr_sacks - 1].end == ooo->seq) {
+            sacks[nr_sacks - 1].end += ooo->length;
+        } else if (nr_sacks < STCP_MAX_SACK) {
+            sacks[nr_sacks].start = ooo->seq;
+            sacks[nr_sacks].end = ooo->seq + ooo->length;
+            nr_sacks++;
+        } else {
+            break;
+        }
+    }
+    ack.header.length = nr_sacks * sizeof(sacks[0]);
+    memcpy(ack.data, sacks, ack.header.length);
+    ack_sent(st);
+    st->nr_dataacks++;
+    st->output(st->owner, &ack);
+}
+
+/**
+ * @brief 按序的段已经交付, 又没有数据可以捎带确认时调用. 调用者持有 lock.
+ *
+ * 攒够 STCP_DELACK_SEGS 个段时立即确认, 否则启动延迟确认定时器. 对方按被确认的段数增长拥塞窗口,
+ * 并用触发确认的最后一个段采样 RTT, 所以攒段不影响它的 RTT 估计, 只有定时器到期发出的确认会晚到 STCP_DELACK_MS.
+ * 接收缓冲区放不下对方在延迟期间可能发来的数据时也立即确认, 否则对方会在过时的窗口上停下来.
+ */
+static void delay_ack(stream_t *st)
+{
+    if (++st->ack_pending >= STCP_DELACK_SEGS || recvbuf_room(&st->rcvbuf) < STCP_DELACK_SEGS * MAX_SEG_LEN) {
+        send_dataack(st, 1);
+    } else if (st->ack_pending == 1) {
+        timerwheel_add(st->timers, &st->delack_timer, STCP_DELACK_MS);
+    }
+}
+
+/**
+ * @brief 延迟确认定时器到期, 由时间轮线程调用
+ */
+static void delack_timeout(void *arg)
+{
+    stream_t *st = arg;
+    pthread_mutex_lock(&st->lock);
+    if (!st->closed && st->ack_pending != 0) {
+        send_dataack(st, 1);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief 把数据追加到接收缓冲区, 读者在等待且数据已经足够时唤醒它. 调用者持有 lock.
+ * @return 成功返回 0, 接收缓冲区放不下返回 -1
+ */
+static int deliver(stream_t *st, const char *data, unsigned int length)
+{
+    if (recvbuf_write(&st->rcvbuf, data, length) == -1) {
+        return -1;
+    }
+    st->rcv_nxt += length;
+    if (st->recv_need != 0 && recvbuf_used(&st->rcvbuf) >= st->recv_need) {
+        pthread_cond_signal(&st->rcvCond);
+    }
+    stcp_poll_notify();
+    return 0;
+}
+
+/**
+ * @brief 处理 DATA 段的数据部分. 调用者持有 lock.
+ * @return 需要立即用 DATAACK 回复时返回 1, 确认可以延迟或者捎带在之后发出的 DATA 段上时返回 0
+ *
+ * 按序到达的段交给接收缓冲区. 选择重传模式下, 之后缓存中与之相连的乱序段也依次交付;
+ * 窗口之内的乱序段按序号插入缓存. GBN 模式下乱序的段直接丢弃.
+ * 乱序, 重复, 放不下的段和零窗口探测都需要立即回复, 发送方靠重复确认和窗口更新做出反应.
+ */
+static int input_data(stream_t *st, seg_t *seg)
+{
+    unsigned int seq = seg->header.seq_num;
+    unsigned int length = seg->header.length;
+    if (length == 0) {
+        return 1;
+    } else if (seq == st->rcv_nxt) {
+        if (deliver(st, seg->data, length) == -1) {
+            LOG(st, "seq %u exceeds the recv buffer size, discarded", seq);
+            return 1;
+        }
+        int filled = st->oooHead != NULL;
+        while (st->oooHead && (int)(st->oooHead->seq - st->rcv_nxt) <= 0) {
+            oooSeg_t *ooo = st->oooHead;
+            if (ooo->seq == st->rcv_nxt && deliver(st, ooo->data, ooo->length) == -1) {
+                break;
+            }
+            st->oooHead = ooo->next;
+            free(ooo);
+        }
+        // 填补了空洞的段多半是重传, 对方在等它的确认才能走出恢复; 缓存中还有乱序段时, 对方需要最新的选择确认块
+        return filled;
+    } else if (st->sr && seq - st->rcv_nxt < st->window * MAX_SEG_LEN) {
+        oooSeg_t **pos = &st->oooHead;
+        while (*pos && (int)((*pos)->seq - seq) < 0) {
+            pos = &(*pos)->next;
+        }
+        if (*pos == NULL || (*pos)->seq != seq) {
+            oooSeg_t *ooo = malloc(sizeof(*ooo) + length);
+            if (ooo != NULL) {
+                ooo->seq = seq;
+                ooo->length = length;
+                memcpy(ooo->data, seg->data, length);
+                ooo->next = *pos;
+                *pos = ooo;
+                LOG(st, "buffers out-of-order seq %u (expected %u)", seq, st->rcv_nxt);
+            }
+        }
+    } else {
+        LOG(st, "expects seq num %u, but receives %u", st->rcv_nxt, seq);
+    }
+    return 1;
+}
+
+int stream_recv(stream_t *st, void *buf, unsigned int length, unsigned int need)
+{
+    if (need > RECEIVE_BUF_SIZE) {
+        LOG(st, "cannot wait for %u bytes, more than the recv buffer holds", need);
+        return -1;
+    }
+    pthread_mutex_lock(&st->lock);
+    while (recvbuf_used(&st->rcvbuf) < need) {
+        if (st->closed) {
+            pthread_mutex_unlock(&st->lock);
+            return -1;
+        }
+        st->recv_need = need;
+        pthread_cond_wait(&st->rcvCond, &st->lock);
+    }
+    st->recv_need = 0;
+    unsigned int n = recvbuf_read(&st->rcvbuf, buf, length);
+    // 之前通告的窗口放不下一个最长的段时, 对方在等待窗口打开, 需要主动告诉它
+    if (st->rcv_wnd_adv < MAX_SEG_LEN && recvbuf_room(&st->rcvbuf) >= MAX_SEG_LEN) {
+        send_dataack(st, 0);
+        LOG(st, "sends window update (%u bytes)", st->rcv_wnd_adv);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return n;
+}
+
+/*发送方向*/
+
+/**
+ * @brief 发送窗口: 协商的窗口和拥塞窗口中较小的一个, 单位为段
+ */
+static inline unsigned int send_window(const stream_t *st)
+{
+    return st->cc.cwnd < st->window ? st->cc.cwnd : st->window;
+}
+
+/**
+ * @brief 对方通告的接收窗口是否放得下结束于序号end的数据. 调用者持有lock.
+ */
+static inline int rwnd_allows(const stream_t *st, unsigned int end)
+{
+    return end - st->snd_una <= st->snd_wnd;
+}
+
+void stream_set_peer_window(stream_t *st, unsigned short rcv_win)
+{
+    pthread_mutex_lock(&st->lock);
+    st->snd_wnd = rcv_win << STCP_RCV_WIN_SHIFT;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief 从发送缓冲区中取出序号从 seq 开始的 len 个字节, 组成 DATA 段发出. 调用者持有lock.
+ *
+ * 段在每次发送时才组装, 发送缓冲区中只保存数据本身. 每个 DATA 段都捎带接收方向的确认和窗口.
+ * len 为 0 时就是零窗口探测, 对方会用 DATAACK 回复当前的接收窗口.
+ */
+static void send_data(stream_t *st, unsigned int seq, unsigned int len)
+{
+    seg_t seg = {
+        .header.seq_num = seq,
+        .header.ack_num = st->rcv_nxt,
+        .header.length = len,
+        .header.type = DATA,
+        .header.rcv_win = rcv_win_locked(st),
+    };
+    sendbuf_read(&st->sndbuf, seq, seg.data, len);
+    ack_sent(st);
+    st->output(st->owner, &seg);
+}
+
+/**
+ * @brief 在窗口允许的范围内从发送缓冲区中切出新段并发出. 调用者持有lock.
+ * @return 发出的段数
+ *
+ * 每个段最长MAX_SEG_LEN. 不足一个完整段的尾部数据只在没有段在途中时发出, 否则等到后续的写入把它补满,
+ * 或者确认把在途的段清空为止(Nagle算法), 这样连续的小块写入会合并成完整的段.
+ * 应用程序塞住(cork)数据通路时, 即使没有段在途中, 尾部数据也要等到解除塞住.
+ * 接收窗口放不下下一个段且没有段在途中时, 重传定时器兼作坚持定时器, 到期时发送零窗口探测.
+ */
+static int transmit(stream_t *st)
+{
+    sendbuf_t *sb = &st->sndbuf;
+    unsigned int now = clock_ms();
+    int nr_sent = 0;
+    while (sendbuf_unsent(sb) > 0 && sendbuf_inflight(sb) < send_window(st)) {
+        unsigned int len = sendbuf_unsent(sb) < MAX_SEG_LEN ? sendbuf_unsent(sb) : MAX_SEG_LEN;
+        // 塞住时不足一个段的尾部一直等到后续的写入或者解除塞住; 发送文件要等到确认才返回, 不受影响
+        if (len < MAX_SEG_LEN && (sendbuf_inflight(sb) > 0 || (st->cork && sb->ext == NULL))) {
+            break;
+        }
+        if (!rwnd_allows(st, sb->nxt + len)) {
+            // 对方的接收缓冲区满了. 有段在途中时, 它们的确认会带来新的窗口; 否则需要定期探测
+            if (sendbuf_inflight(sb) == 0 && st->persist == 0) {
+                st->persist = rto_get(&st->rto);
+                timerwheel_add(st->timers, &st->rtx_timer, st->persist);
+            }
+            break;
+        }
+        sendseg_t *ss = sendbuf_cut(sb, len);
+        ss->sentTime = now;
+        send_data(st, ss->seq, len);
+        st->bytes_sent += len;
+        st->persist = 0;
+        nr_sent++;
+    }
+    if (sendbuf_inflight(sb) > 0 && !timerwheel_pending(st->timers, &st->rtx_timer)) {
+        timerwheel_add(st->timers, &st->rtx_timer, rto_get(&st->rto));
+    }
+    return nr_sent;
+}
+
+/**
+ * @brief 数据段重传定时器到期, 由时间轮线程调用
+ *
+ * 每个段记录最近一次发送的时刻sentTime, 到期时刻为sentTime + RTO. 定时器只在最早的到期时刻触发,
+ * 段被确认或快速重传后不需要调整定时器, 这里发现还没有到期的段就按照剩余的时间重新添加定时器.
+ * GBN模式下第一个已发送但未被确认的段到期时, 重新发送所有已发送但未被确认的段;
+ * 选择重传模式下到期且未被选择确认的段单独重传. 有段重传时RTO加倍并收缩拥塞窗口.
+ * 没有段在途中而接收窗口关闭时, 这个定时器是坚持定时器: 发送零窗口探测, 间隔逐次加倍.
+ */
+static void rtx_timeout(void *arg)
+{
+    stream_t *st = arg;
+    sendbuf_t *sb = &st->sndbuf;
+    pthread_mutex_lock(&st->lock);
+    if (st->closed) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    if (sendbuf_inflight(sb) == 0) {
+        if (st->persist != 0 && sendbuf_unsent(sb) > 0) {
+            LOG(st, "probes zero window at seq %u", sb->nxt);
+            send_data(st, sb->nxt, 0);
+            st->persist = st->persist * 2 < RTO_MAX_MS ? st->persist * 2 : RTO_MAX_MS;
+            timerwheel_add(st->timers, &st->rtx_timer, st->persist);
+        }
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    unsigned int now = clock_ms();
+    unsigned int timeout = rto_get(&st->rto);
+    int expired = !st->sr && now - sendbuf_seg(sb, 0)->sentTime >= timeout;
+    unsigned int wait = timeout;
+    sendseg_t *ss;
+    for (unsigned int i = 0; (ss = sendbuf_seg(sb, i)) != NULL; i++) {
+        if (ss->sacked) {
+            continue;
+        }
+        unsigned int elapsed = now - ss->sentTime;
+        if (st->sr ? elapsed >= timeout : expired) {
+            LOG(st, "resends seq %u", ss->seq);
+            send_data(st, ss->seq, ss->len);
+            st->bytes_resent += ss->len;
+            ss->sentTime = now;
+            ss->retrans = 1;
+            expired = 1;
+            elapsed = 0;
+        }
+        if (timeout - elapsed < wait) {
+            wait = timeout - elapsed;
+        }
+    }
+    if (expired) {
+        rto_backoff(&st->rto);
+        cc_on_timeout(&st->cc);
+    }
+    timerwheel_add(st->timers, &st->rtx_timer, wait);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief 快速重传: 不等超时, 立即重传第一个未被确认的段.
+ *
+ * GBN模式下对方丢弃乱序的段, 所以从第一个未被确认的段开始重传所有已发送的段;
+ * 选择重传模式下只重传第一个没有被选择确认的段. 调用者持有lock.
+ */
+static void fast_retransmit(stream_t *st)
+{
+    unsigned int now = clock_ms();
+    sendseg_t *ss;
+    for (unsigned int i = 0; (ss = sendbuf_seg(&st->sndbuf, i)) != NULL; i++) {
+        if (ss->sacked) {
+            continue;
+        }
+        LOG(st, "fast retransmits seq %u", ss->seq);
+        send_data(st, ss->seq, ss->len);
+        st->bytes_resent += ss->len;
+        ss->sentTime = now;
+        ss->retrans = 1;
+        if (st->sr) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 处理对方的确认, 它来自 DATAACK 或捎带在 DATA 段上. 调用者持有lock.
+ * @param ack 累积确认的序号
+ * @param pure 是否是不带数据的 DATAACK. 只有它才可能是重复确认
+ *
+ * 释放所有结束于确认号之前的在途段, 这只需要移动发送缓冲区的环指针.
+ * 选择重传模式下, 选择确认块覆盖的段被标记, 之后不再重传.
+ * 拥塞窗口随被确认的段增长, 重复确认触发快速重传.
+ */
+static void input_ack(stream_t *st, unsigned int ack, unsigned short rcv_win, int pure,
+                      const stcp_sack_t *sacks, int nr_sacks)
+{
+    unsigned int now = clock_ms();
+    int has_sample = 0;
+    int held = 0;
+    unsigned int rtt = 0;
+    unsigned int nr_acked = 0;
+    sendbuf_t *sb = &st->sndbuf;
+    sendseg_t *ss;
+    while ((ss = sendbuf_seg(sb, 0)) != NULL && (int)(ss->seq + ss->len - ack) <= 0) {
+        // Karn 规则: 重传过的段不产生样本. 取本次确认的最后一个段, 它的发送最接近这个确认.
+        // 重传填补了空洞时, 之后的段早已到达, 在对方的缓存中等待(被选择确认的段更是如此), 确认的时刻不反映它们的RTT
+        held |= ss->retrans;
+        has_sample = !held && !ss->sacked;
+        rtt = now - ss->sentTime;
+        sendbuf_pop(sb);
+        nr_acked++;
+    }
+    if (has_sample) {
+        rto_sample(&st->rto, rtt);
+        cc_on_rtt(&st->cc, rtt);
+    }
+    // 乱序到达的旧确认不能用来更新窗口. 序号会回绕, 按差值的符号比较
+    int win_changed = 0;
+    if ((int)(ack - st->snd_una) >= 0) {
+        unsigned int wnd = rcv_win << STCP_RCV_WIN_SHIFT;
+        win_changed = wnd != st->snd_wnd;
+        st->snd_una = ack;
+        st->snd_wnd = wnd;
+    }
+    int retransmit = 0;
+    if (nr_acked > 0) {
+        retransmit = cc_on_ack(&st->cc, ack, nr_acked);
+    } else if (pure && !win_changed) {
+        // 窗口更新和捎带在数据上的确认不算重复确认
+        int in_flight = sendbuf_inflight(sb) > 0;
+        retransmit = cc_on_dupack(&st->cc, ack, in_flight, sb->nxt);
+    }
+    if (st->sr) {
+        for (unsigned int j = 0; (ss = sendbuf_seg(sb, j)) != NULL; j++) {
+            for (int i = 0; i < nr_sacks && !ss->sacked; i++) {
+                ss->sacked = (int)(ss->seq - sacks[i].start) >= 0 && (int)(ss->seq + ss->len - sacks[i].end) <= 0;
+            }
+        }
+    }
+    // 在处理SACK之后重传, 以免重传已经被对方缓存的段
+    if (retransmit) {
+        fast_retransmit(st);
+    }
+    // stream_send() 等待字节环中的空间, stream_drain() 等待发送缓冲区清空
+    if (nr_acked > 0) {
+        pthread_cond_broadcast(&st->sndCond);
+        stcp_poll_notify();
+    }
+}
+
+void stream_input(stream_t *st, seg_t *seg)
+{
+    pthread_mutex_lock(&st->lock);
+    if (seg->header.type == DATAACK) {
+        stcp_sack_t sacks[STCP_MAX_SACK];
+        int nr_sacks = 0;
+        if (st->sr) {
+            nr_sacks = seg->header.length / sizeof(sacks[0]);
+            if (nr_sacks > STCP_MAX_SACK) {
+                nr_sacks = STCP_MAX_SACK;
+            }
+            memcpy(sacks, seg->data, nr_sacks * sizeof(sacks[0]));
+        }
+        input_ack(st, seg->header.seq_num, seg->header.rcv_win, 1, sacks, nr_sacks);
+        transmit(st);
+    } else if (seg->header.type == DATA) {
+        input_ack(st, seg->header.ack_num, seg->header.rcv_win, 0, NULL, 0);
+        int need_ack = input_data(st, seg);
+        // 有数据发出时确认已经捎带在上面了
+        int nr_sent = transmit(st);
+        if (need_ack) {
+            send_dataack(st, 1);
+        } else if (nr_sent == 0) {
+            delay_ack(st);
+        }
+    }
+    if (sendbuf_inflight(&st->sndbuf) == 0 && st->persist == 0) {
+        timerwheel_del(st->timers, &st->rtx_timer);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+int stream_sendv(stream_t *st, const struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&st->lock);
+    for (int i = 0; i < iovcnt; i++) {
+        const char *p = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+        while (length > 0) {
+            if (st->closed) {
+                pthread_mutex_unlock(&st->lock);
+                return -1;
+            }
+            unsigned int n = sendbuf_write(&st->sndbuf, p, length < UINT_MAX ? length : UINT_MAX);
+            if (n == 0) {
+                // 先把已经写入的数据发出去, 它们的确认才能腾出空间
+                transmit(st);
+                LOG(st, "waits for send buffer space (%u segments in flight)", sendbuf_inflight(&st->sndbuf));
+                pthread_cond_wait(&st->sndCond, &st->lock);
+                continue;
+            }
+            p += n;
+            length -= n;
+        }
+    }
+    // 所有的块都在字节环中之后才切段, 相邻的小块合并在同一个段中
+    transmit(st);
+    pthread_mutex_unlock(&st->lock);
+    return 1;
+}
+
+int stream_send(stream_t *st, const void *data, unsigned int length)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = length };
+    return stream_sendv(st, &iov, 1);
+}
+
+void stream_set_cork(stream_t *st, int on)
+{
+    pthread_mutex_lock(&st->lock);
+    st->cork = on != 0;
+    if (!st->cork) {
+        transmit(st);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+int stream_send_some(stream_t *st, const void *data, unsigned int length)
+{
+    pthread_mutex_lock(&st->lock);
+    if (st->closed) {
+        pthread_mutex_unlock(&st->lock);
+        return -1;
+    }
+    unsigned int n = sendbuf_write(&st->sndbuf, data, length);
+    if (n > 0) {
+        transmit(st);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return n;
+}
+
+short stream_poll(stream_t *st)
+{
+    short revents = 0;
+    pthread_mutex_lock(&st->lock);
+    if (recvbuf_used(&st->rcvbuf) > 0) {
+        revents |= STCP_POLLIN;
+    }
+    if (st->sndbuf.ext == NULL && sendbuf_room(&st->sndbuf) > 0) {
+        revents |= STCP_POLLOUT;
+    }
+    if (st->closed) {
+        revents |= STCP_POLLHUP;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return revents;
+}
+
+void stream_drain(stream_t *st)
+{
+    pthread_mutex_lock(&st->lock);
+    // 关闭连接之前冲刷塞住的数据
+    st->cork = 0;
+    transmit(st);
+    while (!sendbuf_empty(&st->sndbuf) && !st->closed) {
+        pthread_cond_wait(&st->sndCond, &st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief 挂接一段文件映射并等待它的数据全部被确认. 调用者持有lock.
+ * @return 数据全部被确认时返回1, 数据通路被关闭时返回-1
+ *
+ * 已经被确认的页面不会再被读取, 每确认STCP_SNDBUF_SIZE字节就把它们从进程中释放掉,
+ * 这样无论文件多大, 驻留的只有在途的数据附近的页面.
+ */
+static int send_mapped(stream_t *st, char *map, unsigned int skew, unsigned int len)
+{
+    sendbuf_t *sb = &st->sndbuf;
+    unsigned int start = sendbuf_attach(sb, map + skew, len);
+    unsigned int released = 0;
+    transmit(st);
+    while (!sendbuf_empty(sb) && !st->closed) {
+        pthread_cond_wait(&st->sndCond, &st->lock);
+        int acked = (int)(sb->una - start);
+        if (acked > 0 && skew + acked - released >= STCP_SNDBUF_SIZE) {
+            unsigned int upto = (skew + acked) & ~(STCP_SNDBUF_SIZE - 1);
+            pthread_mutex_unlock(&st->lock);
+            madvise(map + released, upto - released, MADV_DONTNEED);
+            pthread_mutex_lock(&st->lock);
+            released = upto;
+        }
+    }
+    int ret = sendbuf_empty(sb) ? 1 : -1;
+    sendbuf_detach(sb);
+    // 等待字节环的 stream_send() 和其他 stream_sendfile() 可以继续了
+    pthread_cond_broadcast(&st->sndCond);
+    stcp_poll_notify();
+    return ret;
+}
+
+int stream_sendfile(stream_t *st, int fd, off_t offset, size_t length)
+{
+    // 映射文件末尾之后的页面, 访问时会收到 SIGBUS
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (offset < 0 || offset > sb.st_size || length > (size_t)(sb.st_size - offset)) {
+        log("sendfile range [%lld, +%zu) is out of the file (%lld bytes)",
+            (long long)offset, length, (long long)sb.st_size);
+        return -1;
+    }
+
+    long pagesize = sysconf(_SC_PAGESIZE);
+    while (length > 0) {
+        // 每次映射一块, 序号空间和地址空间的占用都与文件大小无关
+        unsigned int len = length < STCP_SENDFILE_MAP_SIZE ? length : STCP_SENDFILE_MAP_SIZE;
+        off_t base = offset & ~(off_t)(pagesize - 1);
+        unsigned int skew = offset - base;
+        char *map = mmap(NULL, skew + len, PROT_READ, MAP_SHARED, fd, base);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise(map, skew + len, MADV_SEQUENTIAL);
+
+        pthread_mutex_lock(&st->lock);
+        while (st->sndbuf.ext && !st->closed) {
+            pthread_cond_wait(&st->sndCond, &st->lock);
+        }
+        int ret = st->closed ? -1 : send_mapped(st, map, skew, len);
+        pthread_mutex_unlock(&st->lock);
+        munmap(map, skew + len);
+        if (ret == -1) {
+            return -1;
+        }
+        offset += len;
+        length -= len;
+    }
+    return 1;
+}
@@ -0,0 +1,126 @@
+//文件名: common/stream.h
+//
+//描述: 这个文件定义STCP连接的数据通路.
+//
+//连接是全双工的: 客户端和服务器的TCB都嵌入一个stream_t, 其中包括
+//  发送方向: 发送缓冲区(sendbuf.h), 重传定时器兼坚持定时器, RTO估计(rto.h), 拥塞控制(cc.h)和对方通告的接收窗口;
+//  接收方向: 接收缓冲区(recvbuf.h), 选择重传模式下缓存的乱序段, 以及要通告给对方的接收窗口.
+//TCB只负责建立和拆除连接的状态机, 连接建立之后收到的DATA和DATAACK段都交给stream_input().
+//
+//每个DATA段都在首部的ack_num和rcv_win中携带本方接收方向的累积确认和接收窗口(捎带确认).
+//收到按序的DATA段时, 如果本方正好有数据可以发出, 确认就随数据一起发出, 不再单独发送DATAACK.
+//没有数据可以捎带时确认被延迟: 每收到STCP_DELACK_SEGS个按序的段, 或者第一个未确认的段到达之后
+//STCP_DELACK_MS毫秒, 才发送一个累积确认的DATAACK. 接收缓冲区快满时立即确认, 让对方及时知道窗口.
+//乱序, 重复的段和零窗口探测仍然立即用DATAACK回复, 选择重传模式下DATAACK的数据部分携带选择确认块.
+//DATAACK段首部的seq_num是累积确认的序号.
+//
+//接收缓冲区中有了数据, 发送缓冲区中腾出了空间或者数据通路被关闭时, 调用stcp_poll_notify()通知stcp_poll的等待者.
+//
+//stream_t中的所有字段都由lock保护. 发送段的output回调函数在持有lock时被调用, 不能再获取lock.
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "seg.h"
+#include "sendbuf.h"
+#include "recvbuf.h"
+#include "timerwheel.h"
+#include "rto.h"
+#include "cc.h"
+
+//选择重传模式下缓存的一个乱序到达的段, 链表按序号升序排列
+typedef struct oooSeg {
+    unsigned int seq;               //段的序号
+    unsigned int length;            //段数据长度
+    struct oooSeg* next;
+    char data[];
+} oooSeg_t;
+
+typedef struct stream {
+    pthread_mutex_t lock;
+    pthread_cond_t sndCond;         //发送缓冲区中腾出了空间或者发送缓冲区被清空时广播
+    pthread_cond_t rcvCond;         //接收缓冲区中的数据达到recv_need时唤醒读者
+    void (*output)(void* owner, seg_t* seg);  //填写端口并把段发给对方
+    void* owner;                    //所属的TCB, 作为output的参数, 也用于日志
+    timerwheel_t* timers;           //重传定时器所在的时间轮
+    int closed;                     //stream_shutdown()之后为1
+    int sr;                         //是否使用选择重传, 连接时协商
+    unsigned int window;            //窗口大小, 单位为段, 连接时协商
+    int cork;                       //塞住时只发送完整的段, 参见stream_set_cork()
+
+    //发送方向
+    sendbuf_t sndbuf;               //发送缓冲区
+    unsigned int persist;           //坚持定时器的间隔, 单位为毫秒. 为0表示没有在做零窗口探测
+    tw_timer_t rtx_timer;           //数据段的重传定时器, 有段在途中时运行; 接收窗口关闭时兼作坚持定时器
+    rto_t rto;                      //重传超时估计器
+    cc_t cc;                        //拥塞控制状态, 在途的段数不超过min(window, cc.cwnd)
+    unsigned int snd_una;           //对方最近确认的序号
+    unsigned int snd_wnd;           //对方通告的接收窗口, 单位为字节. 序号不小于snd_una + snd_wnd的数据不能发送
+    unsigned int bytes_sent;        //首次发送的数据字节数
+    unsigned int bytes_resent;      //重传的数据字节数
+
+    //接收方向
+    recvbuf_t rcvbuf;               //接收缓冲区
+    unsigned int recv_need;         //阻塞在stream_recv()中的读者需要的字节数, 为0表示没有读者在等待
+    unsigned int rcv_nxt;           //期待的下一个数据序号
+    oooSeg_t* oooHead;              //选择重传模式下缓存的乱序段
+    unsigned int rcv_wnd_adv;       //最近一次通告的接收窗口, 单位为字节
+    unsigned int ack_pending;       //已经交付但还没有确认的按序段数
+    tw_timer_t delack_timer;        //延迟确认定时器, ack_pending不为0时运行
+    unsigned int nr_dataacks;       //发出的DATAACK段数
+} stream_t;
+
+//这个函数初始化数据通路, 两个方向的序号都从0开始. 成功时返回0, 内存不足时返回-1.
+int stream_init(stream_t* st, timerwheel_t* timers, void (*output)(void*, seg_t*), void* owner);
+
+//这个函数释放数据通路的资源. 调用者保证stream_shutdown()已经被调用, 并且没有其他线程在使用它.
+void stream_free(stream_t* st);
+
+//这个函数关闭数据通路: 重传定时器不再重新添加自己, 阻塞在stream_send()和stream_recv()中的线程被唤醒并返回-1.
+void stream_shutdown(stream_t* st);
+
+//这个函数把length个字节写入发送缓冲区, 并在窗口允许时立即发出. 发送缓冲区满时阻塞.
+//成功时返回1, 数据通路已经关闭时返回-1.
+int stream_send(stream_t* st, const void* data, unsigned int length);
+
+//同stream_send(), 但数据由iovcnt个块组成. 所有的块都写入发送缓冲区之后才切段发出,
+//所以相邻的小块合并在同一个段中, 而不是各自占用一个段.
+int stream_sendv(stream_t* st, const struct iovec* iov, int iovcnt);
+
+//这个函数塞住(on非0)或者解除塞住数据通路. 塞住时不足MAX_SEG_LEN的尾部数据不会发出, 等待后续的写入把它补满,
+//解除塞住时立即发出. stream_drain()和发送文件时自动冲刷.
+void stream_set_cork(stream_t* st, int on);
+
+//同stream_send(), 但不阻塞: 只写入发送缓冲区放得下的部分, 返回写入的字节数, 发送缓冲区满时返回0.
+//数据通路已经关闭时返回-1.
+int stream_send_some(stream_t* st, const void* data, unsigned int length);
+
+//这个函数发送文件fd中从offset开始的length个字节. 文件被分块映射进内存, 段直接从映射的页面组装,
+//重传时也从映射中重新读取, 数据不经过发送缓冲区的字节环. 因为重传需要映射一直有效, 这个函数阻塞直到
+//数据全部被确认. 成功时返回1, offset为负或者超出文件末尾, 映射失败或者数据通路已经关闭时返回-1.
+//发送期间不能截短这个文件: 访问被截掉的页面会收到SIGBUS.
+int stream_sendfile(stream_t* st, int fd, off_t offset, size_t length);
+
+//这个函数阻塞直到接收缓冲区中至少有need个字节, 然后取走最多length个字节, 返回取走的字节数.
+//数据通路已经关闭且数据不够时返回-1.
+int stream_recv(stream_t* st, void* buf, unsigned int length, unsigned int need);
+
+//这个函数阻塞直到发送缓冲区中的数据全部被确认. 数据通路已经关闭时立即返回.
+void stream_drain(stream_t* st);
+
+//这个函数返回数据通路当前就绪的事件: STCP_POLLIN, STCP_POLLOUT和STCP_POLLHUP, 参见stcp_poll.h.
+short stream_poll(stream_t* st);
+
+//这个函数处理收到的DATA或DATAACK段.
+void stream_input(stream_t* st, seg_t* seg);
+
+//这个函数返回要在控制段首部rcv_win中通告的接收窗口.
+unsigned short stream_rcv_win(stream_t* st);
+
+//这个函数在连接建立时记录对方在SYN或SYNACK中通告的接收窗口.
+void stream_set_peer_window(stream_t* st, unsigned short rcv_win);
+
+#endif
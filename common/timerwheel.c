@@ -0,0 +1,237 @@
+//文件名: common/timerwheel.c
+//
+//描述: 这个文件实现STCP使用的分级时间轮定时器服务, 参见timerwheel.h.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "timerwheel.h"
+#include "constants.h"
+#include "common.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+//时钟的当前刻度
+static unsigned long tw_clock(const timerwheel_t *tw)
+{
+    return (clock_ms() - tw->start) / TIMERWHEEL_TICK_MS;
+}
+
+static void tw_arm(timerwheel_t *tw, int on)
+{
+    if (tw->armed == on) {
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_nsec = TIMERWHEEL_TICK_MS * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timerfd_settime(tw->tfd, 0, &its, NULL) == -1) {
+        sys_panic("timerfd_settime");
+    }
+    tw->armed = on;
+}
+
+static void tw_link(tw_timer_t **head, tw_timer_t *t)
+{
+    t->next = *head;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+}
+
+static void tw_unlink(tw_timer_t *t)
+{
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+//按照剩余的刻度数把t放入对应级的槽中. tw->now是下一个要处理的刻度.
+static void tw_insert(timerwheel_t *tw, tw_timer_t *t)
+{
+    unsigned long delta = t->expires - tw->now;
+    if ((long)delta < 0) {
+        // 已经到期, 在下一个刻度处理
+        tw_link(&tw->slots[0][tw->now & TW_MASK], t);
+        return;
+    }
+    for (int level = 0; level < TW_LEVELS; level++) {
+        if (delta < 1UL << (TW_BITS * (level + 1)) || level == TW_LEVELS - 1) {
+            unsigned long expires = t->expires;
+            if (level == TW_LEVELS - 1 && delta >= 1UL << (TW_BITS * TW_LEVELS)) {
+                // 超出时间轮的范围, 放在最远的槽中, 到时候再重新分配
+                expires = tw->now + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+            }
+            tw_link(&tw->slots[level][(expires >> (TW_BITS * level)) & TW_MASK], t);
+            return;
+        }
+    }
+}
+
+//把第level级中当前的槽重新分配到低级, 返回槽的下标
+static unsigned int tw_cascade(timerwheel_t *tw, int level)
+{
+    unsigned int idx = (tw->now >> (TW_BITS * level)) & TW_MASK;
+    tw_timer_t *t = tw->slots[level][idx];
+    tw->slots[level][idx] = NULL;
+    while (t) {
+        tw_timer_t *next = t->next;
+        tw_insert(tw, t);
+        t = next;
+    }
+    return idx;
+}
+
+//处理到当前时刻为止的所有刻度. 调用者持有锁, 执行回调函数时锁会被暂时释放.
+static void tw_run(timerwheel_t *tw)
+{
+    unsigned long clock = tw_clock(tw);
+    while ((long)(clock - tw->now) >= 0) {
+        unsigned int idx = tw->now & TW_MASK;
+        for (int level = 1; level < TW_LEVELS && idx == 0; level++) {
+            idx = tw_cascade(tw, level);
+        }
+        idx = tw->now & TW_MASK;
+        tw->now++;
+
+        // 先把槽中的定时器移到局部链表中, 回调函数重新添加的定时器不会在这一轮中被处理
+        tw_timer_t *expired = tw->slots[0][idx];
+        tw->slots[0][idx] = NULL;
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        while (expired) {
+            tw_timer_t *t = expired;
+            tw_unlink(t);
+            tw->nr_pending--;
+            tw->running = t;
+            pthread_mutex_unlock(&tw->lock);
+            t->fn(t->arg);
+            pthread_mutex_lock(&tw->lock);
+            tw->running = NULL;
+            pthread_cond_broadcast(&tw->done);
+        }
+    }
+}
+
+static void *tw_thread(void *arg)
+{
+    timerwheel_t *tw = arg;
+    for (;;) {
+        uint64_t ticks;
+        if (read(tw->tfd, &ticks, sizeof(ticks)) == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            sys_panic("read timerfd");
+        }
+        pthread_mutex_lock(&tw->lock);
+        tw_run(tw);
+        if (tw->nr_pending == 0) {
+            tw_arm(tw, 0);
+        }
+        pthread_mutex_unlock(&tw->lock);
+    }
+    return arg;
+}
+
+timerwheel_t *timerwheel_create(void)
+{
+    timerwheel_t *tw = calloc(1, sizeof(*tw));
+    if (tw == NULL) {
+        return NULL;
+    }
+    tw->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tw->tfd == -1) {
+        free(tw);
+        return NULL;
+    }
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->done, NULL);
+    tw->start = clock_ms();
+    tw->now = 0;
+    if (pthread_create(&tw->thread, NULL, tw_thread, tw) != 0) {
+        close(tw->tfd);
+        free(tw);
+        return NULL;
+    }
+    pthread_detach(tw->thread);
+    return tw;
+}
+
+void tw_timer_init(tw_timer_t *t, void (*fn)(void *), void *arg)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void timerwheel_add(timerwheel_t *tw, tw_timer_t *t, unsigned int ms)
+{
+    unsigned long ticks = (ms + TIMERWHEEL_TICK_MS - 1) / TIMERWHEEL_TICK_MS;
+    pthread_mutex_lock(&tw->lock);
+    if (t->pprev) {
+        tw_unlink(t);
+        tw->nr_pending--;
+    }
+    unsigned long clock = tw_clock(tw);
+    if (tw->nr_pending == 0 && (long)(clock - tw->now) >= 0) {
+        // 时间轮是空的, 直接跳到当前时刻, 不需要逐个处理停止期间的刻度
+        tw->now = clock + 1;
+    }
+    t->expires = clock + (ticks ? ticks : 1);
+    tw_insert(tw, t);
+    tw->nr_pending++;
+    tw_arm(tw, 1);
+    pthread_mutex_unlock(&tw->lock);
+}
+
+int timerwheel_del(timerwheel_t *tw, tw_timer_t *t)
+{
+    int pending = 0;
+    pthread_mutex_lock(&tw->lock);
+    if (t->pprev) {
+        tw_unlink(t);
+        tw->nr_pending--;
+        pending = 1;
+    }
+    pthread_mutex_unlock(&tw->lock);
+    return pending;
+}
+
+int timerwheel_del_sync(timerwheel_t *tw, tw_timer_t *t)
+{
+    int pending = 0;
+    pthread_mutex_lock(&tw->lock);
+    if (t->pprev) {
+        tw_unlink(t);
+        tw->nr_pending--;
+        pending = 1;
+    }
+    while (tw->running == t && !pthread_equal(pthread_self(), tw->thread)) {
+        pthread_cond_wait(&tw->done, &tw->lock);
+    }
+    pthread_mutex_unlock(&tw->lock);
+    return pending;
+}
+
+int timerwheel_pending(timerwheel_t *tw, const tw_timer_t *t)
+{
+    pthread_mutex_lock(&tw->lock);
+    int pending = t->pprev != NULL;
+    pthread_mutex_unlock(&tw->lock);
+    return pending;
+}
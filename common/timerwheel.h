@@ -0,0 +1,63 @@
+//文件名: common/timerwheel.h
+//
+//描述: 这个文件定义STCP使用的分级时间轮定时器服务.
+//
+//一个STCP实例(客户端库或服务器库)只有一个时间轮和一个服务线程, 线程阻塞在一个CLOCK_MONOTONIC的timerfd上.
+//有定时器等待时, timerfd每TIMERWHEEL_TICK_MS毫秒触发一次; 没有定时器时timerfd停止, 线程不会被唤醒.
+//时间轮分为TW_LEVELS级, 每级TW_SLOTS个槽. 第0级的槽对应一个刻度, 第k级的槽对应TW_SLOTS^k个刻度,
+//定时器按照剩余时间放入对应的级中, 高级的槽到期时其中的定时器被重新分配到低级, 因此添加和删除定时器都是O(1)的.
+//
+//定时器结构嵌入在使用者的数据结构中, 不需要另外分配内存. 回调函数在服务线程中执行, 执行时不持有时间轮的锁,
+//所以回调函数中可以重新添加定时器. 回调函数执行之前定时器已经被移出时间轮.
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <pthread.h>
+
+#define TW_LEVELS 4
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+
+typedef struct tw_timer {
+    struct tw_timer* next;
+    struct tw_timer** pprev;        //指向链表中前一个节点的next, 不在时间轮中时为NULL
+    unsigned long expires;          //到期的刻度
+    void (*fn)(void* arg);          //到期时调用的函数
+    void* arg;
+} tw_timer_t;
+
+typedef struct timerwheel {
+    pthread_mutex_t lock;
+    pthread_cond_t done;            //回调函数执行结束时广播, 用于timerwheel_del_sync()
+    int tfd;                        //timerfd
+    int armed;                      //timerfd是否在周期性触发
+    unsigned int start;             //创建时的clock_ms(), 刻度从这里开始计算
+    unsigned long now;              //已经处理过的刻度
+    unsigned int nr_pending;        //时间轮中的定时器个数
+    tw_timer_t* running;            //正在执行回调函数的定时器
+    pthread_t thread;
+    tw_timer_t* slots[TW_LEVELS][TW_SLOTS];
+} timerwheel_t;
+
+//这个函数创建一个时间轮并启动它的服务线程. 失败时返回NULL.
+timerwheel_t* timerwheel_create(void);
+
+//这个函数初始化一个定时器, 到期时在服务线程中调用fn(arg).
+void tw_timer_init(tw_timer_t* t, void (*fn)(void*), void* arg);
+
+//这个函数让定时器t在ms毫秒之后到期. 如果t已经在时间轮中, 就修改它的到期时间.
+void timerwheel_add(timerwheel_t* tw, tw_timer_t* t, unsigned int ms);
+
+//这个函数把定时器t移出时间轮. t在时间轮中时返回1, 否则返回0.
+//返回时t的回调函数可能正在执行, 所以回调函数需要在自己的锁之下检查是否还有事情要做.
+int timerwheel_del(timerwheel_t* tw, tw_timer_t* t);
+
+//同timerwheel_del(), 但如果t的回调函数正在执行, 就等待它结束. 用于释放定时器所在的数据结构之前.
+//调用者不能持有回调函数会获取的锁, 也不能在t自己的回调函数中调用.
+int timerwheel_del_sync(timerwheel_t* tw, tw_timer_t* t);
+
+//这个函数返回定时器t是否在时间轮中.
+int timerwheel_pending(timerwheel_t* tw, const tw_timer_t* t);
+
+#endif
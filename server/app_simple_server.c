@@ -1,7 +1,8 @@
 //文件名: server/app_simple_server.c
 
 //描述: 这是简单版本的服务器程序代码. 服务器首先连接到本地SIP进程. 然后它调用stcp_server_init()初始化STCP服务器. 
-//它通过两次调用stcp_server_sock()和stcp_server_accept()创建2个套接字并等待来自客户端的连接. 服务器然后接收来自两个连接的客户端发送的短字符串. 
+//它通过两次调用stcp_server_sock()和stcp_server_listen()创建2个套接字并等待来自客户端的连接. 服务器然后在一个线程中用stcp_server_poll()同时处理两个连接:
+//接收客户端发送的短字符串, 并通过同一个连接把每个字符串发回给客户端. 
 //最后, 服务器通过调用stcp_server_close()关闭套接字, 并断开与本地SIP进程的连接.
 
 //创建日期: 2015年
@@ -80,29 +81,53 @@ int main() {
 	if(sockfd<0) {
 		panic("can't create stcp server");
 	}
-	//监听并接受来自STCP客户端的连接 
-	stcp_server_accept(sockfd);
-
 	//在端口SERVERPORT2上创建另一个STCP服务器套接字
 	int sockfd2= stcp_server_sock(SERVERPORT2);
 	if(sockfd2<0) {
 		panic("can't create stcp server");
 	}
-	//监听并接受来自STCP客户端的连接 
-	stcp_server_accept(sockfd2);
 
-	char buf1[6];
-	char buf2[7];
-	int i;
-	//接收来自第一个连接的字符串
-	for(i=0;i<5;i++) {
-		stcp_server_recv(sockfd,buf1,6);
-		log("recv string: %s from connection 1",buf1);
+	//两个套接字都开始监听, 然后由这一个线程通过stcp_server_poll()同时处理两个连接
+	if(stcp_server_listen(sockfd)<0 || stcp_server_listen(sockfd2)<0) {
+		panic("can't listen on stcp server");
 	}
-	//接收来自第二个连接的字符串
-	for(i=0;i<5;i++) {
-		stcp_server_recv(sockfd2,buf2,7);
-		log("recv string: %s from connection 2",buf2);
+	stcp_pollfd_t fds[2] = {
+		{ .sockfd = sockfd, .events = STCP_POLLACCEPT },
+		{ .sockfd = sockfd2, .events = STCP_POLLACCEPT },
+	};
+	//第一个连接上的字符串长6个字节, 第二个连接上的长7个字节
+	unsigned int len[2] = {6, 7};
+	char buf[2][7];
+	unsigned int got[2] = {0, 0};
+	int nr_strings[2] = {0, 0};
+	int i;
+	while(nr_strings[0]<5 || nr_strings[1]<5) {
+		stcp_server_poll(fds,2,-1);
+		for(i=0;i<2;i++) {
+			if(fds[i].revents & (STCP_POLLHUP|STCP_POLLNVAL)) {
+				panic("connection %d closed unexpectedly",i+1);
+			}
+			if(fds[i].revents & STCP_POLLACCEPT) {
+				log("connection %d accepted",i+1);
+				fds[i].events = STCP_POLLIN;
+			}
+			if(fds[i].revents & STCP_POLLIN) {
+				int n = stcp_server_recv_some(fds[i].sockfd,buf[i]+got[i],len[i]-got[i]);
+				if(n<0) {
+					panic("can't receive from connection %d",i+1);
+				}
+				got[i] += n;
+				if(got[i]==len[i]) {
+					//收到一个完整的字符串, 把它发回给客户端
+					log("recv string: %s from connection %d",buf[i],i+1);
+					stcp_server_send(fds[i].sockfd,buf[i],len[i]);
+					got[i] = 0;
+					if(++nr_strings[i]==5) {
+						fds[i].events = 0;
+					}
+				}
+			}
+		}
 	}
 
     log("prepare to disconnect");
@@ -1,6 +1,6 @@
 //文件名: server/app_stress_server.c
 
-//描述: 这是压力测试版本的服务器程序代码. 服务器首先连接到本地SIP进程. 然后它调用stcp_server_init()初始化STCP服务器.
+//描述: 这是压力测试版本的服务器程序代码. 服务器首先连接到本地SIP进程. 然后它调用stcp_server_init_transport()初始化STCP服务器, 与SIP进程之间使用共享内存环.
 //它通过调用stcp_server_sock()和stcp_server_accept()创建套接字并等待来自客户端的连接. 它然后接收文件长度.
 //在这之后, 它创建一个缓冲区, 接收文件数据并将它保存到receivedtext.txt文件中.
 //最后, 服务器通过调用stcp_server_close()关闭套接字, 并断开与本地SIP进程的连接.
@@ -26,6 +26,7 @@
 #include <common.h>
 #include <constants.h>
 #include "stcp_server.h"
+#include "shmring.h"
 
 //创建一个连接, 使用客户端端口号87和服务器端口号88.
 #define CLIENTPORT1 87
@@ -73,7 +74,10 @@ int main() {
 	}
 
 	//初始化STCP服务器
-	stcp_server_init(sip_conn);
+	//批量传输经过共享内存环, 每个段不再需要一次系统调用
+	if(stcp_server_init_transport(sip_conn, SHMCHAN_SHM)<0) {
+		panic("fail to set up the shared memory ring with SIP");
+	}
 
 	//在端口SERVERPORT1上创建STCP服务器套接字
 	int sockfd= stcp_server_sock(SERVERPORT1);
@@ -88,7 +92,12 @@ int main() {
 	int fileLen;
 	stcp_server_recv(sockfd,&fileLen,sizeof(int));
 	char* buf = (char*) malloc(fileLen);
-	stcp_server_recv(sockfd,buf,fileLen);
+	for (int got = 0, n; got < fileLen; got += n) {
+		n = stcp_server_recv_some(sockfd,buf + got,fileLen - got);
+		if (n < 0) {
+			panic("can't receive file data");
+		}
+	}
 
 	//将接收到的文件数据保存到文件receivedtext.txt中
 	FILE* f;
@@ -3,6 +3,9 @@
 #include <string.h>
 #include <pthread.h>
 #include "stcp_server.h"
+#include "shmring.h"
+#include "conntable.h"
+#include "epoch.h"
 #include "common.h"
 #include "../topology/topology.h"
 
@@ -53,11 +56,11 @@ static const char *state_to_s(const server_tcb_t *tcb)
 }
 
 /**
- * @brief TCB 池
+ * @brief 连接表
  *
- * MAX_TRANSPORT_CONNECTIONS 是支持的最大连接数
+ * 由套接字 ID 或进入段的 (客户端节点, 客户端端口, 服务器端口) 找到 TCB
  */
-static server_tcb_t *tcbs[MAX_TRANSPORT_CONNECTIONS];
+static conntable_t *conns;
 
 /**
  * @brief 记录 seghandler 线程的 tid
@@ -69,30 +72,113 @@ pthread_t handler_tid;
  */
 static int son_connection;
 
+/**
+ * @brief 所有连接的 CLOSEWAIT 定时器都在这个时间轮中
+ */
+static timerwheel_t *timers;
+
 /**
  * @brief 启动 STCP 协议栈
  * @param conn 模拟 SON 的连接套接字
  */
 void stcp_server_init(int conn)
 {
-    // 初始化 TCB 池
-    for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-        tcbs[i] = NULL;
+    if (stcp_server_init_transport(conn, SHMCHAN_SOCKET) < 0) {
+        warn("handshake with SIP failed");
+    }
+}
+
+/**
+ * @brief 启动 STCP 协议栈, 并选择与 SIP 进程之间的传输方式
+ * @param conn 模拟 SON 的连接套接字
+ * @param transport SHMCHAN_SOCKET 或 SHMCHAN_SHM
+ * @return 成功返回 1, 与 SIP 进程握手失败返回 -1
+ */
+int stcp_server_init_transport(int conn, int transport)
+{
+    // 环中的一条消息就是一个 sendseg_arg_t
+    shmchan_t *chan;
+    if (shmchan_offer(conn, transport, sizeof(sendseg_arg_t), STCP_SIP_RING_SLOTS, &chan) == -1) {
+        return -1;
+    }
+
+    if (conns == NULL && (conns = conntable_create()) == NULL) {
+        sys_panic("conntable_create");
+    }
+    log("TCB table has been initialized.");
+
+    if (timers == NULL && (timers = timerwheel_create()) == NULL) {
+        sys_panic("timerwheel_create");
     }
-    log("TCB pool has been initialized.");
 
     // 启动接受网络层报文段的线程
     son_connection = conn;
     pthread_create(&handler_tid, NULL, seghandler, NULL);
-    log("Seghandler started.");
+    log("Seghandler started%s.", chan ? " with shared memory" : "");
+    return 1;
+}
+
+/**
+ * @brief 释放 TCB. 由 epoch_retire() 在 seghandler 不可能再看到这个 TCB 之后调用.
+ */
+static void free_tcb(void *arg)
+{
+    server_tcb_t *tcb = arg;
+    stream_free(&tcb->stream);
+    free(tcb->mutex);
+    free(tcb->condition);
+    free(tcb);
+}
+
+/**
+ * @brief 填写端口并把段发给客户端, 作为数据通路的 output 回调函数
+ */
+static void output(void *owner, seg_t *seg)
+{
+    server_tcb_t *tcb = owner;
+    seg->header.src_port = tcb->server_portNum;
+    seg->header.dest_port = tcb->client_portNum;
+    if (sip_sendseg(son_connection, tcb->client_nodeID, seg) == -1) {
+        log("sending %s to %d:%d failed", seg_type_s(seg), tcb->client_nodeID, tcb->client_portNum);
+    }
+}
+
+/**
+ * @brief 通过套接字 ID 找到 TCB 并增加它的引用计数, 无效或已经释放时返回 NULL
+ *
+ * 引用计数在读临界区中增加, 这时连接表的引用还没有被丢弃, 所以 TCB 一定还活着.
+ * 之后 API 可以离开读临界区阻塞在数据通路上, 用完后调用 put_tcb().
+ */
+static server_tcb_t *get_tcb(int sockfd)
+{
+    epoch_enter();
+    server_tcb_t *tcb = conntable_get(conns, sockfd);
+    if (tcb) {
+        atomic_fetch_add(&tcb->refs, 1);
+    }
+    epoch_exit();
+    return tcb;
+}
+
+/**
+ * @brief 减少 TCB 的引用计数, 最后一个引用释放 TCB
+ *
+ * 连接表持有一个引用, closewait_timeout() 通过 epoch_retire() 丢弃它, 这样 seghandler 也不会再看到这个 TCB.
+ */
+static void put_tcb(void *arg)
+{
+    server_tcb_t *tcb = arg;
+    if (tcb && atomic_fetch_sub(&tcb->refs, 1) == 1) {
+        free_tcb(tcb);
+    }
 }
 
 // 创建服务器套接字
 //
-// 这个函数查找服务器TCB表以找到第一个NULL条目, 然后使用malloc()为该条目创建一个新的TCB条目.
+// 这个函数使用malloc()创建一个新的TCB条目, 并把它加入连接表.
 // 该TCB中的所有字段都被初始化, 例如, TCB state被设置为CLOSED, 服务器端口被设置为函数调用参数server_port.
-// TCB表中条目的索引应作为服务器的新套接字ID被这个函数返回, 它用于标识服务器的连接.
-// 如果TCB表中没有条目可用, 这个函数返回-1.
+// 连接表分配的套接字ID被这个函数返回, 它用于标识服务器的连接.
+// 如果连接表已满或内存不足, 这个函数返回-1.
 
 int stcp_server_sock(unsigned int server_port)
 {
@@ -100,160 +186,287 @@ int stcp_server_sock(unsigned int server_port)
         panic("son has been closed");
     }
 
-    for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-        if (tcbs[i] == NULL) {
-            server_tcb_t *tcb = calloc(1, sizeof(*tcb));
+    server_tcb_t *tcb = calloc(1, sizeof(*tcb));
+    if (tcb == NULL) {
+        return -1;
+    }
 
-            tcb->server_portNum = server_port;
-            tcb->client_portNum = -1;
-            tcb->state = CLOSED;
+    tcb->server_portNum = server_port;
+    tcb->client_portNum = -1;
+    tcb->state = CLOSED;
+    // 连接表持有的引用
+    tcb->refs = 1;
 
-            // Init mutex
-            tcb->mutex = malloc(sizeof(*tcb->mutex));
-            pthread_mutex_init(tcb->mutex, NULL);
+    // Init mutex
+    tcb->mutex = malloc(sizeof(*tcb->mutex));
+    pthread_mutex_init(tcb->mutex, NULL);
 
-            tcb->condition = malloc(sizeof(*tcb->condition));
-            pthread_cond_init(tcb->condition, NULL);
+    tcb->condition = malloc(sizeof(*tcb->condition));
+    pthread_cond_init(tcb->condition, NULL);
 
-            tcb->recvBuf = calloc(RECEIVE_BUF_SIZE, sizeof(*tcb->recvBuf));
+    if (stream_init(&tcb->stream, timers, output, tcb) == -1) {
+        free(tcb->mutex);
+        free(tcb->condition);
+        free(tcb);
+        return -1;
+    }
 
-            log("Assign socket %d to port %d", i, server_port);
-            tcbs[i] = tcb;
+    tcb->sockfd = conntable_add(conns, tcb, server_port);
+    if (tcb->sockfd == -1) {
+        // No socket available.
+        free_tcb(tcb);
+        return -1;
+    }
+    log("Assign socket %d to port %d", tcb->sockfd, server_port);
 
-            // Socket
-            return i;
-        }
+    // 让 SIP 进程把发往这个端口的段交给本进程
+    if (sip_regport(son_connection, server_port) == -1) {
+        warn("fail to register port %d", server_port);
     }
 
-    // No socket available.
-    return -1;
+    // Socket
+    return tcb->sockfd;
 }
 
-// 接受来自STCP客户端的连接
+// 开始在服务器套接字上等待连接
 //
-// 这个函数使用sockfd获得TCB指针, 并将连接的state转换为LISTENING. 它然后进入忙等待(busy wait)直到TCB状态转换为CONNECTED
-// (当收到SYN时, seghandler会进行状态的转换). 该函数在一个无穷循环中等待TCB的state转换为CONNECTED,
-// 当发生了转换时, 该函数返回1. 你可以使用不同的方法来实现这种阻塞等待.
+// 这个函数使用sockfd获得TCB指针, 并将连接的state转换为LISTENING后立即返回. 收到SYN时seghandler把state转换为CONNECTED,
+// 这时stcp_server_poll()报告STCP_POLLACCEPT.
 //
 
-int stcp_server_accept(int sockfd)
+static int listen_tcb(server_tcb_t *tcb, int sockfd)
+{
+    if (tcb == NULL) {
+        log("Invalid stcp socket %d", sockfd);
+        return -1;
+    }
+    else if (tcb->state != CLOSED) {
+        log("The state of this stcp socket is not %s", server_state_s[CLOSED]);
+        return -1;
+    }
+    pthread_mutex_lock(tcb->mutex);
+    tcb->state = LISTENING;
+    pthread_mutex_unlock(tcb->mutex);
+
+    LOG(tcb, "shifts state to %s", state_to_s(tcb));
+    return 1;
+}
+
+int stcp_server_listen(int sockfd)
 {
     if (son_connection == -1) {
         panic("son has been closed");
     }
 
-    server_tcb_t *tcb = tcbs[sockfd];
+    server_tcb_t *tcb = get_tcb(sockfd);
+    int ret = listen_tcb(tcb, sockfd);
+    put_tcb(tcb);
+    return ret;
+}
 
-    if (tcb == NULL) {
-        log("Invalid stcp socket %d", sockfd);
+// 接受来自STCP客户端的连接
+//
+// 这个函数调用stcp_server_listen(), 然后阻塞直到TCB状态转换为CONNECTED(当收到SYN时, seghandler会进行状态的转换).
+// 当发生了转换时, 该函数返回1.
+//
+
+int stcp_server_accept(int sockfd)
+{
+    if (stcp_server_listen(sockfd) == -1) {
         return 0;
     }
-    else if (tcb->state != CLOSED) {
-        log("The state of this stcp socket is not %s", server_state_s[CLOSED]);
+
+    server_tcb_t *tcb = get_tcb(sockfd);
+    if (tcb == NULL) {
+        log("Invalid stcp socket %d", sockfd);
         return 0;
     }
-    else {
-        pthread_mutex_lock(tcb->mutex);
-        tcb->state = LISTENING;
-        pthread_mutex_unlock(tcb->mutex);
 
-        LOG(tcb, "shifts state to %s", state_to_s(tcb));
+    // 等待 seghandler() 唤醒. 连接建立后可能马上收到 FIN 进入 CLOSEWAIT, 所以等待离开 LISTENING
+    pthread_mutex_lock(tcb->mutex);
+    while (tcb->state == LISTENING) {
+        pthread_cond_wait(tcb->condition, tcb->mutex);
+    }
+    pthread_mutex_unlock(tcb->mutex);
 
-        // 等待 seghandler() 唤醒
-        pthread_mutex_lock(tcb->mutex);
-        if (tcb->state != CONNECTED) {
-            pthread_cond_wait(tcb->condition, tcb->mutex);
-        }
-        pthread_mutex_unlock(tcb->mutex);
+    LOG(tcb, "establishes connection");
+    put_tcb(tcb);
+    return 1;
+}
 
-        LOG(tcb, "establishes connection");
-        return 1;
+/**
+ * @brief 从接收缓冲区中取数据, 参见 stream_recv()
+ * @param need 至少要有多少字节才返回
+ * @return 复制的字节数, 失败返回 -1
+ */
+static int recv_data(int sockfd, void *buf, unsigned int length, unsigned int need)
+{
+    server_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "Invalid socket %d" NORMAL, sockfd);
+    } else {
+        ret = stream_recv(&tcb->stream, buf, length, need);
     }
+    put_tcb(tcb);
+    return ret;
 }
 
 /**
  * @brief 接收来自STCP客户端的数据
  *
- * 信号/控制信息(如SYN, SYNACK等)则是双向传递. 这个函数每隔RECVBUF_ROLLING_INTERVAL时间
- * 就查询接收缓冲区, 直到等待的数据到达, 它然后存储数据并返回1. 如果这个函数失败, 则返回-1.
+ * 信号/控制信息(如SYN, SYNACK等)则是双向传递. 这个函数阻塞直到接收缓冲区中有 length 个字节,
+ * 它然后取走数据并返回1. 如果这个函数失败, 则返回-1.
  */
 int stcp_server_recv(int sockfd, void *buf, unsigned int length)
 {
-    server_tcb_t *tcb = tcbs[sockfd];
+    return recv_data(sockfd, buf, length, length) == -1 ? -1 : 1;
+}
+
+/**
+ * @brief 接收来自STCP客户端的数据, 有多少取多少
+ *
+ * 这个函数阻塞直到接收缓冲区非空, 然后取走最多 length 个字节, 返回取走的字节数. 如果这个函数失败, 则返回-1.
+ */
+int stcp_server_recv_some(int sockfd, void *buf, unsigned int length)
+{
+    return recv_data(sockfd, buf, length, length > 0 ? 1 : 0);
+}
+
+/**
+ * @brief 发送数据给STCP客户端
+ *
+ * 数据被复制进发送缓冲区, 在窗口允许时立即发出, 其余的数据在收到确认后发出. 发送缓冲区满时阻塞.
+ * 这个函数在成功时返回1，否则返回-1.
+ */
+int stcp_server_send(int sockfd, void *data, unsigned int length)
+{
+    server_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
     if (tcb == NULL) {
         log(RED "Invalid socket %d" NORMAL, sockfd);
-        return -1;
+    } else if (tcb->state != CONNECTED) {
+        LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
+    } else {
+        ret = stream_send(&tcb->stream, data, length);
     }
+    put_tcb(tcb);
+    return ret;
+}
 
-    pthread_mutex_lock(tcb->mutex);
-    while (tcb->usedBufLen < length) {
-        // Wait for enough data.
-        pthread_cond_wait(tcb->condition, tcb->mutex);
+/**
+ * @brief 发送数据给STCP客户端, 不阻塞
+ *
+ * 只把发送缓冲区放得下的部分复制进去, 返回复制的字节数, 发送缓冲区满时返回0. 如果这个函数失败, 则返回-1.
+ */
+int stcp_server_send_some(int sockfd, void *data, unsigned int length)
+{
+    server_tcb_t *tcb = get_tcb(sockfd);
+    int ret = -1;
+    if (tcb == NULL) {
+        log(RED "Invalid socket %d" NORMAL, sockfd);
+    } else if (tcb->state != CONNECTED) {
+        LOG(tcb, "is under %s, and cannot send data", state_to_s(tcb));
+    } else {
+        ret = stream_send_some(&tcb->stream, data, length);
     }
-    memcpy(buf, tcb->recvBuf, length);
-    memmove(tcb->recvBuf, tcb->recvBuf + length, tcb->usedBufLen - length);
-    tcb->usedBufLen -= length;
-    pthread_mutex_unlock(tcb->mutex);
-    return 1;
+    put_tcb(tcb);
+    return ret;
+}
+
+/**
+ * @brief 查询一个套接字当前就绪的事件, 作为 stcp_poll_wait() 的回调函数
+ *
+ * 调用 poll 的线程不一定拥有这个套接字, 所以在读临界区中访问 TCB.
+ */
+static short poll_query(int sockfd)
+{
+    short revents = STCP_POLLNVAL;
+    epoch_enter();
+    server_tcb_t *tcb = conntable_get(conns, sockfd);
+    if (tcb) {
+        revents = stream_poll(&tcb->stream);
+        if (tcb->state == CONNECTED) {
+            revents |= STCP_POLLACCEPT;
+        } else {
+            // 只有已经建立的连接可以发送数据
+            revents &= ~STCP_POLLOUT;
+        }
+        if (tcb->state == CLOSEWAIT) {
+            revents |= STCP_POLLHUP;
+        }
+    }
+    epoch_exit();
+    return revents;
+}
+
+/**
+ * @brief 等待一组套接字中的任何一个就绪, 参见 stcp_poll.h
+ */
+int stcp_server_poll(stcp_pollfd_t *fds, int nfds, int timeout)
+{
+    return stcp_poll_wait(fds, nfds, timeout, poll_query);
+}
+
+/**
+ * @brief 返回就绪通知的 eventfd, 应用程序可以把它加入自己的 epoll
+ */
+int stcp_server_eventfd(void)
+{
+    return stcp_poll_eventfd();
 }
 
 // 关闭STCP服务器
 //
-// 这个函数调用free()释放TCB条目. 它将该条目标记为NULL, 成功时(即位于正确的状态)返回1,
-// 失败时(即位于错误的状态)返回-1.
+// 这个函数等待连接进入CLOSEWAIT, 然后启动CLOSEWAIT定时器. 定时器到期时TCB被移出连接表并释放.
 //
 
 /**
  * @brief Release the tcb resource after a timeout
- * @param arg the POINTER to the specific tcb entry that we want to release.
+ * @param arg the tcb that we want to release.
  *
- * To make the tcb entry NULL again, we should pass &tcb[i] to this thread.
+ * It runs on the timer wheel thread CLOSEWAIT_TIMEOUT seconds after stcp_server_close().
+ * Once the tcb is out of the connection table, no new duplicated packet reaches it,
+ * but the seghandler may still be handling one, so the table's reference is dropped through
+ * epoch_retire(). Threads still blocked in the API hold their own references, and the tcb
+ * is freed when the last one is dropped.
  */
-static void *closewait_handler(void *arg)
+static void closewait_timeout(void *arg)
 {
-    server_tcb_t **tcbs_entry = arg;
-    server_tcb_t *tcb = *tcbs_entry;
+    server_tcb_t *tcb = arg;
 
-    struct timeval tv = { .tv_sec = CLOSEWAIT_TIMEOUT };
-    if (select(0, NULL, NULL, NULL, &tv) < 0) {
-        perror("select");
-    }
-
-    LOG(*tcbs_entry, "closewait timeout");
-
-    pthread_mutex_lock(tcb->mutex);
-    // Note the fsm handler thread may be locked by this mutex.
-    // The tcb must be on CLOSEWAIT. Currently it does not need the tcb pointer to be valid except for logging.
-    // At least now we can set tcbs_entry to NULL to avoid any new duplicated packet being handled.
-    *tcbs_entry = NULL;
-    pthread_mutex_unlock(tcb->mutex);
-
-    free(tcb->mutex);
-    free(tcb->condition);
-    if (tcb->recvBuf) {
-        free(tcb->recvBuf);
-    }
-    free(tcb);
+    LOG(tcb, "closewait timeout");
 
-    return arg;
+    stream_t *st = &tcb->stream;
+    LOG(tcb, "%u bytes sent, %u bytes resent, %u DATAACKs sent", st->bytes_sent, st->bytes_resent, st->nr_dataacks);
+    conntable_remove(conns, tcb->sockfd);
+    sip_unregport(son_connection, tcb->server_portNum);
+    // 之后重传定时器不再重新添加自己, 阻塞在 stcp_server_recv() 中的线程返回
+    stream_shutdown(st);
+    epoch_retire(tcb, put_tcb);
 }
 
 int stcp_server_close(int sockfd)
 {
-    server_tcb_t *tcb = tcbs[sockfd];
+    server_tcb_t *tcb = get_tcb(sockfd);
+    if (tcb == NULL) {
+        log("Invalid stcp socket %d", sockfd);
+        return -1;
+    }
     log("Socket listening on port %d is to be closed", tcb->server_portNum);
     log("waiting connection %d getting into %s", sockfd, server_state_s[CLOSEWAIT]);
 
     pthread_mutex_lock(tcb->mutex);
-    if (tcb->state != CLOSEWAIT) {
+    while (tcb->state != CLOSEWAIT) {
         pthread_cond_wait(tcb->condition, tcb->mutex);
     }
     pthread_mutex_unlock(tcb->mutex);
 
     LOG(tcb, "connection %d getting into %s", sockfd, state_to_s(tcb));
 
-    pthread_t tid;
-    pthread_create(&tid, NULL, closewait_handler, &tcbs[sockfd]);
+    tw_timer_init(&tcb->closewait_timer, closewait_timeout, tcb);
+    timerwheel_add(timers, &tcb->closewait_timer, CLOSEWAIT_TIMEOUT * 1000);
+    put_tcb(tcb);
     return 0;
 }
 
@@ -267,6 +480,7 @@ static inline void send_ctrl(server_tcb_t *tcb, unsigned short type)
         .header.dest_port = tcb->client_portNum,
         .header.length = 0,
         .header.type = type,
+        .header.rcv_win = stream_rcv_win(&tcb->stream),
     };
     if (sip_sendseg(son_connection, tcb->client_nodeID, &synack) == -1) {
         log("sending ctrl to %d:%d failed", tcb->client_nodeID, tcb->client_portNum);
@@ -274,19 +488,28 @@ static inline void send_ctrl(server_tcb_t *tcb, unsigned short type)
 }
 
 /**
- * @brief 发送 DATAACK
+ * @brief 发送 SYNACK, 如果客户端在 SYN 中带了选项, 则在数据部分中给出双方采用的选项
  */
-static inline void send_dataack(const server_tcb_t *tcb)
+static void send_synack(server_tcb_t *tcb, int with_opt)
 {
+    if (!with_opt) {
+        send_ctrl(tcb, SYNACK);
+        return;
+    }
     seg_t synack = {
         .header.src_port = tcb->server_portNum,
         .header.dest_port = tcb->client_portNum,
-        .header.length = 0,
-        .header.type = DATAACK,
-        .header.seq_num = tcb->expect_seqNum,
+        .header.length = sizeof(stcp_synopt_t),
+        .header.type = SYNACK,
+        .header.rcv_win = stream_rcv_win(&tcb->stream),
+    };
+    stcp_synopt_t opt = {
+        .flags = tcb->stream.sr ? STCP_SYNOPT_SR : 0,
+        .window = tcb->stream.window,
     };
+    memcpy(synack.data, &opt, sizeof(opt));
     if (sip_sendseg(son_connection, tcb->client_nodeID, &synack) == -1) {
-        log("sending ctrl to port %d:%d failed", tcb->client_nodeID, tcb->client_portNum);
+        log("sending ctrl to %d:%d failed", tcb->client_nodeID, tcb->client_portNum);
     }
 }
 
@@ -303,14 +526,26 @@ static void server_fsm(server_tcb_t *tcb, seg_t *seg)
         switch (seg->header.type) {
         case SYN:
             tcb->client_portNum = seg->header.src_port;
-            send_ctrl(tcb, SYNACK);
+            // 此后只有来自这个客户端的段才交给这个连接
+            if (conntable_bind(conns, tcb->sockfd, tcb->client_nodeID, tcb->client_portNum) == -1) {
+                LOG(tcb, "cannot bind to %d:%d", tcb->client_nodeID, tcb->client_portNum);
+            }
+            if (seg->header.length >= sizeof(stcp_synopt_t)) {
+                stcp_synopt_t opt;
+                memcpy(&opt, seg->data, sizeof(opt));
+                tcb->stream.sr = (opt.flags & STCP_SYNOPT_SR) != 0;
+                tcb->stream.window = opt.window > 0 && opt.window < STCP_MAX_WINDOW ? opt.window : STCP_MAX_WINDOW;
+            }
+            stream_set_peer_window(&tcb->stream, seg->header.rcv_win);
+            send_synack(tcb, seg->header.length >= sizeof(stcp_synopt_t));
             LOG(tcb, "has sent %s", seg_type_s(seg));
 
-            // 这里上锁似乎没有什么作用 !?
+            // 持有锁修改 state 并唤醒, 否则 API 可能在检查 state 之后, 等待之前错过唤醒
             pthread_mutex_lock(tcb->mutex);
             tcb->state = CONNECTED;
-            pthread_cond_signal(tcb->condition);
+            pthread_cond_broadcast(tcb->condition);
             pthread_mutex_unlock(tcb->mutex);
+            stcp_poll_notify();
 
             LOG(tcb, "enters state %s", state_to_s(tcb));
             break;
@@ -321,41 +556,25 @@ static void server_fsm(server_tcb_t *tcb, seg_t *seg)
     case CONNECTED:
         switch (seg->header.type) {
         case SYN:
-            send_ctrl(tcb, SYNACK);
+            send_synack(tcb, seg->header.length >= sizeof(stcp_synopt_t));
             LOG(tcb, "receives duplicated SYN request");
             break;
         case FIN:
             send_ctrl(tcb, FINACK);
             LOG(tcb, "has sent %s", seg_type_s(seg));
 
-            // 这里上锁似乎没有什么作用 !?
+            // 持有锁修改 state 并唤醒, 否则 API 可能在检查 state 之后, 等待之前错过唤醒
             pthread_mutex_lock(tcb->mutex);
             tcb->state = CLOSEWAIT;
-            pthread_cond_signal(tcb->condition);
+            pthread_cond_broadcast(tcb->condition);
             pthread_mutex_unlock(tcb->mutex);
+            stcp_poll_notify();
 
             LOG(tcb, "enters state %s", state_to_s(tcb));
             break;
         case DATA:
-            if (tcb->expect_seqNum == seg->header.seq_num) {
-                pthread_mutex_lock(tcb->mutex);
-                if (tcb->usedBufLen + seg->header.length > RECEIVE_BUF_SIZE) {
-                    LOG(tcb, "seq %d exceeds the recv buffer size, discarded", seg->header.seq_num);
-                    pthread_mutex_unlock(tcb->mutex);
-                    break;
-                }
-                memcpy(tcb->recvBuf + tcb->usedBufLen, seg->data, seg->header.length);
-                tcb->usedBufLen += seg->header.length;
-                pthread_cond_signal(tcb->condition);
-                pthread_mutex_unlock(tcb->mutex);
-                tcb->expect_seqNum += seg->header.length;
-                send_dataack(tcb);
-                seg->header.type = DATAACK;
-                LOG(tcb, "has sent %s (expected seq %d -> %d)", seg_type_s(seg), seg->header.seq_num, tcb->expect_seqNum);
-            } else {
-                LOG(tcb, "expects seq num %d, but receives %d", tcb->expect_seqNum, seg->header.seq_num);
-                send_dataack(tcb);
-            }
+        case DATAACK:
+            stream_input(&tcb->stream, seg);
             break;
         default:
             LOG(tcb, "unexpected %s segment for state %s", seg_type_s(seg), server_state_s[CLOSEWAIT]);
@@ -367,10 +586,14 @@ static void server_fsm(server_tcb_t *tcb, seg_t *seg)
             send_ctrl(tcb, FINACK);
             LOG(tcb, "receives duplicated %s segment", seg_type_s(seg));
             break;
+        case DATAACK:
+            // 客户端对服务器发出的数据的确认可能在 FIN 之后才到达
+            stream_input(&tcb->stream, seg);
+            break;
         default:
             // Replacing the state symbol from a dynamic state_to_s call to a static expression keeps the coupling
             // of the symbol and its literal string but avoid potential hazard on accessing a dangling pointer.
-            // Because the closewait_handler will free the pointer.
+            // Because the closewait_timeout will free the pointer.
             LOG(tcb, "unexpected %s segment for state %s", seg_type_s(seg), server_state_s[CLOSEWAIT]);
         }
         break;
@@ -379,6 +602,21 @@ static void server_fsm(server_tcb_t *tcb, seg_t *seg)
     }
 }
 
+/**
+ * @brief SON 断开时唤醒等待中的 API 调用者
+ */
+static void wake_closed(void *arg, void *unused)
+{
+    server_tcb_t *tcb = arg;
+    LOG(tcb, "Sadly, socket %d has not been closed", tcb->sockfd);
+    pthread_mutex_lock(tcb->mutex);
+    tcb->state = CLOSEWAIT;
+    // accept 和 close 可能同时在等待
+    pthread_cond_broadcast(tcb->condition);
+    pthread_mutex_unlock(tcb->mutex);
+    stream_shutdown(&tcb->stream);
+}
+
 // 处理进入段的线程
 //
 // 这是由stcp_server_init()启动的线程. 它处理所有来自客户端的进入数据. seghandler被设计为一个调用sip_recvseg()的无穷循环,
@@ -398,13 +636,9 @@ void *seghandler(void* arg)
 
             // Notice all valid tcb, avoid infinite stalling.
             log("Wake up all waiting api-users");
-            for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-                if (tcbs[i]) {
-                    log("Sadly, socket %d has not been closed", i);
-                    tcbs[i]->state = CLOSEWAIT;
-                    pthread_cond_signal(tcbs[i]->condition);
-                }
-            }
+            epoch_enter();
+            conntable_foreach(conns, wake_closed, NULL);
+            epoch_exit();
 
             break;
         } else if (result == 1) {
@@ -420,17 +654,20 @@ void *seghandler(void* arg)
         log(">>> Receive %s segment from %d to %d",
             seg_type_s(&seg), seg.header.src_port, seg.header.dest_port);
 
-        // Search & forward.
-        // TODO non-block!!!
-        for (int i = 0; i < MAX_TRANSPORT_CONNECTIONS; i++) {
-            if (tcbs[i] && tcbs[i]->server_portNum == seg.header.dest_port) {
-                log("forward the packet to tcb %p", tcbs[i]);
-                Assert(tcbs[i]->client_nodeID == 0 || tcbs[i]->client_nodeID == src_id, "Oops, the id has changed!");
-                tcbs[i]->client_nodeID = src_id;
-                server_fsm(tcbs[i], &seg);
-                break;  // efficiency!
+        // Search & forward. TCB 在 epoch_exit() 之前不会被 closewait_timeout() 释放
+        epoch_enter();
+        server_tcb_t *tcb = conntable_lookup(conns, src_id, seg.header.src_port, seg.header.dest_port);
+        if (tcb) {
+            log("forward the packet to tcb %p", tcb);
+            if (tcb->client_portNum == (unsigned int)-1) {
+                // 还在等待 SYN, 通过 (CONN_ANY, CONN_ANY, 服务器端口) 找到
+                tcb->client_nodeID = src_id;
             }
+            Assert(tcb->client_nodeID == src_id, "Oops, the id has changed!");
+            server_fsm(tcb, &seg);
         }
+        epoch_exit();
+        epoch_poll();
 
         log("<<< Packet handling done");
 
@@ -8,8 +8,12 @@
 #define STCPSERVER_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "seg.h"
 #include "constants.h"
+#include "timerwheel.h"
+#include "stream.h"
+#include "stcp_poll.h"
 
 //FSM中使用的服务器状态
 
@@ -21,16 +25,17 @@ enum {
 
 //服务器传输控制块. 一个STCP连接的服务器端使用这个数据结构记录连接信息.
 typedef struct server_tcb {
+    int sockfd;                     //连接表分配的套接字ID
     unsigned int server_nodeID;     //服务器节点ID, 类似IP地址, 本实验未使用
     unsigned int server_portNum;    //服务器端口号
     unsigned int client_nodeID;     //客户端节点ID, 类似IP地址, 本实验未使用
     unsigned int client_portNum;    //客户端端口号
     unsigned int state;         	//服务器状态
-    unsigned int expect_seqNum;     //服务器期待的数据序号
-    char* recvBuf;                  //指向接收缓冲区的指针
-    unsigned int  usedBufLen;       //接收缓冲区中已接收数据的大小
-    pthread_mutex_t *mutex;         //指向一个互斥量的指针, 该互斥量用于对接收缓冲区的访问
+    pthread_mutex_t *mutex;         //指向一个互斥量的指针, 该互斥量用于对state的访问
     pthread_cond_t *condition;      // 用于唤醒阻塞 API 的条件变量
+    atomic_int refs;                //引用计数: 连接表一个, 每个正在执行的API调用一个, 减到0时释放
+    stream_t stream;                //两个方向的数据通路: 发送缓冲区, 接收缓冲区, 重传, 拥塞控制和流量控制. 参见stream.h
+    tw_timer_t closewait_timer;     //CLOSEWAIT超时后释放这个TCB
 } server_tcb_t;
 
 //
@@ -54,36 +59,98 @@ void stcp_server_init(int conn);
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
+int stcp_server_init_transport(int conn, int transport);
+
+// 同stcp_server_init(), 但由参数transport选择之后与SIP进程之间的段通过套接字(SHMCHAN_SOCKET)
+// 还是共享内存环(SHMCHAN_SHM)传递, 参见shmring.h. stcp_server_init()使用套接字.
+// 成功时返回1, 与SIP进程握手失败时返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
 int stcp_server_sock(unsigned int server_port);
 
-// 这个函数查找服务器TCB表以找到第一个NULL条目, 然后使用malloc()为该条目创建一个新的TCB条目.
+// 这个函数使用malloc()创建一个新的TCB条目, 并把它加入连接表(参见conntable.h).
 // 该TCB中的所有字段都被初始化, 例如, TCB state被设置为CLOSED, 服务器端口被设置为函数调用参数server_port.
-// TCB表中条目的索引应作为服务器的新套接字ID被这个函数返回, 它用于标识服务器的连接.
-// 如果TCB表中没有条目可用, 这个函数返回-1.
+// 连接表分配的套接字ID被这个函数返回, 它用于标识服务器的连接. 连接释放之后这个ID不再有效, 也不会指向之后创建的连接.
+// 如果连接表已满或内存不足, 这个函数返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_listen(int sockfd);
+
+// 这个函数使用sockfd获得TCB指针, 将连接的state转换为LISTENING后立即返回, 不等待连接.
+// 连接建立之后stcp_server_poll()报告STCP_POLLACCEPT. 成功时返回1, 套接字无效或者不在CLOSED状态时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
 int stcp_server_accept(int sockfd);
 
-// 这个函数使用sockfd获得TCB指针, 并将连接的state转换为LISTENING. 它然后启动定时器进入忙等待直到TCB状态转换为CONNECTED
-// (当收到SYN时, seghandler会进行状态的转换). 该函数在一个无穷循环中等待TCB的state转换为CONNECTED,
-// 当发生了转换时, 该函数返回1. 你可以使用不同的方法来实现这种阻塞等待.
+// 这个函数调用stcp_server_listen()将连接的state转换为LISTENING, 然后阻塞直到TCB状态转换为CONNECTED
+// (当收到SYN时, seghandler会进行状态的转换). 当发生了转换时, 该函数返回1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
 int stcp_server_recv(int sockfd, void* buf, unsigned int length);
 
-// 这个函数接收来自STCP客户端的数据. 你不需要在本实验中实现它.
+// 这个函数接收来自STCP客户端的数据. 它阻塞直到接收缓冲区中有length个字节, 然后把它们复制到buf中并返回1.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_recv_some(int sockfd, void* buf, unsigned int length);
+
+// 同stcp_server_recv(), 但只阻塞到接收缓冲区中有数据为止, 然后复制最多length个字节到buf中, 返回复制的字节数.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_send(int sockfd, void* data, unsigned int length);
+
+// 这个函数发送数据给STCP客户端. 数据被复制进发送缓冲区后在窗口允许时发出, 发送缓冲区满时阻塞.
+// 确认捎带在客户端发来的DATA段上时, 服务器不再单独发送DATAACK. 成功时返回1, 否则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_send_some(int sockfd, void* data, unsigned int length);
+
+// 同stcp_server_send(), 但不阻塞: 只把发送缓冲区放得下的部分复制进去, 返回复制的字节数, 发送缓冲区满时返回0.
+// 如果这个函数失败, 则返回-1.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_poll(stcp_pollfd_t* fds, int nfds, int timeout);
+
+// 这个函数等待fds中的任何一个套接字就绪, 参见stcp_poll.h. 它报告
+//   STCP_POLLACCEPT: 连接已经建立(state为CONNECTED);
+//   STCP_POLLIN: 接收缓冲区中有数据, stcp_server_recv_some()不会阻塞;
+//   STCP_POLLOUT: 连接已经建立且发送缓冲区中有空间, stcp_server_send_some()不会阻塞;
+//   STCP_POLLHUP: 客户端已经断开连接(state为CLOSEWAIT);
+//   STCP_POLLNVAL: 套接字无效.
+// timeout是毫秒数, 为-1时一直等待. 返回就绪的套接字数, 超时返回0.
+//
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+
+int stcp_server_eventfd(void);
+
+// 这个函数返回一个eventfd, 任何套接字的就绪条件可能变化时它变为可读. 应用程序可以把它加入自己的epoll,
+// 它可读时用超时0调用stcp_server_poll(), poll会清空它. 失败时返回-1.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
 
 int stcp_server_close(int sockfd);
 
-// 这个函数调用free()释放TCB条目. 它将该条目标记为NULL, 成功时(即位于正确的状态)返回1,
-// 失败时(即位于错误的状态)返回-1.
+// 这个函数等待连接进入CLOSEWAIT, 然后启动CLOSEWAIT定时器. 定时器到期时TCB被移出连接表,
+// 在seghandler不再使用它之后才被释放.
 //
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 //
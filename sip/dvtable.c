@@ -9,23 +9,19 @@
 //其中cost(X,V)即邻居表的内容，D(V,Y)在每次获得更新报文时获取。
 //其他链路代价被初始化为INFINITE_COST.
 //该函数返回动态创建的距离矢量表.
-dv_t *dvtable_create(const nbr_cost_entry_t *nct)
+dv_t *dvtable_create(const nbr_cost_entry_t *nct, nodeindex_t *index)
 {
     // distance vector table
-    dv_t *dvt = calloc(1, sizeof(*dvt));
-    dvt->nodeID = topology_getMyNodeID();
-
-    // 初始化成无效项
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        dvt->dvEntry[i].nodeID = -1;
-        dvt->dvEntry[i].cost = INFINITE_COST;
+    dv_t *dvt = malloc(sizeof(*dvt));
+    if (dvt == NULL) {
+        sys_panic("malloc");
     }
+    dvtable_init(dvt, topology_getMyNodeID());
 
     // 用邻居代价表初始化最初的距离矢量
     int n = topology_getNbrNum();
     for (int i = 0; i < n; i++) {
-        dvt->dvEntry[i].nodeID = nct[i].nodeID;
-        dvt->dvEntry[i].cost = nct[i].cost;
+        dvtable_setcost(dvt, nodeindex_intern(index, nct[i].nodeID), nct[i].cost);
     }
 
     return dvt;
@@ -35,55 +31,72 @@ dv_t *dvtable_create(const nbr_cost_entry_t *nct)
 //它释放所有为距离矢量表动态分配的内存.
 void dvtable_destroy(dv_t **dvtable)
 {
+    dvtable_free(*dvtable);
     free(*dvtable);
     *dvtable = NULL;
 }
 
-//更新当前结点的距离矢量，也被成功设置了,就返回1,否则返回-1.
-int dvtable_setcost(dv_t *dvt, int toNodeID, unsigned int cost)
+void dvtable_init(dv_t *dvt, int nodeID)
 {
-    // 搜索元素
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        if (dvt->dvEntry[i].nodeID == toNodeID) {
-            dvt->dvEntry[i].cost = cost;
-            return 1;
-        }
-    }
+    dvt->nodeID = nodeID;
+    dvt->size = 0;
+    dvt->cost = NULL;
+}
 
-    // 插入新的元素
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        if (dvt->dvEntry[i].nodeID == -1) {
-            dvt->dvEntry[i].nodeID = toNodeID;
-            dvt->dvEntry[i].cost = cost;
-            return 1;
-        }
-    }
+void dvtable_free(dv_t *dvt)
+{
+    free(dvt->cost);
+    dvt->cost = NULL;
+    dvt->size = 0;
+}
 
-    // miss 且表满
-    return -1;
+//这个函数把距离矢量清空成全部不可达, 源节点ID设置为nodeID.
+//用于保存邻居通告的距离矢量: 邻居失效时它的距离矢量也被清空.
+void dvtable_reset(dv_t *dvt, int nodeID)
+{
+    dvt->nodeID = nodeID;
+    for (unsigned int i = 0; i < dvt->size; i++) {
+        dvt->cost[i] = INFINITE_COST;
+    }
 }
 
-//这个函数返回距离矢量的链路代价.
-//如果这个节点在表中发现了,就返回链路代价,否则返回INFINITE_COST.
-//具体是谁的距离矢量，调用者应当清楚
-unsigned int dvtable_getcost(dv_t *dv, int toNodeID)
+//代价数组按两倍增长, 新增的部分填充INFINITE_COST.
+void dvtable_reserve(dv_t *dvt, unsigned int n)
 {
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        if (dv->dvEntry[i].nodeID == toNodeID) {
-            return dv->dvEntry[i].cost;
-        }
+    if (n <= dvt->size) {
+        return;
+    }
+    unsigned int size = dvt->size ? dvt->size : 16;
+    while (size < n) {
+        size *= 2;
+    }
+    unsigned int *grown = realloc(dvt->cost, size * sizeof(*grown));
+    if (grown == NULL) {
+        sys_panic("realloc");
     }
-    return INFINITE_COST;
+    for (unsigned int i = dvt->size; i < size; i++) {
+        grown[i] = INFINITE_COST;
+    }
+    dvt->cost = grown;
+    dvt->size = size;
+}
+
+//更新当前结点的距离矢量.
+void dvtable_setcost(dv_t *dvt, int idx, unsigned int cost)
+{
+    Assert(idx >= 0, "node index %d out of range", idx);
+    dvtable_reserve(dvt, (unsigned int)idx + 1);
+    dvt->cost[idx] = cost;
 }
 
 //这个函数打印距离矢量表的内容.
-void dvtable_print(dv_t *dv)
+void dvtable_print(dv_t *dv, nodeindex_t *index)
 {
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        dv_entry_t *ent = &dv->dvEntry[i];
-        if (ent->nodeID != -1) {
+    unsigned int n = nodeindex_size(index);
+    for (unsigned int i = 0; i < n && i < dv->size; i++) {
+        if (dv->cost[i] != INFINITE_COST) {
             printf("distance vector %d -> %d : %d\n",
-                   dv->nodeID, ent->nodeID, ent->cost);
+                   dv->nodeID, nodeindex_id(index, i), dv->cost[i]);
         }
     }
 }
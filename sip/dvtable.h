@@ -1,34 +1,51 @@
 //文件名: sip/dvtable.h
 //
 //描述: 这个文件定义用于距离矢量表的数据结构和函数. 
+//距离矢量是以节点下标(参见nodeindex.h)为下标的连续代价数组, 随着新节点的出现增长.
+//超出数组长度的下标, 即还没有代价的节点, 代价都是INFINITE_COST.
 //
 //创建日期: 2015年
 
 #ifndef DVTABLE_H
 #define DVTABLE_H
 
+#include "constants.h"
 #include "nbrcosttable.h"
+#include "nodeindex.h"
 
-//dv_entry_t结构定义
-typedef struct distancevectorentry {
-	int nodeID;		    //目标节点ID，-1 表示无效项
-	unsigned int cost;	//到目标节点的代价
-} dv_entry_t;
-
-//一个距离矢量表包含(n+1)个dv_t条目, 其中n是这个节点的邻居数, 剩下的一个是这个节点自身. 
 typedef struct distancevector {
 	int nodeID;		                  //源节点ID
-	dv_entry_t dvEntry[MAX_NODE_NUM]; //一个包含N个dv_entry_t的数组, 其中每个成员包含目标节点ID和从该源节点到该目标节点的代价. N是重叠网络中总的节点数.
+	unsigned int size;                //cost数组的长度
+	unsigned int* cost;               //cost[i]是从源节点到下标为i的目标节点的代价
 } dv_t;
 
-dv_t* dvtable_create(const nbr_cost_entry_t *nct);
+//这个函数动态创建本节点的距离矢量表, 到每个邻居的代价是直接链路代价. 邻居在index中分配下标.
+dv_t* dvtable_create(const nbr_cost_entry_t *nct, nodeindex_t* index);
 
 void dvtable_destroy(dv_t **dvtable);
 
-int dvtable_setcost(dv_t* dvtable, int toNodeID, unsigned int cost);
+//这个函数初始化一个空的距离矢量, 源节点ID为nodeID. 用于嵌入其他结构的距离矢量.
+void dvtable_init(dv_t* dvtable, int nodeID);
+
+//这个函数释放dvtable_init()初始化的距离矢量的代价数组.
+void dvtable_free(dv_t* dvtable);
+
+//这个函数把距离矢量中所有的代价都设置为INFINITE_COST, 源节点ID设置为nodeID.
+void dvtable_reset(dv_t* dvtable, int nodeID);
+
+//这个函数保证代价数组至少有n个元素, 之后可以把cost当作长度为n的数组直接访问.
+void dvtable_reserve(dv_t* dvtable, unsigned int n);
+
+//这个函数设置到下标为idx的节点的代价, 必要时增长代价数组.
+void dvtable_setcost(dv_t* dvtable, int idx, unsigned int cost);
 
-unsigned int dvtable_getcost(dv_t* dvtable, int toNodeID);
+//这个函数返回到下标为idx的节点的代价.
+static inline unsigned int dvtable_getcost(const dv_t* dvtable, int idx)
+{
+	return (unsigned int)idx < dvtable->size ? dvtable->cost[idx] : INFINITE_COST;
+}
 
-void dvtable_print(dv_t* dvtable);
+//这个函数打印距离矢量表的内容, index用于把下标转换成节点ID.
+void dvtable_print(dv_t* dvtable, nodeindex_t* index);
 
 #endif
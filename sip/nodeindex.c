@@ -0,0 +1,140 @@
+//文件名: sip/nodeindex.c
+//
+//描述: 这个文件实现节点ID到稠密下标的映射, 参见nodeindex.h.
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "../common/epoch.h"
+#include "nodeindex.h"
+
+//新建映射的初始槽数, 必须是2的幂
+#define NODEINDEX_INIT_SLOTS 64
+
+static unsigned int hash(int nodeID)
+{
+    unsigned int h = (unsigned int)nodeID * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
+
+static nodemap_t *nodemap_alloc(unsigned int nr_slots)
+{
+    nodemap_t *map = malloc(sizeof(*map) + nr_slots * sizeof(map->slots[0]));
+    int *ids = malloc(nr_slots / 2 * sizeof(*ids));
+    if (map == NULL || ids == NULL) {
+        sys_panic("malloc");
+    }
+    map->mask = nr_slots - 1;
+    atomic_init(&map->nr, 0);
+    map->ids = ids;
+    for (unsigned int i = 0; i < nr_slots; i++) {
+        map->slots[i].nodeID = 0;
+        atomic_init(&map->slots[i].idx, -1);
+    }
+    return map;
+}
+
+static void nodemap_free(void *arg)
+{
+    nodemap_t *map = arg;
+    free(map->ids);
+    free(map);
+}
+
+//这个函数返回nodeID所在的槽, 或者应该插入的空槽.
+static nodeslot_t *probe(nodemap_t *map, int nodeID)
+{
+    for (unsigned int i = hash(nodeID); ; i++) {
+        nodeslot_t *slot = &map->slots[i & map->mask];
+        if (atomic_load_explicit(&slot->idx, memory_order_acquire) == -1 || slot->nodeID == nodeID) {
+            return slot;
+        }
+    }
+}
+
+nodeindex_t *nodeindex_create()
+{
+    nodeindex_t *index = malloc(sizeof(*index));
+    if (index == NULL) {
+        sys_panic("malloc");
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    atomic_init(&index->map, nodemap_alloc(NODEINDEX_INIT_SLOTS));
+    return index;
+}
+
+void nodeindex_destroy(nodeindex_t **index)
+{
+    nodemap_free(atomic_load(&(*index)->map));
+    pthread_mutex_destroy(&(*index)->lock);
+    free(*index);
+    *index = NULL;
+}
+
+int nodeindex_lookup(nodeindex_t *index, int nodeID)
+{
+    epoch_enter();
+    nodemap_t *map = atomic_load_explicit(&index->map, memory_order_acquire);
+    int idx = atomic_load_explicit(&probe(map, nodeID)->idx, memory_order_acquire);
+    epoch_exit();
+    return idx;
+}
+
+int nodeindex_intern(nodeindex_t *index, int nodeID)
+{
+    pthread_mutex_lock(&index->lock);
+    nodemap_t *map = atomic_load_explicit(&index->map, memory_order_relaxed);
+    nodeslot_t *slot = probe(map, nodeID);
+    int idx = atomic_load_explicit(&slot->idx, memory_order_relaxed);
+    if (idx != -1) {
+        pthread_mutex_unlock(&index->lock);
+        return idx;
+    }
+
+    unsigned int nr = atomic_load_explicit(&map->nr, memory_order_relaxed);
+    if (nr == (map->mask + 1) / 2) {
+        // 装载率达到一半, 换成两倍大的表. 下标不变, 只是重新散列
+        nodemap_t *bigger = nodemap_alloc((map->mask + 1) * 2);
+        for (unsigned int i = 0; i < nr; i++) {
+            nodeslot_t *s = probe(bigger, map->ids[i]);
+            s->nodeID = map->ids[i];
+            atomic_init(&s->idx, (int)i);
+            bigger->ids[i] = map->ids[i];
+        }
+        atomic_init(&bigger->nr, nr);
+        atomic_store_explicit(&index->map, bigger, memory_order_release);
+        epoch_retire(map, nodemap_free);
+        map = bigger;
+        slot = probe(map, nodeID);
+    }
+
+    idx = (int)nr;
+    map->ids[idx] = nodeID;
+    slot->nodeID = nodeID;
+    atomic_store_explicit(&map->nr, nr + 1, memory_order_release);
+    atomic_store_explicit(&slot->idx, idx, memory_order_release);
+    pthread_mutex_unlock(&index->lock);
+    epoch_poll();
+    return idx;
+}
+
+unsigned int nodeindex_size(nodeindex_t *index)
+{
+    epoch_enter();
+    unsigned int nr = atomic_load_explicit(&atomic_load_explicit(&index->map, memory_order_acquire)->nr,
+                                           memory_order_acquire);
+    epoch_exit();
+    return nr;
+}
+
+int nodeindex_id(nodeindex_t *index, int idx)
+{
+    epoch_enter();
+    nodemap_t *map = atomic_load_explicit(&index->map, memory_order_acquire);
+    Assert(idx >= 0 && (unsigned int)idx < atomic_load_explicit(&map->nr, memory_order_acquire),
+           "node index %d out of range", idx);
+    int nodeID = map->ids[idx];
+    epoch_exit();
+    return nodeID;
+}
@@ -0,0 +1,51 @@
+//文件名: sip/nodeindex.h
+//
+//描述: 这个文件定义节点ID到稠密下标的映射.
+//节点ID可以是任意的32位整数. 每个节点第一次出现时(来自拓扑文件或者路由更新报文)被分配一个下标,
+//下标从0开始连续分配, 之后不再改变, 也不会被回收. SIP的距离矢量, 可行距离和路由表都是以下标为下标的
+//连续数组, 节点ID只在收发报文时转换一次, 之后的计算都是数组访问.
+//
+//映射是一个开放寻址的哈希表(nodemap_t), 通过原子指针发布. 查找不加锁, 可以在转发路径上调用;
+//分配下标的写者由互斥量串行化, 表的装载率超过一半时复制到两倍大的新表, 旧表通过epoch_retire()释放.
+
+#ifndef NODEINDEX_H
+#define NODEINDEX_H
+
+#include <pthread.h>
+
+typedef struct nodeslot {
+    int nodeID;                     //节点ID
+    _Atomic int idx;                //节点的下标, -1表示空槽. 写者先填写nodeID再发布idx
+} nodeslot_t;
+
+typedef struct nodemap {
+    unsigned int mask;              //槽数减1, 槽数是2的幂
+    _Atomic unsigned int nr;        //已经分配的下标数
+    int* ids;                       //ids[i]是下标为i的节点ID, 容量是槽数的一半
+    nodeslot_t slots[];
+} nodemap_t;
+
+typedef struct nodeindex {
+    pthread_mutex_t lock;           //串行化写者
+    nodemap_t* _Atomic map;         //当前的哈希表
+} nodeindex_t;
+
+//这个函数动态创建一个空的映射.
+nodeindex_t* nodeindex_create();
+
+//这个函数删除映射. 调用者保证没有其他线程还在使用它.
+void nodeindex_destroy(nodeindex_t** index);
+
+//这个函数返回节点nodeID的下标, 节点还没有出现过时返回-1. 不加锁.
+int nodeindex_lookup(nodeindex_t* index, int nodeID);
+
+//这个函数返回节点nodeID的下标, 节点第一次出现时为它分配下一个下标.
+int nodeindex_intern(nodeindex_t* index, int nodeID);
+
+//这个函数返回已经分配的下标数, 有效的下标是0到nodeindex_size() - 1.
+unsigned int nodeindex_size(nodeindex_t* index);
+
+//这个函数返回下标为idx的节点ID.
+int nodeindex_id(nodeindex_t* index, int idx);
+
+#endif
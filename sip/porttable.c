@@ -0,0 +1,101 @@
+//文件名: sip/porttable.c
+//
+//描述: 这个文件实现端口表, 参见porttable.h.
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "../common/constants.h"
+#include "porttable.h"
+
+static inline int port_hash(unsigned int port)
+{
+    return port % MAX_PORTTABLE_SLOTS;
+}
+
+porttable_t *porttable_create()
+{
+    return calloc(1, sizeof(porttable_t));
+}
+
+void porttable_destroy(porttable_t *porttable)
+{
+    for (int i = 0; i < MAX_PORTTABLE_SLOTS; i++) {
+        porttable_entry_t *ent = porttable->hash[i];
+        while (ent) {
+            porttable_entry_t *temp = ent;
+            ent = ent->next;
+            free(temp);
+        }
+    }
+    free(porttable);
+}
+
+int porttable_register(porttable_t *porttable, unsigned int port, int conn)
+{
+    porttable_entry_t **pEntry = &porttable->hash[port_hash(port)];
+    while (*pEntry) {
+        if ((*pEntry)->port == port) {
+            if ((*pEntry)->conn != conn) {
+                return -1;
+            }
+            (*pEntry)->nr_socks++;
+            return 1;
+        }
+        pEntry = &(*pEntry)->next;
+    }
+    *pEntry = calloc(1, sizeof(**pEntry));
+    if (*pEntry == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    (*pEntry)->port = port;
+    (*pEntry)->conn = conn;
+    (*pEntry)->nr_socks = 1;
+    return 1;
+}
+
+void porttable_unregister(porttable_t *porttable, unsigned int port, int conn)
+{
+    porttable_entry_t **pEntry = &porttable->hash[port_hash(port)];
+    while (*pEntry) {
+        porttable_entry_t *ent = *pEntry;
+        if (ent->port == port && ent->conn == conn) {
+            if (--ent->nr_socks == 0) {
+                *pEntry = ent->next;
+                free(ent);
+            }
+            return;
+        }
+        pEntry = &ent->next;
+    }
+    warn("port %u is not registered by conn %d", port, conn);
+}
+
+void porttable_remove_conn(porttable_t *porttable, int conn)
+{
+    for (int i = 0; i < MAX_PORTTABLE_SLOTS; i++) {
+        porttable_entry_t **pEntry = &porttable->hash[i];
+        while (*pEntry) {
+            porttable_entry_t *ent = *pEntry;
+            if (ent->conn == conn) {
+                *pEntry = ent->next;
+                free(ent);
+            } else {
+                pEntry = &ent->next;
+            }
+        }
+    }
+}
+
+int porttable_getconn(const porttable_t *porttable, unsigned int port)
+{
+    const porttable_entry_t *ent = porttable->hash[port_hash(port)];
+    while (ent) {
+        if (ent->port == port) {
+            return ent->conn;
+        }
+        ent = ent->next;
+    }
+    return -1;
+}
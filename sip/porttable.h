@@ -0,0 +1,43 @@
+//文件名: sip/porttable.h
+//
+//描述: 这个文件定义用于端口表的数据结构和函数.
+//端口表记录本地每个STCP端口由哪个STCP进程使用, SIP进程据此把发给本节点的段交给正确的STCP进程.
+//STCP进程通过sip_regport()和sip_unregport()登记和注销端口, 参见seg.h.
+//一个端口表是一个包含MAX_PORTTABLE_SLOTS个槽条目的哈希表.
+
+#ifndef PORTTABLE_H
+#define PORTTABLE_H
+
+//porttable_entry_t是包含在端口表中的端口条目.
+typedef struct porttable_entry {
+    unsigned int port;              //STCP端口号
+    int conn;                       //使用该端口的STCP进程与SIP进程之间的连接
+    int nr_socks;                   //该进程中使用这个端口的STCP套接字数
+    struct porttable_entry* next;   //指向在同一个端口表槽中的下一个porttable_entry_t
+} porttable_entry_t;
+
+//一个端口表是一个包含MAX_PORTTABLE_SLOTS个槽的哈希表. 每个槽是一个端口条目的链表.
+typedef struct porttable {
+    porttable_entry_t* hash[MAX_PORTTABLE_SLOTS];
+} porttable_t;
+
+//这个函数动态创建端口表, 表中的所有条目都被初始化为NULL指针.
+porttable_t* porttable_create();
+
+//这个函数删除端口表, 所有为端口表动态分配的数据结构将被释放.
+void porttable_destroy(porttable_t* porttable);
+
+//这个函数为连接conn登记端口port.
+//如果端口已经由同一个连接登记过, 只增加其套接字计数. 如果端口已被另一个STCP进程使用或内存不足, 返回-1, 否则返回1.
+int porttable_register(porttable_t* porttable, unsigned int port, int conn);
+
+//这个函数注销连接conn对端口port的一次登记, 套接字计数减为0时删除条目.
+void porttable_unregister(porttable_t* porttable, unsigned int port, int conn);
+
+//这个函数删除连接conn登记的所有端口, 在STCP进程断开连接时调用.
+void porttable_remove_conn(porttable_t* porttable, int conn);
+
+//这个函数返回使用端口port的STCP进程的连接, 没有进程使用该端口时返回-1.
+int porttable_getconn(const porttable_t* porttable, unsigned int port);
+
+#endif
@@ -0,0 +1,136 @@
+//文件名: sip/relax.c
+//
+//描述: 这个文件实现距离矢量路由计算中的松弛内核, 参见relax.h.
+
+#include <pthread.h>
+#include "relax.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RELAX_X86
+#endif
+
+//标量实现, 同时处理向量实现剩下的尾部
+static void relax_scalar(unsigned int *best, int *next, unsigned int *any,
+                         const unsigned int *via, const unsigned int *fd,
+                         unsigned int link, int nbr, unsigned int n)
+{
+    for (unsigned int d = 0; d < n; d++) {
+        unsigned int c = link + via[d];
+        if (c < any[d]) {
+            any[d] = c;
+        }
+        if (via[d] < fd[d] && c < best[d]) {
+            best[d] = c;
+            next[d] = nbr;
+        }
+    }
+}
+
+static int always(void)
+{
+    return 1;
+}
+
+#ifdef RELAX_X86
+//SSE2没有32位整数的min和blendv, 用比较得到的掩码做与, 与非, 或来选择
+__attribute__((target("sse2")))
+static void relax_sse2(unsigned int *best, int *next, unsigned int *any,
+                       const unsigned int *via, const unsigned int *fd,
+                       unsigned int link, int nbr, unsigned int n)
+{
+    __m128i vlink = _mm_set1_epi32((int)link);
+    __m128i vnbr = _mm_set1_epi32(nbr);
+    unsigned int d = 0;
+    for (; d + 4 <= n; d += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(via + d));
+        __m128i f = _mm_loadu_si128((const __m128i *)(fd + d));
+        __m128i b = _mm_loadu_si128((const __m128i *)(best + d));
+        __m128i a = _mm_loadu_si128((const __m128i *)(any + d));
+        __m128i x = _mm_loadu_si128((const __m128i *)(next + d));
+        __m128i c = _mm_add_epi32(vlink, v);
+
+        __m128i lt = _mm_cmpgt_epi32(a, c);
+        a = _mm_or_si128(_mm_and_si128(lt, c), _mm_andnot_si128(lt, a));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi32(f, v), _mm_cmpgt_epi32(b, c));
+        b = _mm_or_si128(_mm_and_si128(ok, c), _mm_andnot_si128(ok, b));
+        x = _mm_or_si128(_mm_and_si128(ok, vnbr), _mm_andnot_si128(ok, x));
+
+        _mm_storeu_si128((__m128i *)(any + d), a);
+        _mm_storeu_si128((__m128i *)(best + d), b);
+        _mm_storeu_si128((__m128i *)(next + d), x);
+    }
+    relax_scalar(best + d, next + d, any + d, via + d, fd + d, link, nbr, n - d);
+}
+
+static int sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static void relax_avx2(unsigned int *best, int *next, unsigned int *any,
+                       const unsigned int *via, const unsigned int *fd,
+                       unsigned int link, int nbr, unsigned int n)
+{
+    __m256i vlink = _mm256_set1_epi32((int)link);
+    __m256i vnbr = _mm256_set1_epi32(nbr);
+    unsigned int d = 0;
+    for (; d + 8 <= n; d += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(via + d));
+        __m256i f = _mm256_loadu_si256((const __m256i *)(fd + d));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(best + d));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(any + d));
+        __m256i x = _mm256_loadu_si256((const __m256i *)(next + d));
+        __m256i c = _mm256_add_epi32(vlink, v);
+
+        a = _mm256_min_epi32(a, c);
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi32(f, v), _mm256_cmpgt_epi32(b, c));
+        b = _mm256_blendv_epi8(b, c, ok);
+        x = _mm256_blendv_epi8(x, vnbr, ok);
+
+        _mm256_storeu_si256((__m256i *)(any + d), a);
+        _mm256_storeu_si256((__m256i *)(best + d), b);
+        _mm256_storeu_si256((__m256i *)(next + d), x);
+    }
+    relax_scalar(best + d, next + d, any + d, via + d, fd + d, link, nbr, n - d);
+}
+
+static int avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+const relax_impl_t relax_impls[] = {
+#ifdef RELAX_X86
+    { "avx2", relax_avx2, avx2_supported },
+    { "sse2", relax_sse2, sse2_supported },
+#endif
+    { "scalar", relax_scalar, always },
+    { NULL, NULL, NULL },
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static relax_fn *relax_best;
+
+static void select_impl(void)
+{
+#ifdef RELAX_X86
+    __builtin_cpu_init();
+#endif
+    for (const relax_impl_t *impl = relax_impls; impl->name; impl++) {
+        if (impl->supported()) {
+            relax_best = impl->fn;
+            return;
+        }
+    }
+}
+
+void relax(unsigned int *best, int *next, unsigned int *any,
+           const unsigned int *via, const unsigned int *fd,
+           unsigned int link, int nbr, unsigned int n)
+{
+    pthread_once(&once, select_impl);
+    relax_best(best, next, any, via, fd, link, nbr, n);
+}
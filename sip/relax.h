@@ -0,0 +1,37 @@
+//文件名: sip/relax.h
+//
+//描述: 这个文件定义距离矢量路由计算中的松弛内核.
+//
+//SIP重新计算路由时对每个邻居V调用一次relax(), 一次处理所有目的节点(以节点下标为下标的连续数组,
+//参见nodeindex.h和dvtable.h). 对每个目的节点d:
+//  c = link + via[d]                       经过V到达d的代价
+//  any[d] = min(any[d], c)                 不考虑可行性的最小代价, 用来判断d是否还可达
+//  如果via[d] < fd[d]且c < best[d]:        V满足可行性条件并且更近
+//      best[d] = c, next[d] = nbr
+//所有代价都不超过INFINITE_COST, 所以c不会溢出, 可以当作有符号的32位整数比较.
+//
+//这是一个在连续数组上的加法, 比较和按掩码选择, 适合用SIMD实现. relax()在第一次调用时根据CPU选择
+//AVX2, SSE2或者标量实现, 三者的结果完全相同. relax_impls列出本机可用的全部实现, 供基准测试使用.
+
+#ifndef RELAX_H
+#define RELAX_H
+
+typedef void relax_fn(unsigned int* best, int* next, unsigned int* any,
+                      const unsigned int* via, const unsigned int* fd,
+                      unsigned int link, int nbr, unsigned int n);
+
+typedef struct relax_impl {
+    const char* name;
+    relax_fn* fn;
+    int (*supported)(void);         //当前CPU是否支持这个实现
+} relax_impl_t;
+
+//所有编译进来的实现, 以name为NULL的项结束. 越靠前的越快.
+extern const relax_impl_t relax_impls[];
+
+//这个函数对所有n个目的节点执行一次松弛, 使用当前CPU支持的最快的实现.
+void relax(unsigned int* best, int* next, unsigned int* any,
+           const unsigned int* via, const unsigned int* fd,
+           unsigned int link, int nbr, unsigned int n);
+
+#endif
@@ -2,98 +2,143 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <stdatomic.h>
 
 #include "common.h"
 #include "../common/constants.h"
+#include "../common/epoch.h"
 #include "../topology/topology.h"
 #include "routingtable.h"
 
-//makehash()是由路由表使用的哈希函数.
-//它将输入的目的节点ID作为哈希键,并返回针对这个目的节点ID的槽号作为哈希值.
-int makehash(int node)
+//这个函数分配一个长度为size的快照, 并复制from中的下一跳, 其余的目的节点没有路由.
+static routes_t *routes_alloc(unsigned int size, const routes_t *from)
 {
-    return abs(node - 185) % MAX_ROUTINGTABLE_SLOTS;
+    routes_t *routes = malloc(sizeof(*routes) + size * sizeof(routes->nextNodeID[0]));
+    if (routes == NULL) {
+        sys_panic("malloc");
+    }
+    routes->size = size;
+    unsigned int n = 0;
+    if (from != NULL) {
+        n = from->size < size ? from->size : size;
+        memcpy(routes->nextNodeID, from->nextNodeID, n * sizeof(routes->nextNodeID[0]));
+    }
+    for (unsigned int i = n; i < size; i++) {
+        routes->nextNodeID[i] = -1;
+    }
+    return routes;
 }
 
-//这个函数在路由表中查找指定的目标节点ID.
-//为找到一个目的节点的路由条目, 你应该首先使用哈希函数makehash()获得槽号,
-//然后遍历该槽中的链表以搜索路由条目.如果发现destNodeID, 就返回针对这个目的节点的下一跳节点ID, 否则返回-1.
-int routingtable_getnextnode(const routingtable_t *routingtable, int destNodeID)
+//这个函数返回到目的节点destNodeID的下一跳节点ID, 没有路由时返回-1.
+//快照在epoch_exit()之前不会被释放, 读到的下一跳总是某一个完整快照中的值.
+int routingtable_getnextnode(routingtable_t *routingtable, int destNodeID)
 {
-    const routingtable_entry_t *ent = routingtable->hash[makehash(destNodeID)];
-    while (ent) {
-        if (ent->destNodeID == destNodeID) {
-            return ent->nextNodeID;
-        } else {
-            ent = ent->next;
-        }
+    int idx = nodeindex_lookup(routingtable->index, destNodeID);
+    int next = -1;
+    epoch_enter();
+    const routes_t *routes = atomic_load_explicit(&routingtable->routes, memory_order_acquire);
+    if (idx != -1 && (unsigned int)idx < routes->size) {
+        next = routes->nextNodeID[idx];
+    }
+    epoch_exit();
+    if (next == -1) {
+        warn("dst %d cannot be routed", destNodeID);
     }
-    warn("dst %d cannot be routed", destNodeID);
-    return -1;
+    return next;
 }
 
-//这个函数使用给定的目的节点ID和下一跳节点ID更新路由表.
-//如果给定目的节点的路由条目已经存在, 就更新已存在的路由条目.如果不存在, 就添加一条.
-//路由表中的每个槽包含一个路由条目链表, 这是因为可能有冲突的哈希值存在(不同的哈希键, 即目的节点ID不同, 可能有相同的哈希值, 即槽号相同).
-//为在哈希表中添加一个路由条目:
-//首先使用哈希函数makehash()获得这个路由条目应被保存的槽号.
-//然后将路由条目附加到该槽的链表中.
-void routingtable_setnextnode(routingtable_t *routingtable, int destNodeID, int nextNodeID)
+int routingtable_getnext(routingtable_t *routingtable, int destIdx)
 {
-    routingtable_entry_t **pEntry = &routingtable->hash[makehash(destNodeID)];
-    while (*pEntry) {
-        if ((*pEntry)->destNodeID == destNodeID) {
-            if ((*pEntry)->nextNodeID == nextNodeID) {
-                warn("No effects insert: dest %d, next %d", destNodeID, nextNodeID);
-                // 目前遇到这种情况是因为：
-                // 路由规则 A -> C -> B 在 B 挂掉后，DV(A,B) 变成 INF，
-                // 而 DV(C,B) 由于延迟等原因，还是旧值。
-                // A 收到 C 的更新后，就会出现原地更新的情况，这种情况是不可接受的，所以就这么 pass 过去
-            }
-            else {
-                warn("overriding insert: dest %d, next %d", destNodeID, nextNodeID);
-                (*pEntry)->nextNodeID = nextNodeID;
-            }
-            return;
+    pthread_mutex_lock(&routingtable->lock);
+    const routes_t *routes = routingtable->draft;
+    if (routes == NULL) {
+        routes = atomic_load_explicit(&routingtable->routes, memory_order_relaxed);
+    }
+    int next = (unsigned int)destIdx < routes->size ? routes->nextNodeID[destIdx] : -1;
+    pthread_mutex_unlock(&routingtable->lock);
+    return next;
+}
+
+void routingtable_getall(routingtable_t *routingtable, int *next, unsigned int n)
+{
+    pthread_mutex_lock(&routingtable->lock);
+    const routes_t *routes = routingtable->draft;
+    if (routes == NULL) {
+        routes = atomic_load_explicit(&routingtable->routes, memory_order_relaxed);
+    }
+    unsigned int m = routes->size < n ? routes->size : n;
+    memcpy(next, routes->nextNodeID, m * sizeof(*next));
+    for (unsigned int i = m; i < n; i++) {
+        next[i] = -1;
+    }
+    pthread_mutex_unlock(&routingtable->lock);
+}
+
+//这个函数在草稿中修改下一跳. 第一次修改时复制当前快照作为草稿, 目的节点超出数组长度时把草稿增长到两倍.
+void routingtable_setnext(routingtable_t *routingtable, int destIdx, int nextNodeID)
+{
+    Assert(destIdx >= 0, "node index %d out of range", destIdx);
+    pthread_mutex_lock(&routingtable->lock);
+    routes_t *draft = routingtable->draft;
+    if (draft == NULL || (unsigned int)destIdx >= draft->size) {
+        const routes_t *from = draft ? draft : atomic_load_explicit(&routingtable->routes, memory_order_relaxed);
+        unsigned int size = from->size ? from->size : 16;
+        while (size <= (unsigned int)destIdx) {
+            size *= 2;
         }
-        pEntry = &(*pEntry)->next;
+        routingtable->draft = routes_alloc(size, from);
+        free(draft);
+        draft = routingtable->draft;
+    }
+    draft->nextNodeID[destIdx] = nextNodeID;
+    pthread_mutex_unlock(&routingtable->lock);
+}
+
+//这个函数发布草稿. 旧快照交给epoch_retire()释放.
+void routingtable_commit(routingtable_t *routingtable)
+{
+    pthread_mutex_lock(&routingtable->lock);
+    routes_t *draft = routingtable->draft;
+    if (draft == NULL) {
+        pthread_mutex_unlock(&routingtable->lock);
+        return;
     }
-    log("create new routing entry: dest %d, next %d",destNodeID, nextNodeID);
-    *pEntry = calloc(1, sizeof(**pEntry));
-    (*pEntry)->destNodeID = destNodeID;
-    (*pEntry)->nextNodeID = nextNodeID;
+    routingtable->draft = NULL;
+    routes_t *old = atomic_exchange_explicit(&routingtable->routes, draft, memory_order_acq_rel);
+    pthread_mutex_unlock(&routingtable->lock);
+    epoch_retire(old, free);
+    epoch_poll();
 }
 
-//这个函数动态创建路由表.表中的所有条目都被初始化为NULL指针.
-//然后对有直接链路的邻居,使用邻居本身作为下一跳节点创建路由条目,并插入到路由表中.
+//这个函数动态创建路由表.
+//对有直接链路的邻居,使用邻居本身作为下一跳节点创建路由条目.
 //该函数返回动态创建的路由表结构.
-routingtable_t *routingtable_create()
+routingtable_t *routingtable_create(nodeindex_t *index)
 {
     routingtable_t *tab = calloc(1, sizeof(*tab));
+    if (tab == NULL) {
+        sys_panic("malloc");
+    }
+    pthread_mutex_init(&tab->lock, NULL);
+    tab->index = index;
+    atomic_init(&tab->routes, routes_alloc(0, NULL));
     int *nbrs = topology_getNbrArray();
     int nr_nbrs = topology_getNbrNum();
     for (int i = 0; i < nr_nbrs; i++) {
-        routingtable_setnextnode(tab, nbrs[i], nbrs[i]);
+        routingtable_setnext(tab, nodeindex_intern(index, nbrs[i]), nbrs[i]);
     }
     free(nbrs);
+    routingtable_commit(tab);
     return tab;
 }
 
 //这个函数删除路由表.
-//所有为路由表动态分配的数据结构将被释放.
 //作为参数传入的路由表指针会被设置成 NULL
 void routingtable_destroy(routingtable_t **routingtable)
 {
-    routingtable_entry_t **tab = (*routingtable)->hash;
-    for (int i = 0; i < MAX_ROUTINGTABLE_SLOTS; i++) {
-        routingtable_entry_t *ent = tab[i];
-        while (ent) {
-            typeof(ent) temp = ent;
-            ent = ent->next;
-            free(temp);
-        }
-    }
+    free((*routingtable)->draft);
+    free(atomic_load(&(*routingtable)->routes));
+    pthread_mutex_destroy(&(*routingtable)->lock);
     free(*routingtable);
     *routingtable = NULL;
 }
@@ -101,11 +146,12 @@ void routingtable_destroy(routingtable_t **routingtable)
 //这个函数打印路由表的内容
 void routingtable_print(routingtable_t *tab)
 {
-    for (int i = 0; i < MAX_ROUTINGTABLE_SLOTS; i++) {
-        routingtable_entry_t *ent = tab->hash[i];
-        while (ent) {
-            printf("to %d: next hop %d\n", ent->destNodeID, ent->nextNodeID);
-            ent = ent->next;
+    epoch_enter();
+    const routes_t *routes = atomic_load(&tab->routes);
+    for (unsigned int i = 0; i < routes->size; i++) {
+        if (routes->nextNodeID[i] != -1) {
+            printf("to %d: next hop %d\n", nodeindex_id(tab->index, i), routes->nextNodeID[i]);
         }
     }
+    epoch_exit();
 }
@@ -1,51 +1,57 @@
 //文件名: sip/routingtable.h
 //
-//描述: 这个文件定义用于路由表的数据结构和函数. 
-//一个路由表是一个包含MAX_ROUTINGTABLE_SLOTS个槽条目的哈希表.  
+//描述: 这个文件定义用于路由表的数据结构和函数.
+//路由表是一个以目的节点下标(参见nodeindex.h)为下标的平坦数组, 转发一个报文只需要查一次下标, 读一个数组元素.
+//
+//转发路径上的读者不加锁: 路由表的内容是一个不可修改的快照(routes_t), 通过原子指针发布.
+//写者(路由协议)在互斥量的保护下修改一份草稿, 一轮路由计算结束之后调用routingtable_commit()用原子操作
+//替换指针, 所以读者看到的总是某一轮计算的完整结果, 一轮计算也只复制一次数组. 旧快照通过epoch_retire()
+//在所有读者都不再使用它之后才被释放(参见common/epoch.h). 所以路由更新不会阻塞报文转发.
 //
 //创建日期: 2015年
 
 #ifndef ROUTINGTABLE_H
 #define ROUTINGTABLE_H
 
-//routingtable_entry_t是包含在路由表中的路由条目.
-typedef struct routingtable_entry {
-    int destNodeID;		//目标节点ID
-    int nextNodeID;		//报文应该转发给的下一跳节点ID
-    struct routingtable_entry* next;	//指向在同一个路由表槽中的下一个routingtable_entry_t
-} routingtable_entry_t;
+#include <pthread.h>
+#include "constants.h"
+#include "nodeindex.h"
+
+//路由表的一个快照. nextNodeID[i]是到下标为i的目的节点的下一跳节点ID, -1表示没有路由.
+typedef struct routes {
+    unsigned int size;              //nextNodeID数组的长度
+    int nextNodeID[];
+} routes_t;
 
-//一个路由表是一个包含MAX_ROUTINGTABLE_SLOTS个槽的哈希表. 每个槽是一个路由条目的链表.
 typedef struct routingtable {
-	routingtable_entry_t* hash[MAX_ROUTINGTABLE_SLOTS];
+    pthread_mutex_t lock;           //串行化写者
+    routes_t* _Atomic routes;       //当前的快照
+    routes_t* draft;                //还没有发布的修改, 为NULL表示没有修改
+    nodeindex_t* index;             //目的节点ID到下标的映射
 } routingtable_t;
 
-//makehash()是由路由表使用的哈希函数.
-//它将输入的目的节点ID作为哈希键,并返回针对这个目的节点ID的槽号作为哈希值.
-int makehash(int node); 
+//这个函数动态创建路由表. 对有直接链路的邻居, 使用邻居本身作为下一跳节点, 其他目的节点没有路由.
+//邻居在index中分配下标. 该函数返回动态创建的路由表结构.
+routingtable_t *routingtable_create(nodeindex_t* index);
 
-//这个函数动态创建路由表.表中的所有条目都被初始化为NULL指针.
-//然后对有直接链路的邻居,使用邻居本身作为下一跳节点创建路由条目,并插入到路由表中.
-//该函数返回动态创建的路由表结构.
-routingtable_t *routingtable_create();
-
-//这个函数删除路由表.
-//所有为路由表动态分配的数据结构将被释放.
+//这个函数删除路由表. 调用者保证没有其他线程还在使用它.
 //作为参数传入的路由表指针会被设置成 NULL
 void routingtable_destroy(routingtable_t **routingtable);
 
-//这个函数在路由表中查找指定的目标节点ID.
-//为找到一个目的节点的路由条目, 你应该首先使用哈希函数makehash()获得槽号,
-//然后遍历该槽中的链表以搜索路由条目.如果发现destNodeID, 就返回针对这个目的节点的下一跳节点ID, 否则返回-1.
-int routingtable_getnextnode(const routingtable_t* routingtable, int destNodeID);
-
-//这个函数使用给定的目的节点ID和下一跳节点ID更新路由表.
-//如果给定目的节点的路由条目已经存在, 就更新已存在的路由条目.如果不存在, 就添加一条.
-//路由表中的每个槽包含一个路由条目链表, 这是因为可能有冲突的哈希值存在(不同的哈希键, 即目的节点ID不同, 可能有相同的哈希值, 即槽号相同).
-//为在哈希表中添加一个路由条目:
-//首先使用哈希函数makehash()获得这个路由条目应被保存的槽号.
-//然后将路由条目附加到该槽的链表中.
-void routingtable_setnextnode(routingtable_t* routingtable, int destNodeID, int nextNodeID);
+//这个函数返回到目的节点destNodeID的下一跳节点ID, 没有路由时返回-1. 不加锁, 可以与写者并发调用.
+int routingtable_getnextnode(routingtable_t* routingtable, int destNodeID);
+
+//这个函数返回写者看到的到下标为destIdx的目的节点的下一跳, 包括还没有发布的修改.
+int routingtable_getnext(routingtable_t* routingtable, int destIdx);
+
+//这个函数把写者看到的到下标为0到n - 1的目的节点的下一跳复制到next中.
+void routingtable_getall(routingtable_t* routingtable, int* next, unsigned int n);
+
+//这个函数在草稿中把到下标为destIdx的目的节点的下一跳设置为nextNodeID.
+void routingtable_setnext(routingtable_t* routingtable, int destIdx, int nextNodeID);
+
+//这个函数发布草稿中的修改, 没有修改时什么也不做.
+void routingtable_commit(routingtable_t* routingtable);
 
 //这个函数打印路由表的内容
 void routingtable_print(routingtable_t* routingtable);
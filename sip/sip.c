@@ -11,8 +11,13 @@
 #include "sip.h"
 #include "../topology/topology.h"
 #include "nbrcosttable.h"
+#include "nodeindex.h"
 #include "dvtable.h"
 #include "routingtable.h"
+#include "relax.h"
+#include "porttable.h"
+#include "shmring.h"
+#include "epoch.h"
 #include <sys/un.h>
 #include <signal.h>
 #include <pthread.h>
@@ -25,25 +30,49 @@
 // 就将邻居的距离矢量设置成 INFINITE_COST, 这样当其他邻居能提供次优路径时，可以被更新。
 #define ALIVE_THRESHOLD 10
 
+//与一个邻居之间的路由更新状态
+typedef struct nbr_state {
+    int idx;                        //邻居的节点下标
+    dv_t dv;                        //邻居通告的距离矢量, 由收到的增量更新逐步维护
+    unsigned int rcv_boot;          //邻居的启动标识, 为0表示还没有收到过它的报文
+    unsigned int rcv_seq;           //从邻居收到的最后一个报文的序号
+    int rcv_synced;                 //收到过邻居的快照, 并且之后的增量更新没有丢失
+    dv_t adv;                       //最近一次通告给邻居的距离矢量(经过毒性逆转), 增量相对于它计算
+    unsigned int snd_seq;           //发给邻居的最后一个报文的序号
+    int snd_snapshot;               //下一次更新要给邻居发送完整快照
+    int snd_request;                //下一次更新要请求邻居发送完整快照
+    int query_reply;                //本节点发出的查询还在等待这个邻居的快照应答
+} nbr_state_t;
+
 /**************************************************************/
 //声明全局变量
 /**************************************************************/
 int son_conn; 			//到重叠网络的连接
-int stcp_conn;			//到STCP的连接
 int nr_nbrs;  // 邻居结点数（一开始为了 KISS 原则，这些数据我都是用 topo 的 API 临时获取的，然而这个代码的 overhead 一点也不 KISS）
 nbr_cost_entry_t* nct;			//邻居代价表
 dv_t* dv;				//距离矢量表
-pthread_mutex_t* dv_mutex;		//距离矢量表互斥量
-routingtable_t* routingtable;		//路由表
-pthread_mutex_t* routingtable_mutex;	//路由表互斥量
+nbr_state_t* nbrs;			//与每个邻居之间的路由更新状态, 与nct按下标对应
+pthread_mutex_t* dv_mutex;		//距离矢量表互斥量, 同时保护nct和nbrs
+pthread_cond_t dv_cond;			//有路由更新需要立即发送时唤醒路由更新线程
+int update_pending;			//距离矢量发生了变化, 或者有邻居需要快照, 由dv_mutex保护
+unsigned int boot_id;			//本次启动的标识, 参见pkt.h中的路由更新报文定义
+dv_t feasible_dist;			//到每个节点的可行距离, 由dv_mutex保护. 参见recompute_all()
+int nr_query_replies;			//还没有应答查询的邻居数, 为0时没有进行中的查询, 由dv_mutex保护
+nodeindex_t* nodeidx;			//节点ID到稠密下标的映射, 距离矢量, 可行距离和路由表都以下标为下标
+routingtable_t* routingtable;		//路由表, 读者不加锁, 写者由它自己的互斥量串行化
+porttable_t* porttable;			//端口表, 记录每个本地STCP端口由哪个STCP进程使用
+// 端口表读写锁: 查找端口时持有读锁, 登记和注销端口时持有写锁.
+// 把段交给STCP进程时不持有锁, 而是处在epoch读临界区中, STCP进程断开时连接和共享内存通道由epoch_retire()延迟释放.
+pthread_rwlock_t porttable_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /**************************************************************/
 //实现SIP的函数
 /**************************************************************/
 
 //SIP进程使用这个函数连接到本地SON进程的端口SON_PORT
+//参数transport决定之后与SON进程之间的报文通过套接字(SHMCHAN_SOCKET)还是共享内存环(SHMCHAN_SHM)传递
 //成功时返回连接描述符, 否则返回-1
-int connectToSON()
+int connectToSON(int transport)
 {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd == -1) {
@@ -61,16 +90,168 @@ int connectToSON()
         return -1;
     }
 
-    log("unix domain established");
+    // 环中的一条消息就是一个 sendpkt_arg_t
+    shmchan_t *chan;
+    if (shmchan_offer(fd, transport, sizeof(sendpkt_arg_t), SON_SIP_RING_SLOTS, &chan) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    log("unix domain established%s", chan ? " with shared memory" : "");
 
     return fd;
 }
 
+//这个函数唤醒路由更新线程, 调用者持有dv_mutex.
+static void request_update(void)
+{
+    update_pending = 1;
+    pthread_cond_signal(&dv_cond);
+}
+
+//这个函数重置不可达节点的可行距离, 调用者持有dv_mutex. 可行距离只会变小, 一条真实存在但比原来更长的路由
+//在邻居看来总是不可行的. 查询得到所有邻居的应答之后, 或者保活周期到来时, 才可以接受更长的路由.
+//重置之后进行中的查询也就没有意义了.
+static void reset_feasible(void)
+{
+    for (unsigned int i = 0; i < feasible_dist.size; i++) {
+        if (dvtable_getcost(dv, i) == INFINITE_COST) {
+            feasible_dist.cost[i] = INFINITE_COST;
+        }
+    }
+    for (int i = 0; i < nr_nbrs; i++) {
+        nbrs[i].query_reply = 0;
+    }
+    nr_query_replies = 0;
+}
+
+//这个函数向所有存活的邻居发出查询, 调用者持有dv_mutex. 有目的节点失去了可行的下一跳, 但还有邻居通告了更长的路由时调用.
+//本节点此时把这些目的节点通告为不可达, 查询随同一次更新发出, 就是请求每个邻居发送快照.
+//经过本节点的邻居在处理这次更新之后才会应答, 所以应答中不会再有指回本节点的旧路由.
+//已经有查询在进行时什么也不做.
+static void start_query(void)
+{
+    if (nr_query_replies > 0) {
+        return;
+    }
+    for (int i = 0; i < nr_nbrs; i++) {
+        if (nct[i].cost < INFINITE_COST) {
+            nbrs[i].snd_request = 1;
+            nbrs[i].query_reply = 1;
+            nr_query_replies++;
+        }
+    }
+    if (nr_query_replies > 0) {
+        log("querying %d neighbors for longer routes", nr_query_replies);
+        request_update();
+    }
+}
+
+//这个函数记录邻居ns对查询的应答, 调用者持有dv_mutex. 收到它的快照或者判定它失效都算作应答.
+//所有邻居都应答之后重置可行距离, 之后的recompute_all()就可以从应答中选择更长的路由.
+static void answer_query(nbr_state_t *ns)
+{
+    if (!ns->query_reply) {
+        return;
+    }
+    ns->query_reply = 0;
+    if (--nr_query_replies == 0) {
+        reset_feasible();
+    }
+}
+
+//这个函数按照 D(X,Y) = min{ cost(X,V) + D(V,Y) } 重新计算到所有出现过的目的节点的代价和下一跳, 然后发布路由表.
+//D(V,Y)取自邻居V最近一次通告的距离矢量, V到它自己的代价为0(参见reset_nbr_dv()).
+//可行性条件: 只有D(V,Y)小于可行距离的邻居才能作为下一跳. 可行距离是到Y曾经有过的最小代价,
+//比它还远的邻居可能正是经过本节点到达Y的, 用它会形成环路, 毒性逆转只能避免两个节点之间的环路.
+//没有可行的邻居时Y暂时不可达: 所有邻居都通告Y不可达时立即重置可行距离; 还有邻居通告了更长的路由时,
+//发出查询(参见start_query()), 所有邻居应答之后再重置. 保活周期到来时无论如何都会重置.
+//
+//计算按邻居进行: 每个邻居用relax()对所有目的节点的连续代价数组松弛一遍, 这是可以向量化的部分.
+//之后逐个目的节点比较结果: 代价相同时保留当前的下一跳, 避免路由来回切换.
+//有代价发生变化时唤醒路由更新线程发出触发更新. 调用者持有dv_mutex, 它也保护这里的临时数组.
+static void recompute_all(void)
+{
+    static unsigned int *best, *any;
+    static int *next, *cur;
+    static unsigned int cap;
+
+    unsigned int n = nodeindex_size(nodeidx);
+    if (cap < n) {
+        cap = n * 2;
+        best = realloc(best, cap * sizeof(*best));
+        any = realloc(any, cap * sizeof(*any));
+        next = realloc(next, cap * sizeof(*next));
+        cur = realloc(cur, cap * sizeof(*cur));
+        if (best == NULL || any == NULL || next == NULL || cur == NULL) {
+            sys_panic("realloc");
+        }
+    }
+    dvtable_reserve(dv, n);
+    dvtable_reserve(&feasible_dist, n);
+    routingtable_getall(routingtable, cur, n);
+    for (unsigned int d = 0; d < n; d++) {
+        best[d] = any[d] = INFINITE_COST;
+        next[d] = -1;
+    }
+
+    for (int i = 0; i < nr_nbrs; i++) {
+        if (nct[i].cost >= INFINITE_COST) {
+            continue;
+        }
+        dvtable_reserve(&nbrs[i].dv, n);
+        relax(best, next, any, nbrs[i].dv.cost, feasible_dist.cost, nct[i].cost, nct[i].nodeID, n);
+    }
+
+    int changed = 0;
+    int stuck = 0;
+    for (unsigned int d = 0; d < n; d++) {
+        if (next[d] != cur[d] && cur[d] != -1 && best[d] < INFINITE_COST) {
+            // 当前的下一跳如果同样近并且可行, 就保留它
+            for (int i = 0; i < nr_nbrs; i++) {
+                if ((int)nct[i].nodeID == cur[d] && nbrs[i].dv.cost[d] < feasible_dist.cost[d] &&
+                        nct[i].cost + nbrs[i].dv.cost[d] == best[d]) {
+                    next[d] = cur[d];
+                }
+            }
+        }
+        if (best[d] < feasible_dist.cost[d]) {
+            feasible_dist.cost[d] = best[d];
+        } else if (any[d] >= INFINITE_COST) {
+            feasible_dist.cost[d] = INFINITE_COST;
+        } else if (next[d] == -1) {
+            stuck = 1;
+        }
+        if (next[d] != cur[d]) {
+            log("route to %d: next hop %d => %d", nodeindex_id(nodeidx, d), cur[d], next[d]);
+            routingtable_setnext(routingtable, d, next[d]);
+        }
+        if (dv->cost[d] != best[d]) {
+            dv->cost[d] = best[d];
+            changed = 1;
+        }
+    }
+    routingtable_commit(routingtable);
+    if (changed) {
+        request_update();
+    }
+    if (stuck) {
+        start_query();
+    }
+}
+
+//这个函数清空邻居通告的距离矢量, 只保留邻居到它自己的代价0, 这样relax()不需要特殊处理邻居本身. 调用者持有dv_mutex.
+static void reset_nbr_dv(nbr_state_t *ns)
+{
+    dvtable_reset(&ns->dv, ns->dv.nodeID);
+    dvtable_setcost(&ns->dv, ns->idx, 0);
+}
+
 // 这个线程每隔 ALIVE_THRESHOLD 时间就检查当前的邻居表有没有
-// 更新过距离矢量信息，如果有，就清空 flag，为下次检查做准备。
-// 如果没有，即上次清空的 flag 没有因收到距离矢量而设置，则将邻
-// 居的距离矢量设置成 INFINITE_COST，既表明链路断开，也为能够
-// 更新成其他节点的路由提供条件。
+// 收到过路由更新报文，如果有，就清空 flag，为下次检查做准备。
+// 如果没有，即上次清空的 flag 没有因收到路由更新而设置，则把到这个
+// 邻居的链路代价设置成 INFINITE_COST 并丢弃它通告的距离矢量，然后
+// 重新计算所有路由, 经过它的路由改走其他邻居或者变为不可达, 并触发路由更新。
 static void *alive_check(void *arg)
 {
     while (nr_nbrs) {
@@ -80,64 +261,178 @@ static void *alive_check(void *arg)
         // 要上锁，不然中间这不知道什么时候就会被打断……
         log("checker awake");
         pthread_mutex_lock(dv_mutex);
-        pthread_mutex_lock(routingtable_mutex);
         for (int i = 0; i < nr_nbrs; i++) {
-            if (!nct[i].is_updated) {
+            if (!nct[i].is_updated && nct[i].cost != INFINITE_COST) {
                 warn("%d is dead", nct[i].nodeID);
                 nct[i].cost = INFINITE_COST;
-                dvtable_setcost(dv, nct[i].nodeID, INFINITE_COST);
-                // 所有以这个挂掉的邻居为 next hop 的结点的 dv 都要设置成 INFINITE_COST
-                for (int j = 0; j < MAX_NODE_NUM; j++) {
-                    if (dv->dvEntry[j].nodeID != -1 &&
-                            routingtable_getnextnode(routingtable, dv->dvEntry[j].nodeID) == nct[i].nodeID) {
-                        dv->dvEntry[j].cost = INFINITE_COST;
-                    }
-                }
+                reset_nbr_dv(&nbrs[i]);
+                answer_query(&nbrs[i]);
+                // 它恢复之后双方都要从快照重新同步
+                nbrs[i].rcv_synced = 0;
+                nbrs[i].snd_snapshot = 1;
+                nbrs[i].snd_request = 1;
             }
             nct[i].is_updated = 0;
         }
-        pthread_mutex_unlock(routingtable_mutex);
+        recompute_all();
         pthread_mutex_unlock(dv_mutex);
     }
 
     return NULL;
 }
 
-//这个线程每隔ROUTEUPDATE_INTERVAL时间发送路由更新报文.
-//路由更新报文包含这个节点的距离矢量.
-//广播是通过设置SIP报文头中的dest_nodeID为BROADCAST_NODEID,并通过son_sendpkt()发送报文来完成的.
+//一次路由更新中发给一个邻居的内容, 由路由更新线程在dv_mutex之下准备, 释放锁之后发出
+typedef struct update_out {
+    unsigned int seq;               //第一个报文的序号
+    unsigned short flags;           //RU_SNAPSHOT和RU_REQUEST, 只出现在第一个报文中
+    unsigned int nr_entries;
+    unsigned int cap;               //entries数组的容量
+    route_entry_t* entries;
+} update_out_t;
+
+//这个函数准备发给第i个邻居的路由更新, 调用者持有dv_mutex. 返回要发送的报文数, 没有内容可发时返回0.
+//毒性逆转: 下一跳就是这个邻居的目的节点以INFINITE_COST通告给它, 这样它不会再把到这些节点的路由指回本节点,
+//链路失效时两个节点之间不会出现计数到无穷. 通常只携带与上次通告不同的代价; 需要快照时携带全部有限的代价.
+//keepalive非0时即使没有内容也发送一个空报文.
+static int prepare_update(int i, update_out_t *out, int keepalive)
+{
+    nbr_state_t *ns = &nbrs[i];
+    out->flags = 0;
+    out->nr_entries = 0;
+    if (ns->snd_snapshot) {
+        out->flags |= RU_SNAPSHOT;
+        ns->snd_snapshot = 0;
+        dvtable_reset(&ns->adv, dv->nodeID);
+    }
+    if (ns->snd_request) {
+        out->flags |= RU_REQUEST;
+        ns->snd_request = 0;
+    }
+
+    unsigned int n = nodeindex_size(nodeidx);
+    if (out->cap < n) {
+        out->entries = realloc(out->entries, n * sizeof(*out->entries));
+        if (out->entries == NULL) {
+            sys_panic("realloc");
+        }
+        out->cap = n;
+    }
+    for (unsigned int dest = 0; dest < n; dest++) {
+        unsigned int cost = dvtable_getcost(dv, dest);
+        if (routingtable_getnext(routingtable, dest) == (int)nct[i].nodeID) {
+            cost = INFINITE_COST;
+        }
+        // adv中还没有的节点对邻居来说代价就是INFINITE_COST
+        if (cost != dvtable_getcost(&ns->adv, dest)) {
+            out->entries[out->nr_entries].nodeID = nodeindex_id(nodeidx, dest);
+            out->entries[out->nr_entries].cost = cost;
+            out->nr_entries++;
+            dvtable_setcost(&ns->adv, dest, cost);
+        }
+    }
+
+    if (out->nr_entries == 0 && out->flags == 0 && !keepalive) {
+        return 0;
+    }
+    int nr_pkts = out->nr_entries == 0 ? 1 : (out->nr_entries + RU_MAX_ENTRIES - 1) / RU_MAX_ENTRIES;
+    out->seq = ns->snd_seq + 1;
+    ns->snd_seq += nr_pkts;
+    return nr_pkts;
+}
+
+//这个函数把准备好的路由更新分成nr_pkts个报文发给邻居nbr_id. 成功时返回1, 与SON进程的连接断开时返回-1.
+static int send_update(int nbr_id, const update_out_t *out, int nr_pkts, sip_pkt_t *pkt)
+{
+    route_update_hdr_t *hdr = (void *)pkt->data;
+    route_entry_t *ent = (void *)(hdr + 1);
+    unsigned int done = 0;
+    for (int k = 0; k < nr_pkts; k++) {
+        unsigned int n = out->nr_entries - done < RU_MAX_ENTRIES ? out->nr_entries - done : RU_MAX_ENTRIES;
+        hdr->boot_id = boot_id;
+        hdr->seq = out->seq + k;
+        hdr->flags = (k == 0 ? out->flags : 0) | (k < nr_pkts - 1 ? RU_MORE : 0);
+        hdr->nr_entries = n;
+        memcpy(ent, out->entries + done, n * sizeof(*ent));
+        pkt->header.length = sizeof(*hdr) + n * sizeof(*ent);
+        done += n;
+        if (son_sendpkt(nbr_id, pkt, son_conn) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+//这个线程发送路由更新报文. 每个邻居收到的是经过毒性逆转的增量更新, 所以逐个单播, 格式参见pkt.h.
+//距离矢量发生变化或者有邻居需要快照时立即触发更新, 但相邻两次更新之间至少间隔ROUTEUPDATE_MIN_GAP_MS毫秒加上随机抖动,
+//间隔之内的变化合并在一次更新中. 没有变化时, 每隔大约ROUTEUPDATE_INTERVAL秒给每个邻居发送一个空的更新作为保活,
+//邻居靠它判断本节点是否存活. 抖动使相邻节点的更新错开, 不会同步成一波一波的突发.
 static void *routeupdate_daemon(void *arg)
 {
+    int this_id = topology_getMyNodeID();
+    unsigned int seed = clock_ms() ^ this_id;
+    update_out_t *outs = calloc(nr_nbrs > 0 ? nr_nbrs : 1, sizeof(*outs));
+    int *nr_pkts = calloc(nr_nbrs > 0 ? nr_nbrs : 1, sizeof(*nr_pkts));
     sip_pkt_t pkt;
-    memset(&pkt, 0, sizeof(pkt));
+    if (outs == NULL || nr_pkts == NULL) {
+        sys_panic("calloc");
+    }
 
     // 提前初始化更新报文的静态信息
+    memset(&pkt, 0, sizeof(pkt));
     pkt.header.type = ROUTE_UPDATE;
-    // TODO 这里为了简化使用了数组，所以可以直接知道大小。如果改动 dvEntry 为动态数组，则这里要进行相应的改动。
-    pkt.header.length = sizeof(dv->dvEntry);
-    pkt.header.src_nodeID = topology_getMyNodeID();
+    pkt.header.src_nodeID = this_id;
     pkt.header.dest_nodeID = 0;
 
-    while (1) {
-        struct timeval tv;
-        tv.tv_sec = ROUTEUPDATE_INTERVAL;
-        tv.tv_usec = 0;
-        select(0, NULL, NULL, NULL, &tv);
-        pthread_mutex_lock(dv_mutex);
-        memcpy(pkt.data, dv->dvEntry, pkt.header.length);
+    unsigned int keepalive = ROUTEUPDATE_INTERVAL * 1000;
+    // 启动后立即发送第一次更新, 即给每个邻居的快照
+    unsigned int last_sent = clock_ms() - keepalive;
+    pthread_mutex_lock(dv_mutex);
+    for (;;) {
+        unsigned int gap = ROUTEUPDATE_MIN_GAP_MS + rand_r(&seed) % (ROUTEUPDATE_JITTER_MS + 1);
+        unsigned int period = keepalive - rand_r(&seed) % (keepalive / 4 + 1);
+        for (;;) {
+            unsigned int since = clock_ms() - last_sent;
+            unsigned int wait = update_pending ? gap : period;
+            if (since >= wait) {
+                break;
+            }
+            struct timespec deadline = deadline_ms(wait - since);
+            pthread_cond_timedwait(&dv_cond, dv_mutex, &deadline);
+        }
+        int is_keepalive = !update_pending;
+        if (is_keepalive) {
+            reset_feasible();
+            recompute_all();
+        }
+        update_pending = 0;
+        for (int i = 0; i < nr_nbrs; i++) {
+            nr_pkts[i] = prepare_update(i, &outs[i], is_keepalive);
+        }
         pthread_mutex_unlock(dv_mutex);
-        log("send update pakcet...");
-        if (son_sendpkt(BROADCAST_NODEID, &pkt, son_conn) < 0) {
-            break;
+
+        log("send %s update packet...", is_keepalive ? "keepalive" : "triggered");
+        for (int i = 0; i < nr_nbrs; i++) {
+            if (nr_pkts[i] > 0 && send_update(nct[i].nodeID, &outs[i], nr_pkts[i], &pkt) < 0) {
+                warn("daemon exits due to sip-son connection breaking");
+                for (int j = 0; j < nr_nbrs; j++) {
+                    free(outs[j].entries);
+                }
+                free(outs);
+                free(nr_pkts);
+                return NULL;
+            }
         }
+        last_sent = clock_ms();
+        // 断开的STCP进程的连接等待epoch推进才关闭, 没有段要转发时就靠这里推进
+        epoch_poll();
+        pthread_mutex_lock(dv_mutex);
     }
-
-    warn("daemon exits due to sip-son connection breaking");
-    return NULL;
 }
 
 // 处理距离向量更新。
 // 注意该函数一次只针对一个邻居（和它的小伙伴们）
+// 报文中的增量合并进这个邻居通告的距离矢量, 然后重新计算所有的路由: 代价可能变小, 也可能因为当前下一跳的
+// 距离变大或者变为不可达而改走其他邻居. 代价有变化时触发路由更新.
 void update_dv(sip_pkt_t *arg)
 {
     // 更新报文只从邻居处获得，所以可以从报文头里获取需要的信息。
@@ -145,39 +440,114 @@ void update_dv(sip_pkt_t *arg)
     sip_pkt_t *pkt = arg;
     int nbr_id = pkt->header.src_nodeID;
     int this_id = topology_getMyNodeID();
-    int nbr_cost = nbrcosttable_getcost(nct, nbr_id);
-    dv_entry_t *nbr_dv = (void *)pkt->data;
+    const route_update_hdr_t *hdr = (void *)pkt->data;
+    const route_entry_t *ent = (void *)(hdr + 1);
 
     Assert(nbr_id != this_id, "Oops, send to self!?");
+    if (pkt->header.length < sizeof(*hdr) ||
+            pkt->header.length < sizeof(*hdr) + hdr->nr_entries * sizeof(*ent)) {
+        warn("malformed route update from %d dropped", nbr_id);
+        return;
+    }
 
     pthread_mutex_lock(dv_mutex);
-    // dv(this, node) = min { nbr_cost + dv(nbr, node) }
-    for (int i = 0; i < MAX_NODE_NUM; i++) {
-        if (nbr_dv->nodeID != -1 && nbr_dv->nodeID != this_id) {  // A valid element
-            unsigned old_dst_cost = dvtable_getcost(dv, nbr_dv->nodeID);
-            log("%d -> %d -> %d: %d(old), %d(new)",
-                this_id, nbr_id, nbr_dv->nodeID, old_dst_cost, nbr_cost + nbr_dv->cost);
-            if (old_dst_cost > nbr_cost + nbr_dv->cost) {
-                log("update dv (%d => %d) and routing table (%d => %d)", old_dst_cost, nbr_cost + nbr_dv->cost,
-                    routingtable_getnextnode(routingtable, nbr_dv->nodeID), nbr_id);
-                pthread_mutex_lock(routingtable_mutex);
-                routingtable_setnextnode(routingtable, nbr_dv->nodeID, nbr_id);
-                pthread_mutex_unlock(routingtable_mutex);
-                dvtable_setcost(dv, nbr_dv->nodeID, nbr_cost + nbr_dv->cost);
-            }
-            else if (nbr_id == routingtable_getnextnode(routingtable, nbr_dv->nodeID)) {
-                // 我们暂时无条件接受当前下一跳的距离矢量更新，以期待结点失效导致的代价提升会反馈到更远的地方，
-                // 并从更宏观的场景里获得最小的距离矢量更新。
-                log("update next hop's dv from %d to %d regardless", old_dst_cost, nbr_cost + nbr_dv->cost);
-                dvtable_setcost(dv, nbr_dv->nodeID,
-                                (nbr_cost + nbr_dv->cost) > INFINITE_COST ? INFINITE_COST : nbr_cost + nbr_dv->cost);
-            }
+    int i;
+    for (i = 0; i < nr_nbrs && (int)nct[i].nodeID != nbr_id; i++)
+        ;
+    if (i == nr_nbrs) {
+        pthread_mutex_unlock(dv_mutex);
+        warn("route update from non-neighbor %d ignored", nbr_id);
+        return;
+    }
+    nbr_state_t *ns = &nbrs[i];
+
+    nct[i].is_updated = 1;
+    if (nct[i].cost == INFINITE_COST) {
+        // 被判定失效的邻居又发来了更新, 恢复直接链路代价
+        nct[i].cost = topology_getCost(this_id, nbr_id);
+        log("%d is back, link cost %u", nbr_id, nct[i].cost);
+    }
+
+    if (hdr->boot_id != ns->rcv_boot) {
+        // 邻居(重新)启动了, 它不知道本节点之前通告过什么
+        log("%d booted (id %u)", nbr_id, hdr->boot_id);
+        ns->rcv_boot = hdr->boot_id;
+        ns->rcv_synced = 0;
+        ns->snd_snapshot = 1;
+        request_update();
+    }
+    if (hdr->flags & RU_REQUEST) {
+        ns->snd_snapshot = 1;
+        request_update();
+    }
+
+    if (hdr->flags & RU_SNAPSHOT) {
+        reset_nbr_dv(ns);
+        ns->rcv_synced = 1;
+        // 快照的其余部分在RU_MORE的报文中, recompute_all()在最后一个报文之后才进行
+        answer_query(ns);
+    } else if (!ns->rcv_synced || hdr->seq != ns->rcv_seq + 1) {
+        // 丢失了增量更新, 丢弃之后的增量直到收到快照. 请求的快照也可能丢失, 所以之后每收到一个保活报文再请求一次
+        if (ns->rcv_synced || hdr->nr_entries == 0) {
+            warn("route update from %d lost (seq %u, expecting %u)", nbr_id, hdr->seq, ns->rcv_seq + 1);
+            ns->rcv_synced = 0;
+            ns->snd_request = 1;
+            request_update();
+        }
+        ns->rcv_seq = hdr->seq;
+        pthread_mutex_unlock(dv_mutex);
+        return;
+    }
+    ns->rcv_seq = hdr->seq;
+
+    // 第一次出现的目的节点在这里分配下标, 之后的计算只访问数组
+    for (int j = 0; j < hdr->nr_entries; j++) {
+        if (ent[j].nodeID != this_id && ent[j].nodeID != nbr_id) {
+            unsigned int cost = ent[j].cost < INFINITE_COST ? ent[j].cost : INFINITE_COST;
+            dvtable_setcost(&ns->dv, nodeindex_intern(nodeidx, ent[j].nodeID), cost);
         }
-        nbr_dv++;
+    }
+    if (!(hdr->flags & RU_MORE)) {
+        recompute_all();
     }
     pthread_mutex_unlock(dv_mutex);
 }
 
+//这个函数把来自节点src_id的段交给使用其目的端口的本地STCP进程, len是seg所在缓冲区中有效的字节数.
+//没有STCP进程登记这个端口时丢弃该段. 段来自远程节点, 首部中的长度不可信, 超出len时也丢弃,
+//否则不但会读到缓冲区之外, STCP进程也会因为消息不合法而认为与SIP的连接已经断开.
+static void deliver_to_stcp(int src_id, seg_t *seg, unsigned int len)
+{
+    if (len < sizeof(seg->header) || seg->header.length > MAX_SEG_LEN ||
+            sizeof(seg->header) + seg->header.length > len) {
+        warn("malformed segment from %d dropped", src_id);
+        return;
+    }
+
+    // 连接在临界区结束之前不会被关闭, 发送时不需要持有端口表的锁
+    epoch_enter();
+    pthread_rwlock_rdlock(&porttable_lock);
+    int conn = porttable_getconn(porttable, seg->header.dest_port);
+    pthread_rwlock_unlock(&porttable_lock);
+    if (conn == -1) {
+        warn("no STCP process on port %u, segment from %d dropped", seg->header.dest_port, src_id);
+    } else if (forwardsegToSTCP(conn, src_id, seg) > 0) {
+        log("forward to stcp successfully");
+    } else {
+        warn("forwarding to stcp failed, segment from %d dropped", src_id);
+    }
+    epoch_exit();
+    epoch_poll();
+}
+
+//这个函数关闭与一个已经断开的STCP进程之间的连接, 由epoch_retire()在没有线程还在向它转发段时调用.
+static void close_stcp_conn(void *arg)
+{
+    int conn = (intptr_t)arg;
+    shmchan_detach(conn);
+    close(conn);
+}
+
 //这个线程处理来自SON进程的进入报文. 它通过调用son_recvpkt()接收来自SON进程的报文.
 //如果报文是SIP报文,并且目的节点就是本节点,就转发报文给STCP进程. 如果目的节点不是本节点,
 //就根据路由表转发报文给下一跳.如果报文是路由更新报文,就更新距离矢量表和路由表.
@@ -190,27 +560,15 @@ void *pkthandler(void *arg)
         if (pkt.header.type == ROUTE_UPDATE) {
             log("route update!");
             Assert(pkt.header.dest_nodeID == 0, "unexpected");
-            for (int i = 0; i < nr_nbrs; i++) {
-                if (nct[i].nodeID == pkt.header.src_nodeID) {
-                    log("%d is alive", nct[i].nodeID);
-                    nct[i].is_updated = 1;
-                }
-            }
             update_dv(&pkt);
         }
         else if (topology_getMyNodeID() == pkt.header.dest_nodeID) {  // TODO save my id
             log("recv segment from %d", pkt.header.src_nodeID);
             // 转发给 STCP 不检查返回值是因为可以允许连续若干个 STCP 用例，所以中途断开可以被容忍。
-            if (forwardsegToSTCP(stcp_conn, pkt.header.src_nodeID, (void *)&pkt.data) > 0) {
-                log("forward to stcp successfully");
-            } else {
-                warn("forwarding to stcp failed");
-            }
+            deliver_to_stcp(pkt.header.src_nodeID, (void *)&pkt.data, pkt.header.length);
         }
         else {
-            pthread_mutex_lock(routingtable_mutex);
             int next_id = routingtable_getnextnode(routingtable, pkt.header.dest_nodeID);
-            pthread_mutex_unlock(routingtable_mutex);
             log("forward: seg(%d -> %d) next hop %d", pkt.header.src_nodeID, pkt.header.dest_nodeID, next_id);
             if (son_sendpkt(next_id, &pkt, son_conn) < 0) {
                 break; // 不可接受 SON 的异常
@@ -234,10 +592,80 @@ void sip_stop(int unused)
     exit(0);
 }
 
+//每个stcp_handler线程服务一个本地STCP进程, 参数arg是与该进程之间的连接.
+//它持续接收STCP进程发来的sendseg_arg_t: 控制消息用于登记和注销端口; 发往本节点的段直接交给本地使用目的端口的STCP进程;
+//其余的段被封装进报文, 按路由表发送到下一跳. STCP进程断开连接时, 它登记的所有端口被删除.
+static void *stcp_handler(void *arg)
+{
+    int conn = (intptr_t)arg;
+    int this_id = topology_getMyNodeID();
+
+    // 由STCP进程决定是否使用共享内存, 之后seg.c中的收发函数会自动选择传输方式
+    shmchan_t *chan;
+    if (shmchan_answer(conn, sizeof(sendseg_arg_t), &chan) == -1) {
+        warn("handshake with STCP failed");
+        close(conn);
+        return NULL;
+    }
+    log("unix domain for sip-stcp %d established%s", conn, chan ? " with shared memory" : "");
+
+    int dst_id;
+    sip_pkt_t pkt;
+    seg_t *segptr = (void *)pkt.data;  // 直接往 data 段里写，减少一次结构体拷贝
+    while (getsegToSend(conn, &dst_id, segptr) > 0) {
+        if (dst_id == SIP_CTRL_REGPORT) {
+            pthread_rwlock_wrlock(&porttable_lock);
+            int ret = porttable_register(porttable, segptr->header.src_port, conn);
+            pthread_rwlock_unlock(&porttable_lock);
+            if (ret == -1) {
+                warn("port %u is already used by another STCP process", segptr->header.src_port);
+            } else {
+                log("port %u registered by stcp %d", segptr->header.src_port, conn);
+            }
+            continue;
+        } else if (dst_id == SIP_CTRL_UNREGPORT) {
+            pthread_rwlock_wrlock(&porttable_lock);
+            porttable_unregister(porttable, segptr->header.src_port, conn);
+            pthread_rwlock_unlock(&porttable_lock);
+            log("port %u unregistered by stcp %d", segptr->header.src_port, conn);
+            continue;
+        } else if (dst_id == this_id) {
+            // 同一节点上的两个 STCP 进程之间的段不经过重叠网络
+            deliver_to_stcp(this_id, segptr, sizeof(segptr->header) + segptr->header.length);
+            continue;
+        }
+
+        // 初始路由, 不加锁, 不会被路由更新阻塞
+        int next_id = routingtable_getnextnode(routingtable, dst_id);
+        if (next_id != -1) {
+            log("stcp segment to %d, forwarding to %d", dst_id, next_id);
+            // 准备网络层协议头，按有效数据长度标记长度并拷贝数据
+            pkt.header.dest_nodeID = dst_id;
+            pkt.header.src_nodeID = this_id;
+            pkt.header.length = sizeof(segptr->header) + segptr->header.length;
+            pkt.header.type = SIP;
+            if (son_sendpkt(next_id, &pkt, son_conn) < 0) {
+                warn("fail to send pkt to SON");
+            }
+            else {
+                log("send pkt successfully");
+            }
+        }
+        else {
+            warn("refuse to route unroutable dest %d", dst_id);
+        }
+    }
+
+    log("STCP process %d disconnected", conn);
+    pthread_rwlock_wrlock(&porttable_lock);
+    porttable_remove_conn(porttable, conn);
+    pthread_rwlock_unlock(&porttable_lock);
+    epoch_retire((void *)(intptr_t)conn, close_stcp_conn);
+    return NULL;
+}
+
 //这个函数打开端口SIP_PORT并等待来自本地STCP进程的TCP连接.
-//在连接建立后, 这个函数从STCP进程处持续接收包含段及其目的节点ID的sendseg_arg_t.
-//接收的段被封装进数据报(一个段在一个数据报中), 然后使用son_sendpkt发送该报文到下一跳. 下一跳节点ID提取自路由表.
-//当本地STCP进程断开连接时, 这个函数等待下一个STCP进程的连接.
+//可以同时有多个STCP进程连接, 每个连接建立后都启动一个stcp_handler线程为其服务.
 static void waitSTCP()
 {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -257,71 +685,74 @@ static void waitSTCP()
         perror(NULL);
     }
 
-    // 无限循环以接受任意多次 STCP 连接，但是一次只支持一个。
+    // 无限循环以接受任意多次 STCP 连接, 每个 STCP 进程由自己的 stcp_handler 线程服务.
     // 本函数位于 main 的末尾，所以程序不会从这里退出，只能通过 SIGINT 退出
     for (;;) {
-        stcp_conn = accept(fd, NULL, NULL);
-        if (stcp_conn == -1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn == -1) {
             perror(NULL);
             continue;
-        } else {
-            log("unix domain for sip-stcp established");
         }
 
-        int dst_id;
-        sip_pkt_t pkt;
-        seg_t *segptr = (void *)pkt.data;  // 直接往 data 段里写，减少一次结构体拷贝
-        while (getsegToSend(stcp_conn, &dst_id, segptr) > 0) {
-            // 初始路由
-            pthread_mutex_lock(routingtable_mutex);
-            int next_id = routingtable_getnextnode(routingtable, dst_id);
-            pthread_mutex_unlock(routingtable_mutex);
-            if (next_id != -1) {
-                log("stcp segment to %d, forwarding to %d", dst_id, next_id);
-                // 准备网络层协议头，按有效数据长度标记长度并拷贝数据
-                pkt.header.dest_nodeID = dst_id;
-                pkt.header.src_nodeID = topology_getMyNodeID();
-                pkt.header.length = sizeof(segptr->header) + segptr->header.length;
-                pkt.header.type = SIP;
-                if (son_sendpkt(next_id, &pkt, son_conn) < 0) {
-                    return;  // 不可接受 SON 的异常
-                }
-                else {
-                    log("send pkt successfully");
-                }
-            }
-            else {
-                warn("refuse to route unroutable dest %d", dst_id);
-            }
-        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, stcp_handler, (void *)(intptr_t)conn);
+        pthread_detach(tid);
     }
 }
 
 int main(int argc, char *argv[])
 {
+    int opt;
+    int transport = SHMCHAN_SOCKET;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            // 与SON进程之间的报文经过共享内存环传递
+            transport = SHMCHAN_SHM;
+            break;
+        default:
+            panic("Usage: %s [-s]", argv[0]);
+        }
+    }
+
     log("SIP layer is starting, pls wait...");
 
     //初始化全局变量
     nr_nbrs = topology_getNbrNum();
     nct = nbrcosttable_create();
-    dv = dvtable_create(nct);
+    nodeidx = nodeindex_create();
+    dv = dvtable_create(nct, nodeidx);
+    dvtable_init(&feasible_dist, dv->nodeID);
+    nbrs = calloc(nr_nbrs > 0 ? nr_nbrs : 1, sizeof(*nbrs));
+    for (int i = 0; i < nr_nbrs; i++) {
+        nbrs[i].idx = nodeindex_intern(nodeidx, nct[i].nodeID);
+        dvtable_init(&nbrs[i].dv, nct[i].nodeID);
+        reset_nbr_dv(&nbrs[i]);
+        dvtable_init(&nbrs[i].adv, dv->nodeID);
+        // 第一次更新给邻居发送快照, 并请求邻居的快照
+        nbrs[i].snd_snapshot = 1;
+        nbrs[i].snd_request = 1;
+    }
+    srand(time(NULL) ^ getpid());
+    do {
+        boot_id = rand();
+    } while (boot_id == 0);
     dv_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(dv_mutex,NULL);
-    routingtable = routingtable_create();
-    routingtable_mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(routingtable_mutex,NULL);
+    cond_init_monotonic(&dv_cond);
+    routingtable = routingtable_create(nodeidx);
     son_conn = -1;
-    stcp_conn = -1;
+    porttable = porttable_create();
 
     nbrcosttable_print(nct);
-    dvtable_print(dv);
+    dvtable_print(dv, nodeidx);
     routingtable_print(routingtable);
 
     //注册用于终止进程的信号句柄
     signal(SIGINT, sip_stop);
 
     //连接到本地SON进程
-    son_conn = connectToSON();
+    son_conn = connectToSON(transport);
     if(son_conn<0) {
         log("can't connect to SON process");
         exit(1);
@@ -345,11 +776,9 @@ int main(int argc, char *argv[])
 
     sleep(SIP_WAITTIME);
     puts("===========================");
-    pthread_mutex_lock(routingtable_mutex);
     routingtable_print(routingtable);
-    pthread_mutex_unlock(routingtable_mutex);
     pthread_mutex_lock(dv_mutex);
-    dvtable_print(dv);
+    dvtable_print(dv, nodeidx);
     pthread_mutex_unlock(dv_mutex);
     puts("===========================");
 
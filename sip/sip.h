@@ -8,7 +8,8 @@
 #define NETWORK_H
 
 //SIP进程使用这个函数连接到本地SON进程的端口SON_PORT
+//参数transport决定之后与SON进程之间的报文通过套接字(SHMCHAN_SOCKET)还是共享内存环(SHMCHAN_SHM)传递
 //成功时返回连接描述符, 否则返回-1
-int connectToSON();
+int connectToSON(int transport);
 
 #endif
@@ -22,7 +22,7 @@ nbr_entry_t *nt_create()
 
     log("%d has %d neighbors", this_id, nr_nbrs);
 
-    nbr_entry_t *table = calloc((size_t)nbrs, sizeof(*table));
+    nbr_entry_t *table = calloc((size_t)nr_nbrs, sizeof(*table));
     for (int i = 0; i < nr_nbrs; i++) {
         log("create nbr table entry for %d", nbrs[i]);
         table[i].conn = -1;
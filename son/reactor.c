@@ -0,0 +1,493 @@
+//文件名: son/reactor.c
+//
+//描述: 这个文件实现SON进程的事件驱动模式.
+//所有邻居连接, 与SIP进程的连接, 以及邻居和SIP的两个监听套接字都注册到同一个epoll实例中, 由一个线程处理.
+//读到的数据进入每个连接的pkt_rbuf_t后就地解帧; 写不完的数据进入每个连接的写队列, 待EPOLLOUT时再发出.
+//SIP进程选择共享内存时, 它的rx eventfd也注册到epoll中, 与SIP之间的套接字只用于发现SIP进程退出.
+//与SIP之间的握手同样由EPOLLIN驱动, 握手消息没有到达之前反应器不会等待.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "constants.h"
+#include "pkt.h"
+#include "shmring.h"
+#include "reactor.h"
+#include "../topology/topology.h"
+
+//每次epoll_wait()最多取回的事件数
+#define REACTOR_MAX_EVENTS 64
+
+//每个连接写队列的容量. 队列满时新的报文被丢弃, 积压再多内存占用也不会增长.
+#define REACTOR_WQUEUE_SIZE (1 << 18)
+
+enum {
+    PEER_NBR_LISTEN,
+    PEER_SIP_LISTEN,
+    PEER_SIP_HELLO,  // 已接受但还没有收到握手消息的 SIP 连接
+    PEER_NBR,
+    PEER_SIP,
+    PEER_SIP_RING,
+};
+
+/**
+ * @brief 反应器中的一个套接字
+ *
+ * 关闭后 fd 被置为 -1 并挂到 dead 链表上, 在本轮事件处理完后才释放,
+ * 因为同一批事件中可能还有引用它的项.
+ */
+typedef struct peer {
+    int kind;
+    int fd;
+    nbr_entry_t *nbr;       // 仅 PEER_NBR 使用
+    pkt_rbuf_t *rb;         // 读缓冲区, 监听套接字没有
+    char *wq;               // 写队列, 第一次需要排队时才分配
+    size_t wq_head;         // 写队列中第一个未发出的字节
+    size_t wq_tail;         // 写队列中数据的末尾
+    shmchan_t *chan;        // PEER_SIP 和 PEER_SIP_RING 使用, SIP 进程选择了共享内存时不为 NULL
+    struct peer *ring;      // 仅 PEER_SIP 使用, 指向注册 rx eventfd 的 PEER_SIP_RING
+    struct peer *next_dead;
+} peer_t;
+
+static int epfd;
+static nbr_entry_t *nt;
+static int nr_nbrs;
+static peer_t **nbr_peers;  // 与 nt 一一对应, 未连接的邻居为 NULL
+static peer_t *sip_peer;    // 同一时间只接受一个 SIP 进程
+static peer_t *dead_peers;
+
+static peer_t *peer_open(int kind, int fd, nbr_entry_t *nbr)
+{
+    peer_t *peer = calloc(1, sizeof(*peer));
+    peer->kind = kind;
+    peer->fd = fd;
+    peer->nbr = nbr;
+
+    if (kind == PEER_NBR || kind == PEER_SIP) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        peer->rb = malloc(sizeof(*peer->rb));
+        pkt_rbuf_init(peer->rb, fd);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = peer };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        sys_panic("epoll_ctl");
+    }
+    return peer;
+}
+
+static void peer_bury(peer_t *peer)
+{
+    peer->fd = -1;
+    peer->next_dead = dead_peers;
+    dead_peers = peer;
+}
+
+static void peer_close(peer_t *peer)
+{
+    if (peer->kind == PEER_NBR) {
+        log("Exit listener on %d", peer->nbr->nodeID);
+        nbr_peers[peer->nbr - nt] = NULL;
+        peer->nbr->conn = -1;
+    } else if (peer->kind == PEER_SIP) {
+        log("SIP process disconnected");
+        sip_peer = NULL;
+        if (peer->ring) {
+            // eventfd 由 shmchan_detach() 关闭
+            epoll_ctl(epfd, EPOLL_CTL_DEL, peer->ring->fd, NULL);
+            peer_bury(peer->ring);
+            shmchan_detach(peer->fd);
+        }
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, peer->fd, NULL);
+    close(peer->fd);
+    peer_bury(peer);
+}
+
+static void release_dead_peers()
+{
+    while (dead_peers) {
+        peer_t *peer = dead_peers;
+        dead_peers = peer->next_dead;
+        free(peer->rb);
+        free(peer->wq);
+        free(peer);
+    }
+}
+
+/**
+ * @brief 根据写队列是否为空决定是否关注 EPOLLOUT
+ */
+static void peer_watch(peer_t *peer)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | (peer->wq_tail > peer->wq_head ? EPOLLOUT : 0),
+        .data.ptr = peer,
+    };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, peer->fd, &ev);
+}
+
+/**
+ * @brief 向一个连接发送 iov 描述的一个完整消息
+ * @return 已发出或已排队返回 0, 写队列已满而丢弃或连接已断开返回 -1
+ *
+ * 写队列为空时直接尝试写, 写不完的部分进入写队列.
+ * 写队列非空时必须排在队列之后, 以保持消息顺序.
+ */
+static int peer_send(peer_t *peer, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    size_t sent = 0;
+    int was_empty = peer->wq_tail == peer->wq_head;
+    if (was_empty) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(peer->fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("sendmsg");
+                peer_close(peer);
+                return -1;
+            }
+            n = 0;
+        }
+        sent = n;
+        if (sent == total) {
+            return 0;
+        }
+        peer->wq_head = peer->wq_tail = 0;
+    }
+
+    size_t rest = total - sent;
+    if (peer->wq == NULL) {
+        peer->wq = malloc(REACTOR_WQUEUE_SIZE);
+    }
+    if (peer->wq_tail + rest > REACTOR_WQUEUE_SIZE && peer->wq_head > 0) {
+        memmove(peer->wq, peer->wq + peer->wq_head, peer->wq_tail - peer->wq_head);
+        peer->wq_tail -= peer->wq_head;
+        peer->wq_head = 0;
+    }
+    if (peer->wq_tail + rest > REACTOR_WQUEUE_SIZE) {
+        // 只有队列非空时才会走到这里, 此时这个消息一个字节都还没有发出, 可以整个丢弃
+        warn("write queue of fd %d is full, %zu bytes dropped", peer->fd, total);
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(peer->wq + peer->wq_tail, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        peer->wq_tail += iov[i].iov_len - sent;
+        sent = 0;
+    }
+
+    if (was_empty) {
+        peer_watch(peer);
+    }
+    return 0;
+}
+
+static void peer_flush(peer_t *peer)
+{
+    ssize_t n = send(peer->fd, peer->wq + peer->wq_head, peer->wq_tail - peer->wq_head, MSG_NOSIGNAL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("send");
+            peer_close(peer);
+        }
+        return;
+    }
+    peer->wq_head += n;
+    if (peer->wq_head == peer->wq_tail) {
+        peer->wq_head = peer->wq_tail = 0;
+        peer_watch(peer);
+    }
+}
+
+/**
+ * @brief 读一次连接上的数据
+ * @return 连接仍然可用返回 1, 连接已关闭返回 0
+ */
+static int peer_fill(peer_t *peer)
+{
+    int n = pkt_rbuf_fill(peer->rb);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    } else if (n <= 0) {
+        if (n == -1) {
+            perror("readv");
+        }
+        peer_close(peer);
+        return 0;
+    }
+    return 1;
+}
+
+static void send_to_nbr(int i, sip_pkt_t *pkt)
+{
+    struct iovec iov[PKT_IOV_MAX];
+    if (peer_send(nbr_peers[i], iov, pkt_frame_iov(pkt, iov)) == 0) {
+        log("send to %d successfully", nt[i].nodeID);
+    } else {
+        log("send to %d failed", nt[i].nodeID);
+    }
+}
+
+static void on_nbr_readable(peer_t *peer)
+{
+    if (!peer_fill(peer)) {
+        return;
+    }
+
+    sip_pkt_t pkt;
+    while (pkt_rbuf_decode(peer->rb, &pkt)) {
+        log("Received a pkt from %d", pkt.header.src_nodeID);
+        if (sip_peer == NULL) {
+            warn("SIP process is not connected, pkt from %d dropped", pkt.header.src_nodeID);
+            continue;
+        }
+        struct iovec iov[PKT_IOV_MAX];
+        int cnt = pkt_tosip_iov(&pkt, iov);
+        // 环满时同写队列满一样丢弃报文, 不能阻塞反应器
+        if ((sip_peer->chan ? shmchan_trysend(sip_peer->chan, iov, cnt) : peer_send(sip_peer, iov, cnt)) == -1) {
+            warn("Forwarding to SIP failed");
+        }
+    }
+}
+
+/**
+ * @brief 将 SIP 进程交来的报文发往下一跳
+ */
+static void dispatch_from_sip(sip_pkt_t *pkt, int next_node)
+{
+    if (next_node == BROADCAST_NODEID) {
+        log("Received a broadcast");
+        int this_id = topology_getMyNodeID();
+        for (int i = 0; i < nr_nbrs; i++) {
+            if (nbr_peers[i] && nt[i].nodeID != this_id) {
+                send_to_nbr(i, pkt);
+            }
+        }
+    } else {
+        int i;
+        for (i = 0; i < nr_nbrs; i++) {
+            if (next_node == nt[i].nodeID && nbr_peers[i]) {
+                send_to_nbr(i, pkt);
+                break;
+            }
+        }
+        if (i == nr_nbrs) {
+            log("no nbr %d found", next_node);
+        }
+    }
+}
+
+static void on_sip_readable(peer_t *peer)
+{
+    if (!peer_fill(peer)) {
+        return;
+    }
+
+    sip_pkt_t pkt;
+    int next_node;
+    int ret;
+    while ((ret = pkt_rbuf_decode_tosend(peer->rb, &pkt, &next_node)) == 1) {
+        dispatch_from_sip(&pkt, next_node);
+    }
+    if (ret == -1) {
+        peer_close(peer);
+    }
+}
+
+/**
+ * @brief 取空 SIP 进程的共享内存环
+ *
+ * 收到不合法的消息时断开与 SIP 进程的连接, 此后 peer 和它的通道都不能再使用.
+ */
+static void on_sip_ring(peer_t *peer)
+{
+    shmchan_clear(peer->chan);
+
+    sip_pkt_t pkt;
+    int next_node;
+    struct iovec iov[PKT_IOV_MAX];
+    pkt.header.length = MAX_PKT_LEN;
+    int cnt = pkt_tosend_iov(&next_node, &pkt, iov);
+    const int fixed_len = sizeof(next_node) + sizeof(pkt.header);
+    int len;
+    while ((len = shmchan_tryrecv(peer->chan, iov, cnt)) > 0) {
+        if (len < fixed_len || pkt.header.length > MAX_PKT_LEN || len != fixed_len + pkt.header.length) {
+            // 与 SIP 进程之间是可靠的本地通道, 出现这种情况说明两边的程序版本不一致
+            warn("invalid message of %d bytes from SIP", len);
+            peer_close(sip_peer);
+            return;
+        }
+        dispatch_from_sip(&pkt, next_node);
+    }
+}
+
+static void on_nbr_accept(peer_t *listener)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int conn = accept(listener->fd, (struct sockaddr *)&addr, &len);
+    if (conn == -1) {
+        perror("Cannot connect to the neighbor");
+        return;
+    }
+
+    int id = topology_getNodeIDfromip(&addr.sin_addr);
+    for (int i = 0; i < nr_nbrs; i++) {
+        if (nt[i].nodeID == id) {
+            if (nbr_peers[i]) {
+                warn("%d reconnects, the old connection is dropped", id);
+                peer_close(nbr_peers[i]);
+            }
+            log("%d is connected to %d", topology_getMyNodeID(), id);
+            nt[i].conn = conn;
+            nbr_peers[i] = peer_open(PEER_NBR, conn, &nt[i]);
+            return;
+        }
+    }
+
+    warn("refuse the connection from %d which is not a neighbor", id);
+    close(conn);
+}
+
+static void on_sip_accept(peer_t *listener)
+{
+    int conn = accept(listener->fd, NULL, NULL);
+    if (conn == -1) {
+        perror(NULL);
+        return;
+    }
+    if (sip_peer) {
+        warn("a SIP process is already connected");
+        close(conn);
+        return;
+    }
+    // SIP 进程在连接后立即发送握手消息, 到达时由 on_sip_hello() 处理
+    peer_open(PEER_SIP_HELLO, conn, NULL);
+}
+
+static void on_sip_hello(peer_t *peer)
+{
+    if (sip_peer) {
+        // 多个 SIP 进程同时连接时, 先完成握手的被接受
+        warn("a SIP process is already connected");
+        peer_close(peer);
+        return;
+    }
+
+    shmchan_t *chan;
+    int ret = shmchan_tryanswer(peer->fd, sizeof(sendpkt_arg_t), &chan);
+    if (ret == 1) {
+        return;
+    } else if (ret == -1) {
+        warn("handshake with SIP failed");
+        peer_close(peer);
+        return;
+    }
+
+    // 套接字转交给新的 PEER_SIP, 这里只释放 peer 本身
+    int conn = peer->fd;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn, NULL);
+    peer_bury(peer);
+    sip_peer = peer_open(PEER_SIP, conn, NULL);
+    if (chan) {
+        sip_peer->chan = chan;
+        sip_peer->ring = peer_open(PEER_SIP_RING, chan->rx_efd, NULL);
+        sip_peer->ring->chan = chan;
+    }
+    log("unix domain established%s", chan ? " with shared memory" : "");
+    if (chan) {
+        // 握手之后到注册 eventfd 之前放入环中的报文不会产生新的事件
+        on_sip_ring(sip_peer->ring);
+    }
+}
+
+void son_reactor(nbr_entry_t *table, int n, int nbr_listen, int sip_listen)
+{
+    nt = table;
+    nr_nbrs = n;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        sys_panic("epoll_create1");
+    }
+
+    peer_open(PEER_NBR_LISTEN, nbr_listen, NULL);
+    peer_open(PEER_SIP_LISTEN, sip_listen, NULL);
+    nbr_peers = calloc((size_t)nr_nbrs, sizeof(*nbr_peers));
+    for (int i = 0; i < nr_nbrs; i++) {
+        if (nt[i].conn != -1) {
+            nbr_peers[i] = peer_open(PEER_NBR, nt[i].conn, &nt[i]);
+        }
+    }
+    log("reactor started");
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    for (;;) {
+        int nr_events = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (nr_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sys_panic("epoll_wait");
+        }
+
+        for (int i = 0; i < nr_events; i++) {
+            peer_t *peer = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (peer->fd == -1) {
+                continue;  // 已在本轮中关闭
+            }
+            switch (peer->kind) {
+            case PEER_NBR_LISTEN:
+                on_nbr_accept(peer);
+                break;
+            case PEER_SIP_LISTEN:
+                on_sip_accept(peer);
+                break;
+            case PEER_SIP_HELLO:
+                on_sip_hello(peer);
+                break;
+            case PEER_SIP_RING:
+                on_sip_ring(peer);
+                break;
+            case PEER_NBR:
+            case PEER_SIP:
+                if (ev & EPOLLOUT) {
+                    peer_flush(peer);
+                }
+                if (peer->fd != -1 && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    if (peer->kind == PEER_NBR) {
+                        on_nbr_readable(peer);
+                    } else {
+                        if (peer->ring) {
+                            on_sip_ring(peer->ring);  // SIP 进程退出前放入环中的报文
+                        }
+                        if (peer->fd != -1) {
+                            on_sip_readable(peer);
+                        }
+                    }
+                }
+                break;
+            }
+        }
+
+        release_dead_peers();
+    }
+}
@@ -0,0 +1,18 @@
+//文件名: son/reactor.h
+//
+//描述: 这个文件声明SON进程的事件驱动模式.
+//在这种模式下, 一个epoll反应器在单个线程中处理所有邻居连接, 与SIP进程之间的连接以及两个监听套接字,
+//代替每个邻居一个listen_to_neighbor线程, 再加上阻塞在getpktToSend()上的主线程的线程模型.
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "neighbortable.h"
+
+// 这个函数运行SON进程的epoll反应器, 不会返回.
+// 参数nt是邻居表, 其中已经建立的连接(conn不为-1)会被加入反应器, 其余邻居的连接由反应器在nbr_listen上接受.
+// 参数nbr_listen和sip_listen分别是son_listen_nbrs()和son_listen_sip()返回的监听套接字.
+// 所有连接都被设置为非阻塞, 不能立即写出的数据进入该连接自己的写队列, 在连接可写时发出.
+void son_reactor(nbr_entry_t* nt, int nr_nbrs, int nbr_listen, int sip_listen);
+
+#endif
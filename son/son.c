@@ -19,7 +19,9 @@
 #include "common.h"
 #include "constants.h"
 #include "pkt.h"
+#include "shmring.h"
 #include "son.h"
+#include "reactor.h"
 #include "../topology/topology.h"
 
 //你应该在这个时间段内启动所有重叠网络节点上的SON进程
@@ -42,14 +44,14 @@ int sip_conn;
 //实现重叠网络函数
 /**************************************************************/
 
-// 这个线程打开TCP端口CONNECTION_PORT, 等待节点ID比自己大的所有邻居的进入连接,
-// 在所有进入连接都建立后, 这个线程终止.
-void *waitNbrs(void *arg)
+// 这个函数打开TCP端口CONNECTION_PORT并开始监听来自邻居的进入连接.
+// 返回监听套接字, 失败时返回-1.
+int son_listen_nbrs()
 {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         perror("Cannot open socket");
-        pthread_exit(NULL);
+        return -1;
     }
 
     struct sockaddr_in sockaddr_in;
@@ -61,15 +63,29 @@ void *waitNbrs(void *arg)
     int enable = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1) {
         perror("setsockopt SO_REUSEADDR");
-        pthread_exit(NULL);
+        close(fd);
+        return -1;
     }
 
     if (bind(fd, (struct sockaddr *)&sockaddr_in, sizeof(sockaddr_in))) {
         perror("Cannot bind");
-        pthread_exit(NULL);
+        close(fd);
+        return -1;
     }
 
     listen(fd, 5);
+    return fd;
+}
+
+// 这个线程打开TCP端口CONNECTION_PORT, 等待节点ID比自己大的所有邻居的进入连接,
+// 在所有进入连接都建立后, 这个线程终止.
+void *waitNbrs(void *arg)
+{
+    int fd = son_listen_nbrs();
+    if (fd < 0) {
+        pthread_exit(NULL);
+    }
+    struct sockaddr_in sockaddr_in;
 
     nbr_entry_t *nbrs = arg;
     int nr_nbrs = topology_getNbrNum();
@@ -154,20 +170,18 @@ void *listen_to_neighbor(void *arg)
 
     log("Listening on %d", nbr->nodeID);
 
+    // 接收缓冲区较大, 不放在线程栈上
+    pkt_rbuf_t *rb = malloc(sizeof(*rb));
+    pkt_rbuf_init(rb, nbr->conn);
+
     sip_pkt_t sip_pkt;
-    for (;;) {
-        int ret = recvpkt(&sip_pkt, nbr->conn);
-        if (ret == -2) {
-            break;
-        } else if (ret != -1) {
-            log("Received a pkt from %d", sip_pkt.header.src_nodeID);
-            if (forwardpktToSIP(&sip_pkt, sip_conn) == -1) {
-                warn("Forwarding to SIP failed");
-            }
-        } else {
-            warn("pkt damage? check semantic collision with the markup!");
+    while (recvpkt(&sip_pkt, rb) > 0) {
+        log("Received a pkt from %d", sip_pkt.header.src_nodeID);
+        if (forwardpktToSIP(&sip_pkt, sip_conn) == -1) {
+            warn("Forwarding to SIP failed");
         }
     }
+    free(rb);
 
     log("Exit listener on %d", nbr->nodeID);
 
@@ -180,10 +194,9 @@ void *listen_to_neighbor(void *arg)
     return NULL;
 }
 
-//这个函数打开TCP端口SON_PORT, 等待来自本地SIP进程的进入连接.
-//在本地SIP进程连接之后, 这个函数持续接收来自SIP进程的sendpkt_arg_t结构, 并将报文发送到重叠网络中的下一跳.
-//如果下一跳的节点ID为BROADCAST_NODEID, 报文应发送到所有邻居节点.
-void waitSIP()
+//这个函数在UNIX_PATH上打开unix domain套接字并开始监听来自本地SIP进程的连接.
+//返回监听套接字.
+int son_listen_sip()
 {
     int unix_socket = socket(AF_UNIX, SOCK_STREAM, 0);
     if (unix_socket == -1) {
@@ -201,11 +214,29 @@ void waitSIP()
     if (listen(unix_socket, 5) == -1) {
         perror(NULL);
     }
-    if ((sip_conn = accept(unix_socket, NULL, NULL)) == -1) {
+    return unix_socket;
+}
+
+//这个函数打开TCP端口SON_PORT, 等待来自本地SIP进程的进入连接.
+//在本地SIP进程连接之后, 这个函数持续接收来自SIP进程的sendpkt_arg_t结构, 并将报文发送到重叠网络中的下一跳.
+//如果下一跳的节点ID为BROADCAST_NODEID, 报文应发送到所有邻居节点.
+void waitSIP()
+{
+    int unix_socket = son_listen_sip();
+    int conn = accept(unix_socket, NULL, NULL);
+    if (conn == -1) {
         perror(NULL);
     }
 
-    log("unix domain established");
+    // 由SIP进程决定是否使用共享内存, 之后pkt.c中的收发函数会自动选择传输方式
+    shmchan_t *chan;
+    if (shmchan_answer(conn, sizeof(sendpkt_arg_t), &chan) == -1) {
+        warn("handshake with SIP failed");
+    }
+    // 握手完成之后才公开连接, 否则邻居线程可能在通道建立之前就把报文写到套接字上
+    sip_conn = conn;
+
+    log("unix domain established%s", chan ? " with shared memory" : "");
 }
 
 //这个函数停止重叠网络, 当接收到信号SIGINT时, 该函数被调用.
@@ -214,7 +245,7 @@ void son_stop(int unused)
 {
     int nr_nbrs = topology_getNbrNum();
     nt_destroy(nt);
-    for (int i = 0; i < nr_nbrs; i++) {
+    for (int i = 0; tids && i < nr_nbrs; i++) {
         pthread_join(tids[i], NULL);
     }
     free(nt);
@@ -222,8 +253,25 @@ void son_stop(int unused)
     exit(1);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    int opt;
+    int use_reactor = 0;
+    while ((opt = getopt(argc, argv, "el")) != -1) {
+        switch (opt) {
+        case 'e':
+            // 用单线程的 epoll 反应器代替每个邻居一个 listen_to_neighbor 线程
+            use_reactor = 1;
+            break;
+        case 'l':
+            // 与仍使用 '!&...!#' 分隔符帧格式的旧节点互通
+            pkt_set_framing(PKT_FRAMING_DELIM);
+            break;
+        default:
+            panic("Usage: %s [-e] [-l]", argv[0]);
+        }
+    }
+
     //启动重叠网络初始化工作
     log("Overlay network: Node %d initializing...", topology_getMyNodeID());
 
@@ -238,6 +286,18 @@ int main()
         log("Overlay network: neighbor %d:%d", i + 1, nt[i].nodeID);
     }
 
+    if (use_reactor) {
+        // 先开始监听, 节点ID比自己大的邻居的连接由反应器接受
+        int nbr_listen = son_listen_nbrs();
+        if (nbr_listen < 0) {
+            exit(EXIT_FAILURE);
+        }
+        connectNbrs();
+        signal(SIGINT, son_stop);
+        log("Overlay network: waiting for connection from SIP process...");
+        son_reactor(nt, nbrNum, nbr_listen, son_listen_sip());
+    }
+
     //启动waitNbrs线程, 等待节点ID比自己大的所有邻居的进入连接
     pthread_t waitNbrs_thread;
     pthread_create(&waitNbrs_thread, NULL, waitNbrs, nt);
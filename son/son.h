@@ -10,6 +10,10 @@
 #include "../common/pkt.h"
 #include "neighbortable.h"
 
+// 这个函数打开TCP端口CONNECTION_PORT并开始监听来自邻居的进入连接.
+// 返回监听套接字, 失败时返回-1.
+int son_listen_nbrs();
+
 // 这个线程打开TCP端口CONNECTION_PORT, 等待节点ID比自己大的所有邻居的进入连接,
 // 在所有进入连接都建立后, 这个线程终止.
 void* waitNbrs(void* arg);
@@ -18,6 +22,10 @@ void* waitNbrs(void* arg);
 // 在所有外出连接都建立后, 返回1, 否则返回-1.
 int connectNbrs();
 
+//这个函数在UNIX_PATH上打开unix domain套接字并开始监听来自本地SIP进程的连接.
+//返回监听套接字.
+int son_listen_sip();
+
 //这个函数打开TCP端口SON_PORT, 等待来自本地SIP进程的进入连接.
 //在本地SIP进程连接之后, 这个函数持续接收来自SIP进程的sendpkt_arg_t结构, 并将报文发送到重叠网络中的下一跳.
 //如果下一跳的节点ID为BROADCAST_NODEID, 报文应发送到所有邻居节点.